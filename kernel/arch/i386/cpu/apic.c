@@ -12,18 +12,23 @@
 #include <arch/memlayout.h>
 #include <arch/mpt.h>
 #include <arch/pit.h>
+#include <arch/time.h>
 #include <arch/cpu/apic.h>
 #include <arch/cpu/apic_types.h>
 #include <arch/kernel/portio.h>
 
 /* TODO: Separate IOAPIC code from this file. */
 
-/* kernel/ticks.h export */
-atomic_uint_fast64_t current_ticks;
+/* kernel/ticks.h export. Read all over the kernel and written on every tick, so it gets a line of its
+   own. */
+atomic_uint_fast64_t current_ticks __cacheline_exclusive;
 
 volatile lapic_reg_t *lapic = NULL;
-static uint32_t calibrated_ticr = 0;
 static uint64_t bus_freq = 0;
+static uint64_t tsc_freq = 0;
+
+/* Does the LAPIC timer support the TSC-deadline mode? Otherwise it counts down one-shot. */
+static bool tsc_deadline = false;
 
 /* Write to LAPIC's register and synchronize on read. */
 #define lapicw(reg, val)	\
@@ -39,9 +44,8 @@ static void isr_timer_calibration(__unused struct isr_frame *frame)
 
 static void isr_timer(__unused struct isr_frame *frame)
 {
-	/* Increment the ticks count on the boot CPU. */
-	if (is_boot_cpu())
-		ticks_increment();
+	/* The generic interrupt handler only runs the scheduler tick if one was due. */
+	cpu_current()->timer_tick = timer_interrupt();
 	lapic_eoi();
 }
 
@@ -59,7 +63,8 @@ static void isr_error(__unused struct isr_frame *frame)
 
 static void lapic_calibrate_timer_with_pit(void)
 {
-	uint64_t count;
+	uint64_t count, tsc_start, tsc_end;
+	uint32_t eax, ebx, ecx, edx;
 
 	/* We need interrupts to be off. */
 	if (cpu_get_eflags() & EFLAGS_IF)
@@ -83,10 +88,12 @@ static void lapic_calibrate_timer_with_pit(void)
 	pit_prepare_counter(10000);
 	/* Start the countdown in PIT. */
 	pit_start_counter();
-	/* Start the LAPIC timer. */
+	/* Start the LAPIC timer. The TSC is measured over the same period. */
 	lapicw(LAPIC_REG_TICR, -1);
+	tsc_start = cpu_timestamp();
 	/* Wait for the countdown to finish in PIT. */
 	pit_wait_counter();
+	tsc_end = cpu_timestamp();
 	/* Stop the LAPIC timer. */
 	lapicw(LAPIC_REG_TIMER, LAPIC_MASKED);
 
@@ -99,19 +106,37 @@ static void lapic_calibrate_timer_with_pit(void)
 	/* We used a divisor of 16, so shift the result left by 16. We also waited for 1/100 of a second
 	   so multiply by 100. We now have the bus frequency in Hz. */
 	bus_freq = (count << 4) * 100;
-	/* Calculate the TICR we need to tick with the frequency of TICKS_PER_SECOND. */
-	calibrated_ticr = (bus_freq / TICKS_PER_SECOND) >> 4;
+	tsc_freq = (tsc_end - tsc_start) * 100;
 
 	pit_release();
 
+	cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+	tsc_deadline = (ecx & CPUID_FEATURES_ECX_TSC_DEADLINE) != 0;
+
 	kdprintf("LAPIC bus frequency: %u\n", (uint32_t)bus_freq);
+	kdprintf("TSC frequency: %u, TSC-deadline timer: %s\n", (uint32_t)tsc_freq,
+		tsc_deadline ? "yes" : "no");
+
+	init_clocksource(tsc_freq);
 }
 
+/* Switches the timer to one-shot events. The tick is emulated with them. */
 static inline void lapic_enable_calibrated_timer(void)
 {
 	lapicw(LAPIC_REG_TDCR, LAPIC_TIMER_X16);
-	lapicw(LAPIC_REG_TIMER, LAPIC_TIMER_PERIODIC | INT_IRQ_TIMER);
-	lapicw(LAPIC_REG_TICR, calibrated_ticr);
+
+	if (tsc_deadline)
+	{
+		lapicw(LAPIC_REG_TIMER, LAPIC_TIMER_TSC_DEADLINE | INT_IRQ_TIMER);
+		/* The LVT write has to land before the deadline MSR is written. */
+		asm volatile ("mfence" : : : "memory");
+	}
+	else
+	{
+		lapicw(LAPIC_REG_TIMER, LAPIC_TIMER_ONESHOT | INT_IRQ_TIMER);
+	}
+
+	timer_start_cpu();
 }
 
 static void lapic_enable_timer(void)
@@ -130,7 +155,7 @@ static void lapic_enable_timer(void)
 	/* Use the real timer ISR now. */
 	isr_set_handler(INT_IRQ_TIMER, isr_timer);
 
-	/* Configure the timer with the calibrated TICR value. */
+	/* Start the one-shot timer events. */
 	lapic_enable_calibrated_timer();
 }
 
@@ -185,6 +210,45 @@ void init_lapic(void)
 	lapic_enable_timer();
 }
 
+/* Programs the timer of the current CPU's local APIC to fire once the TSC reaches the given
+   value. */
+void lapic_timer_arm(uint64_t tsc)
+{
+	uint64_t now, count;
+
+	if (tsc_deadline)
+	{
+		/* A deadline in the past fires right away. */
+		cpu_wrmsr(MSR_TSC_DEADLINE, tsc);
+		return;
+	}
+
+	/* Convert the TSC distance to LAPIC timer counts, which run at 1/16 of the bus frequency. */
+	now = cpu_timestamp();
+	count = tsc > now ? ((tsc - now) * (bus_freq >> 4)) / tsc_freq : 0;
+
+	if (count == 0)
+		count = 1;
+	else if (count > UINT32_MAX)
+		count = UINT32_MAX;
+
+	lapicw(LAPIC_REG_TICR, (uint32_t)count);
+}
+
+/* Stops the timer of the current CPU's local APIC. */
+void lapic_timer_stop(void)
+{
+	/* lapicw() is two statements, hence the braces. */
+	if (tsc_deadline)
+	{
+		cpu_wrmsr(MSR_TSC_DEADLINE, 0);
+	}
+	else
+	{
+		lapicw(LAPIC_REG_TICR, 0);
+	}
+}
+
 /* Get the current LAPIC ID. Can be used regardless of init_lapic() */
 lapic_id_t lapic_get_id(void)
 {
@@ -13,14 +13,14 @@
 #include <arch/cpu/gdt.h>
 #include <arch/cpu/selectors.h>
 
-#define MAX_CPUS 8
 #define BOOT_CPU 0
 
-static struct x86_cpu cpus[MAX_CPUS];
+static struct x86_cpu cpus[X86_MAX_CPUS];
 
 /* Initial CPU, when we have not enumerated CPUs yet. */
 static struct x86_cpu initial_cpu = {
 	.magic = X86_CPU_MAGIC,
+	.self = &initial_cpu,
 	.num = 0,
 	.active = false,
 	.lapic_id = 0xff,
@@ -29,12 +29,15 @@ static struct x86_cpu initial_cpu = {
 	.cli_stack = 0,
 
 	.preempt_disabled = 0,
-	.scheduler = NULL,
+	.idle = NULL,
 	.thread = NULL,
 };
 
 lapic_id_t boot_lapic_id;
 
+/* Set once init_gdt() has run on the boot CPU. */
+bool percpu_segment_ready = false;
+
 static unsigned int nof_cpus = 0;
 static atomic_uint nof_active_cpus = 0;
 
@@ -43,7 +46,7 @@ static atomic_uint nof_active_cpus = 0;
 /* Adds a CPU. */
 void cpu_add(lapic_id_t lapic_id)
 {
-	if (nof_cpus == MAX_CPUS)
+	if (nof_cpus == X86_MAX_CPUS)
 		kpanic("cpu_add(): too many CPUs");
 
 	/* We're pretty relaxed in this function for a reason... */
@@ -55,6 +58,7 @@ void cpu_add(lapic_id_t lapic_id)
 	kmemset(&cpus[nof_cpus], 0, sizeof(struct x86_cpu));
 
 	cpus[nof_cpus].magic = X86_CPU_MAGIC;
+	cpus[nof_cpus].self = &cpus[nof_cpus];
 	cpus[nof_cpus].num = nof_cpus;
 	cpus[nof_cpus].active = false;
 	cpus[nof_cpus].lapic_id = lapic_id;
@@ -65,6 +69,9 @@ void cpu_add(lapic_id_t lapic_id)
 	cpus[nof_cpus].int_enabled = false;
 	cpus[nof_cpus].cli_stack = 0;
 
+	/* All CPUs start with the kernel page directory. */
+	atomic_init(&(cpus[nof_cpus].cr3), phys_kernel_pd);
+
 	if (cpu_has_cpuid() == false)
 		kpanic("init_cpu(): CPU does not support CPUID");
 
@@ -98,8 +105,8 @@ void cpu_enumerate_other_cpus(void (*receiver)(struct x86_cpu *))
 	preempt_enable();
 }
 
-/* Gets the current CPU object. */
-struct x86_cpu *cpu_current(void)
+/* Looks the current CPU object up by the LAPIC ID. Used before the per-CPU segment is set up. */
+struct x86_cpu *cpu_lookup_current(void)
 {
 	lapic_id_t lapic_id;
 
@@ -114,7 +121,16 @@ struct x86_cpu *cpu_current(void)
 		if (verify_cpu(&cpus[i]) && cpus[i].lapic_id == lapic_id)
 			return &cpus[i];
 
-	kpanic("cpu_current(): called from an unregistered CPU");
+	kpanic("cpu_lookup_current(): called from an unregistered CPU");
+}
+
+/* Gets the CPU object with the given number. */
+struct x86_cpu *cpu_get(unsigned int num)
+{
+	if (num >= nof_cpus)
+		kpanic("cpu_get(): bad CPU number");
+
+	return &cpus[num];
 }
 
 /* Set current CPU's active flag. */
@@ -145,6 +161,21 @@ void cpu_flush_tlb(void)
 	preempt_enable();
 }
 
+/* Flush TLB on current CPU, including the global pages. */
+void cpu_flush_tlb_global(void)
+{
+	uint32_t cr4;
+
+	push_no_interrupts();
+
+	/* Toggling the global page enable bit flushes the entire TLB. */
+	asm volatile ("movl %%cr4, %0" : "=r" (cr4));
+	asm volatile ("movl %0, %%cr4" : : "r" (cr4 & ~CR4_PGE) : "memory");
+	asm volatile ("movl %0, %%cr4" : : "r" (cr4) : "memory");
+
+	pop_no_interrupts();
+}
+
 /* Set CR3 on current CPU. */
 paddr_t cpu_set_cr3(paddr_t cr3)
 {
@@ -159,6 +190,9 @@ paddr_t cpu_set_cr3(paddr_t cr3)
 	if (cr3 == prev_cr3)
 		goto _cpu_set_cr3_redundant;
 
+	/* Publish the new page directory before loading it. A CPU changing its page tables either sees
+	   it and flushes our TLB, or has made the changes before we load CR3, which flushes anyway. */
+	atomic_store(&(cpu_current()->cr3), cr3);
 	asm volatile ("movl %0, %%cr3" : : "r" (cr3) : "memory");
 
 _cpu_set_cr3_redundant:
@@ -216,7 +250,7 @@ void push_no_interrupts(void)
 	}
 
 	cpu_force_cli();
-	cpu = cpu_current();
+	cpu = cpu_current_early();
 
 	if (cpu->cli_stack == 0)
 		cpu->int_enabled = eflags & EFLAGS_IF;
@@ -241,7 +275,7 @@ void pop_no_interrupts(void)
 	if (eflags & EFLAGS_IF)
 		kpanic("pop_no_interrupts(): interrupts enabled");
 
-	cpu = cpu_current();
+	cpu = cpu_current_early();
 	cpu->cli_stack -= 1;
 
 	if (cpu->cli_stack < 0)
@@ -264,9 +298,18 @@ void preempt_disable(void)
 		return;
 	}
 
+	/* A single instruction cannot be split by a switch to another CPU, so there is no need to turn
+	   off interrupts. */
+	if (percpu_segment_ready)
+	{
+		asm volatile ("incl %%gs:%c0" : : "i" (offsetof(struct x86_cpu, preempt_disabled))
+			: "memory");
+		return;
+	}
+
 	/* Need to turn off interrupts so that we're not rescheduled during this process. */
 	push_no_interrupts();
-	cpu = cpu_current();
+	cpu = cpu_current_early();
 	cpu->preempt_disabled++;
 	pop_no_interrupts();
 }
@@ -285,9 +328,21 @@ void preempt_enable(void)
 		return;
 	}
 
+	/* Preemption is still disabled before the decrement, so we stay on the same CPU between the
+	   check and the decrement. */
+	if (percpu_segment_ready)
+	{
+		if (percpu_read(preempt_disabled) <= 0)
+			kpanic("preempt_enable(): underflow");
+
+		asm volatile ("decl %%gs:%c0" : : "i" (offsetof(struct x86_cpu, preempt_disabled))
+			: "memory");
+		return;
+	}
+
 	/* Need to turn off interrupts so that we're not rescheduled during this process. */
 	push_no_interrupts();
-	cpu = cpu_current();
+	cpu = cpu_current_early();
 	cpu->preempt_disabled--;
 
 	if (cpu->preempt_disabled < 0)
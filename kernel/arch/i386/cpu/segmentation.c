@@ -11,10 +11,14 @@
 /* Initializes the GDT for the current CPU. */
 void init_gdt(void)
 {
-	struct x86_cpu *cpu = cpu_current();
+	struct x86_cpu *cpu = cpu_lookup_current();
+	uint32_t eflags = cpu_get_eflags();
 	seg_t seg;
 
-	push_no_interrupts();
+	/* On an AP, percpu_segment_ready is already set, but %gs does not hold the segment yet. So
+	   nothing that looks up the current CPU may run until it is loaded, push_no_interrupts()
+	   included. */
+	cpu_force_cli();
 
 	/* Create the GDT. */
 	cpu->gdt[0] = gdte_construct(0, 0, 0);
@@ -34,6 +38,10 @@ void init_gdt(void)
 	seg = gdte_construct((uint32_t)&(cpu->tss), sizeof(struct tss), GDTE_TSS_FLAGS | SEG_BIT_RING(0));
 	cpu->gdt[seg_selector_to_index(KERNEL_TSS_SELECTOR)] = seg;
 
+	/* The per-CPU segment starts at the CPU object. */
+	seg = gdte_construct((uint32_t)cpu, 0xffffffff, GDTE_DATA32_FLAGS | SEG_BIT_RING(0));
+	cpu->gdt[seg_selector_to_index(KERNEL_CPU_SELECTOR)] = seg;
+
 	/* Load the GDT. */
 	cpu->gdtr.size = sizeof(cpu->gdt);
 	cpu->gdtr.offset = (vaddr32_t)(cpu->gdt);
@@ -42,16 +50,17 @@ void init_gdt(void)
 	/* Jump into the kernel code segment. */
 	asm volatile ("ljmp %0, $_with_kernel_cs; _with_kernel_cs: " : : "i" (KERNEL_CODE_SELECTOR));
 
-	/* Use the kernel data segment. */
+	/* Use the kernel data segment and the per-CPU segment. */
 	asm volatile (
 		"movl %0, %%eax\n"
 		"movl %%eax, %%ds\n"
 		"movl %%eax, %%es\n"
 		"movl %%eax, %%fs\n"
-		"movl %%eax, %%gs\n"
 		"movl %%eax, %%ss\n"
+		"movl %1, %%eax\n"
+		"movl %%eax, %%gs\n"
 		:
-		: "i" (KERNEL_DATA_SELECTOR)
+		: "i" (KERNEL_DATA_SELECTOR), "i" (KERNEL_CPU_SELECTOR)
 		: "eax"
 	);
 
@@ -62,5 +71,8 @@ void init_gdt(void)
 	   operations in user mode. */
 	cpu->tss.iopb = sizeof(struct tss);
 
-	pop_no_interrupts();
+	percpu_segment_ready = true;
+
+	if (eflags & EFLAGS_IF)
+		cpu_force_sti();
 }
@@ -12,6 +12,7 @@
 #include <arch/memlayout.h>
 #include <arch/paging.h>
 #include <arch/cpu/apic.h>
+#include <arch/cpu/smp.h>
 
 packed_struct ap_entry_args
 {
@@ -39,6 +40,129 @@ static void ipi_panic_handler(__unused struct isr_frame *frame)
 	__builtin_unreachable();
 }
 
+/* Runs the function calls queued for the current CPU. */
+static void ipi_call_function_handler(__unused struct isr_frame *frame)
+{
+	struct cpu_call *queue, *call, *next, *prev = NULL;
+
+	/* Take all the queued calls at once. Calls queued after this send a new IPI. */
+	queue = atomic_exchange(&(cpu_current()->call_queue), NULL);
+
+	/* The queue is a stack. Reverse it to run the calls in the order they were queued. */
+	while (queue)
+	{
+		next = queue->next;
+		queue->next = prev;
+		prev = queue;
+		queue = next;
+	}
+
+	for (call = prev; call; call = next)
+	{
+		/* The caller may reuse the call object as soon as it is not busy. */
+		next = call->next;
+		call->func(call->arg);
+		atomic_store(&(call->busy), false);
+	}
+
+	lapic_eoi();
+}
+
+/* Queues a call on the target CPU, using the slot of the current CPU for that target. */
+static void queue_call(struct x86_cpu *self, struct x86_cpu *target, void (*func)(void *arg),
+	void *arg)
+{
+	struct cpu_call *call = &(self->call_slots[target->num]);
+	struct cpu_call *head;
+
+	/* An asynchronous call issued earlier may still be pending. */
+	while (atomic_load(&(call->busy)))
+		cpu_relax();
+
+	call->func = func;
+	call->arg = arg;
+	atomic_store(&(call->busy), true);
+
+	head = atomic_load(&(target->call_queue));
+
+	do
+	{
+		call->next = head;
+	} while (!atomic_compare_exchange_weak(&(target->call_queue), &head, call));
+
+	/* If other calls were queued already, the IPI sent for them has not been handled yet and will
+	   run this call as well. */
+	if (head)
+		return;
+
+	/* An interrupt handler could issue another IPI between the ICR writes. */
+	push_no_interrupts();
+	lapic_ipi(target->lapic_id, INT_CALL_FUNCTION_IPI, 0);
+	lapic_ipi_wait();
+	pop_no_interrupts();
+}
+
+/* Runs func(arg) on the CPUs in the mask. The current CPU, if included, runs it directly. */
+void smp_call_function_mask(cpu_mask_t mask, void (*func)(void *arg), void *arg, bool wait)
+{
+	struct x86_cpu *self, *target;
+	cpu_mask_t queued = 0;
+
+	/* The call slots belong to the current CPU. */
+	preempt_disable();
+	self = cpu_current();
+
+	for (uint i = 0; i < get_nof_cpus(); i++)
+	{
+		target = cpu_get(i);
+
+		if ((mask & cpu_mask_bit(i)) == 0 || target == self || !atomic_load(&(target->active)))
+			continue;
+
+		queue_call(self, target, func, arg);
+		queued |= cpu_mask_bit(i);
+	}
+
+	/* Run our part while the other CPUs run theirs. */
+	if (mask & cpu_mask_bit(self->num))
+	{
+		push_no_interrupts();
+		func(arg);
+		pop_no_interrupts();
+	}
+
+	if (wait)
+	{
+		for (uint i = 0; i < get_nof_cpus(); i++)
+		{
+			if (queued & cpu_mask_bit(i))
+			{
+				while (atomic_load(&(self->call_slots[i].busy)))
+					cpu_relax();
+			}
+		}
+	}
+
+	preempt_enable();
+}
+
+/* Runs func(arg) on the CPU with the given number. */
+void smp_call_function_single(uint num, void (*func)(void *arg), void *arg, bool wait)
+{
+	smp_call_function_mask(cpu_mask_bit(num), func, arg, wait);
+}
+
+/* Runs func(arg) on all the other CPUs. */
+void smp_call_function(void (*func)(void *arg), void *arg, bool wait)
+{
+	cpu_mask_t mask;
+
+	preempt_disable();
+	mask = CPU_MASK_ALL & ~cpu_mask_bit(cpu_current()->num);
+	smp_call_function_mask(mask, func, arg, wait);
+	preempt_enable();
+}
+
 static void setup_ap(struct x86_cpu *ap)
 {
 	ap->stack_top = kalloc(HEAP_NORMAL, 16, 4096);
@@ -65,6 +189,7 @@ void init_smp(void)
 	cpu_enumerate_other_cpus(setup_ap);
 
 	isr_set_handler(INT_PANIC_IPI, ipi_panic_handler);
+	isr_set_handler(INT_CALL_FUNCTION_IPI, ipi_call_function_handler);
 }
 
 static void start_ap(struct x86_cpu *ap)
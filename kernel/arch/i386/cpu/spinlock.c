@@ -2,6 +2,7 @@
 #include <kernel/cdefs.h>
 #include <kernel/cpu.h>
 #include <kernel/debug.h>
+#include <kernel/lockstat.h>
 #include <kernel/thread.h>
 #include <arch/cpu.h>
 #include <arch/thread.h>
@@ -19,10 +20,29 @@ static inline int asm_xchg(void *ptr, int x)
 
 void cpu_spinlock_create(struct cpu_spinlock *spinlock, const char *name)
 {
+	cpu_spinlock_create_type(spinlock, name, CPU_SPINLOCK_TAS);
+}
+
+void cpu_spinlock_create_type(struct cpu_spinlock *spinlock, const char *name, int type)
+{
+	kassert(type == CPU_SPINLOCK_TAS || type == CPU_SPINLOCK_TICKET || type == CPU_SPINLOCK_MCS);
+
 	spinlock->locked = 0;
+	spinlock->type = type;
 	spinlock->num = 0;
 	spinlock->cpu = CPU_SPINLOCK_INVALID_CPU;
 
+	atomic_init(&(spinlock->ticket_next), 0);
+	atomic_init(&(spinlock->ticket_owner), 0);
+
+	atomic_init(&(spinlock->mcs_tail), NULL);
+	spinlock->mcs_node = NULL;
+
+#ifdef KERNEL_LOCKSTAT
+	spinlock->lockstat = lockstat_get_spinlock_class(name);
+	spinlock->lockstat_since = 0;
+#endif
+
 #ifdef KERNEL_DEBUG
 	spinlock->name = name;
 	spinlock->tid = TID_INVALID;
@@ -30,8 +50,12 @@ void cpu_spinlock_create(struct cpu_spinlock *spinlock, const char *name)
 #endif
 }
 
-static inline void spin_interruptible(struct cpu_spinlock *spinlock)
+/* The spin functions return whether the lock was contended, i.e. whether they had to wait. */
+
+static inline bool spin_interruptible(struct cpu_spinlock *spinlock)
 {
+	bool contended = false;
+
 	while (1)
 	{
 		cpu_force_cli();
@@ -42,19 +66,146 @@ static inline void spin_interruptible(struct cpu_spinlock *spinlock)
 		cpu_force_sti();
 
 		cpu_relax();
+		contended = true;
 	}
+
+	return contended;
 }
 
-static inline void spin_uninterruptible(struct cpu_spinlock *spinlock)
+static inline bool spin_uninterruptible(struct cpu_spinlock *spinlock)
 {
+	bool contended = false;
+
 	while (asm_xchg(&(spinlock->locked), 1))
+	{
 		cpu_relax();
+		contended = true;
+	}
+
+	return contended;
+}
+
+/* Waits for one spin of a queue lock. Interrupts are enabled during the pause if asked to. */
+static inline void spin_pause(bool interruptible)
+{
+	if (interruptible)
+		cpu_force_sti();
+
+	cpu_relax();
+
+	if (interruptible)
+		cpu_force_cli();
+}
+
+static inline bool ticket_spin(struct cpu_spinlock *spinlock, bool interruptible)
+{
+	uint ticket = atomic_fetch_add(&(spinlock->ticket_next), 1);
+	bool contended = false;
+
+	while (atomic_load(&(spinlock->ticket_owner)) != ticket)
+	{
+		spin_pause(interruptible);
+		contended = true;
+	}
+
+	spinlock->locked = 1;
+
+	return contended;
+}
+
+static inline void ticket_unlock(struct cpu_spinlock *spinlock)
+{
+	spinlock->locked = 0;
+
+	/* Only the holder writes the owner, so there is no need for an atomic increment. */
+	atomic_store(&(spinlock->ticket_owner), atomic_load(&(spinlock->ticket_owner)) + 1);
+}
+
+/* Takes an MCS node from the CPU's pool. Call with interrupts disabled. */
+static struct cpu_mcs_node *mcs_node_alloc(struct x86_cpu *cpu)
+{
+	for (uint i = 0; i < X86_CPU_MCS_NODES; i++)
+	{
+		if ((cpu->mcs_nodes_used & (1u << i)) == 0)
+		{
+			cpu->mcs_nodes_used |= 1u << i;
+			return &(cpu->mcs_nodes[i]);
+		}
+	}
+
+	kpanic("mcs_node_alloc(): out of MCS nodes");
+}
+
+/* Returns an MCS node to the CPU's pool. Call with interrupts disabled. */
+static void mcs_node_free(struct x86_cpu *cpu, struct cpu_mcs_node *node)
+{
+	uint i = node - cpu->mcs_nodes;
+
+	kassert(i < X86_CPU_MCS_NODES && (cpu->mcs_nodes_used & (1u << i)));
+	cpu->mcs_nodes_used &= ~(1u << i);
+}
+
+static inline bool mcs_spin(struct cpu_spinlock *spinlock, struct x86_cpu *cpu, bool interruptible)
+{
+	struct cpu_mcs_node *node, *prev;
+
+	node = mcs_node_alloc(cpu);
+	atomic_store(&(node->next), NULL);
+	atomic_store(&(node->waiting), true);
+
+	/* Queue ourselves. If there was a previous waiter or holder, it hands the lock over to us by
+	   clearing our waiting flag. */
+	prev = atomic_exchange(&(spinlock->mcs_tail), node);
+
+	if (prev)
+	{
+		atomic_store(&(prev->next), node);
+
+		while (atomic_load(&(node->waiting)))
+			spin_pause(interruptible);
+	}
+
+	spinlock->mcs_node = node;
+	spinlock->locked = 1;
+
+	return prev != NULL;
+}
+
+static inline void mcs_unlock(struct cpu_spinlock *spinlock, struct x86_cpu *cpu)
+{
+	struct cpu_mcs_node *node = spinlock->mcs_node;
+	struct cpu_mcs_node *next = atomic_load(&(node->next));
+
+	spinlock->mcs_node = NULL;
+	spinlock->locked = 0;
+
+	if (next == NULL)
+	{
+		/* Nobody seems to be waiting. If we're still the tail, the lock is free. */
+		struct cpu_mcs_node *expected = node;
+
+		if (atomic_compare_exchange_strong(&(spinlock->mcs_tail), &expected, NULL))
+			goto unlocked;
+
+		/* A waiter has swapped the tail, but has not linked itself to us yet. */
+		while ((next = atomic_load(&(node->next))) == NULL)
+			cpu_relax();
+	}
+
+	atomic_store(&(next->waiting), false);
+
+unlocked:
+	mcs_node_free(cpu, node);
 }
 
 void cpu_spinlock_acquire(struct cpu_spinlock *spinlock)
 {
 	struct x86_cpu *cpu;
 	uint32_t eflags = cpu_get_eflags();
+	bool contended;
+#ifdef KERNEL_LOCKSTAT
+	uint64_t wait_start = cpu_timestamp();
+#endif
 
 	/* Disable preemption so that the thread we're currently running does not get rescheduled on
 	   a different CPU while holding the spinlock. */
@@ -70,20 +221,34 @@ void cpu_spinlock_acquire(struct cpu_spinlock *spinlock)
 		goto num_incremented;
 	}
 
+	/* Preemption is disabled, so we stay on this CPU while spinning. */
+	cpu = cpu_current_early();
+
 	/* If interrupts were enabled before acquire was called, we want to spin with interrupts
 	   enabled, so that we can get IPIs and be preempted. Interrupts will be disabled when
 	   we acquire the lock. */
-	if (eflags & EFLAGS_IF)
-		spin_interruptible(spinlock);
+	if (spinlock->type == CPU_SPINLOCK_TICKET)
+		contended = ticket_spin(spinlock, eflags & EFLAGS_IF);
+	else if (spinlock->type == CPU_SPINLOCK_MCS)
+		contended = mcs_spin(spinlock, cpu, eflags & EFLAGS_IF);
+	else if (eflags & EFLAGS_IF)
+		contended = spin_interruptible(spinlock);
 	else
-		spin_uninterruptible(spinlock);
+		contended = spin_uninterruptible(spinlock);
 
 	cpu_memory_barrier();
 
 	spinlock->num = 1;
 
+#ifdef KERNEL_LOCKSTAT
+	spinlock->lockstat_since = cpu_timestamp();
+	lockstat_acquired(spinlock->lockstat, cpu->num, contended,
+		spinlock->lockstat_since - wait_start);
+#else
+	(void)contended;
+#endif
+
 	/* Set fields using the CPU object. */
-	cpu = cpu_current();
 
 	spinlock->cpu = cpu->num;
 
@@ -115,6 +280,11 @@ void cpu_spinlock_release(struct cpu_spinlock *spinlock)
 
 	spinlock->cpu = CPU_SPINLOCK_INVALID_CPU;
 
+#ifdef KERNEL_LOCKSTAT
+	lockstat_released(spinlock->lockstat, cpu_current_early()->num,
+		cpu_timestamp() - spinlock->lockstat_since);
+#endif
+
 #ifdef KERNEL_DEBUG
 	/* Clear debug fields. */
 	spinlock->tid = TID_INVALID;
@@ -123,7 +293,12 @@ void cpu_spinlock_release(struct cpu_spinlock *spinlock)
 
 	cpu_memory_barrier();
 
-	asm volatile ("movl $0, %0" : "+m" (spinlock->locked));
+	if (spinlock->type == CPU_SPINLOCK_TICKET)
+		ticket_unlock(spinlock);
+	else if (spinlock->type == CPU_SPINLOCK_MCS)
+		mcs_unlock(spinlock, cpu_current_early());
+	else
+		asm volatile ("movl $0, %0" : "+m" (spinlock->locked));
 
 num_decremented:
 	pop_no_interrupts();
@@ -137,7 +312,7 @@ bool cpu_spinlock_held(struct cpu_spinlock *spinlock)
 	/* Disable interrupts. This way we can avoid weird behaviour when an interrupt handler tries to
 	   use the same spinlock. */
 	push_no_interrupts();
-	bool ret = spinlock->locked && spinlock->cpu == cpu_current()->num;
+	bool ret = spinlock->locked && spinlock->cpu == cpu_current_early()->num;
 	pop_no_interrupts();
 	return ret;
 }
@@ -119,7 +119,7 @@ static void get_stack_info(void **top, void **bottom)
 {
 	struct x86_cpu *cpu;
 
-	cpu = cpu_current();
+	cpu = cpu_current_early();
 
 	if (cpu->stack_top == NULL)
 	{
@@ -143,7 +143,8 @@ static void get_stack_info(void **top, void **bottom)
 	}
 	else
 	{
-		kassert(cpu->thread == NULL);
+		/* The idle thread runs on the CPU's own stack. */
+		kassert(cpu->thread == NULL || cpu->thread == cpu->idle);
 		*top = cpu->stack_top;
 		*bottom = cpu->stack_top + cpu->stack_size;
 	}
@@ -177,8 +178,9 @@ void debug_fill_call_stack(struct debug_call_stack *cs)
 
 	for (i = 0; i < DEBUG_MAX_CALL_DEPTH; i++)
 	{
-		/* Check if we're outside of the stack. */
-		if ((void*)frame > stack_bottom || (void*)frame < stack_top)
+		/* Check if we're outside of the stack. The whole frame has to fit, because the page past
+		   the stack may not be mapped. */
+		if ((void*)(frame + 1) > stack_bottom || (void*)frame < stack_top)
 			break;
 
 		cs->stack[i] = frame->eip;
@@ -5,13 +5,49 @@
 #include <kernel/debug.h>
 #include <kernel/heap.h>
 #include <kernel/paging.h>
+#include <kernel/slab.h>
 #include <arch/cpu.h>
+#include <arch/heap.h>
 #include <arch/memlayout.h>
 #include <arch/palloc.h>
 #include <arch/paging.h>
 
 #define HEAP_ALLOC_MAGIC 0xA110CA73
 
+/* Smallest free area worth splitting off an allocation. */
+#define HEAP_MIN_SPLIT 64
+
+/* Requests up to this size, with an alignment that is a power of two, are served by the size-class
+   caches. Classes are the powers of two from KALLOC_MIN_CLASS to KMEM_CACHE_MAX_SIZE. */
+#define KALLOC_MIN_CLASS 16
+#define NOF_SIZE_CLASSES 7
+
+static struct kmem_cache size_caches[NOF_SIZE_CLASSES];
+
+static const char *size_cache_names[NOF_SIZE_CLASSES] = {
+	"kalloc-16", "kalloc-32", "kalloc-64", "kalloc-128", "kalloc-256", "kalloc-512", "kalloc-1024"
+};
+
+/* Free objects a magazine holds at most, and the number moved between a magazine and its cache at
+   once. */
+#define MAGAZINE_SIZE 16
+#define MAGAZINE_BATCH 8
+
+/* Stack of free objects of one size class, owned by one CPU. Only used with interrupts off. */
+struct magazine
+{
+	uint count;
+	vaddr_t objs[MAGAZINE_SIZE];
+};
+
+/* Magazines of a CPU. Only the CPU itself touches them, so each CPU gets its own cache lines. */
+struct cpu_magazines
+{
+	struct magazine classes[NOF_SIZE_CLASSES];
+} __cacheline_aligned;
+
+static struct cpu_magazines magazines[X86_MAX_CPUS];
+
 struct heap_alloc
 {
 	uint32_t magic1; /* Magic value for detecting buffer overflows. */
@@ -26,9 +62,10 @@ struct heap_alloc
 };
 
 /*
-	This is a very simple heap allocator. The allocator keeps track of all allocations as a linked
-	list. The items are placed sequentially in the kernel heap region of the virtual memory. Here is
-	my attempt to draw it :)
+	Larger requests go to a very simple heap allocator. The allocator keeps track of all allocations
+	as a linked list. The items are placed sequentially in the first quarter of the kernel heap region
+	of the virtual memory. Freed allocations are merged with free neighbours and reused by later
+	requests that fit. Here is my attempt to draw it :)
 
     0               v---heap                      v---first
 	[ other memory ][ #1 align_offset_size bytes ][ #1 heap_alloc   ][ #1 size bytes ][ #2 align_...
@@ -43,6 +80,7 @@ static const struct vm_region *heap_region;
 
 static struct cpu_spinlock spinlock; /* Mutex lock for the heap. */
 static size_t heap_size; /* Total heap size in bytes. */
+static size_t heap_max_size; /* Size of the part of the region the list may grow in. */
 static size_t cur_size;
 static void *heap; /* Heap base address. */
 static struct heap_alloc *first; /* First allocation. */
@@ -86,7 +124,7 @@ static void unsafe_grow_heap(size_t new_size)
 	/* TODO: Allow kernel heap to free memory. */
 	kassert(new_size >= heap_size);
 
-	if (heap + new_size > heap_region->vbase + heap_region->size)
+	if (new_size > heap_max_size)
 		kpanic("heap exceeded the heap_region");
 
 	/* We do not want to (for whatever, future reason) be holding the physical memory allocator's
@@ -104,11 +142,7 @@ static void unsafe_grow_heap(size_t new_size)
 		v = (vaddr_t)align_to_next_page(heap + heap_size);
 		vto = (vaddr_t)align_to_next_page(heap + new_size);
 
-		while (v < vto)
-		{
-			kp_map(v, palloc());
-			v += PAGE_SIZE;
-		}
+		kp_map_range(v, (size_t)(vto - v), PHYS_NULL);
 	}
 
 	heap_size = new_size;
@@ -133,22 +167,200 @@ static void unsafe_truncate_heap(void)
 		last->next = NULL;
 }
 
+/* Merges the free allocation following alloc into it. Their areas are adjacent. */
+static void unsafe_merge_next(struct heap_alloc *alloc)
+{
+	struct heap_alloc *next = alloc->next;
+
+	alloc->size += next->align_offset_size + sizeof(struct heap_alloc) + next->size;
+	alloc->next = next->next;
+
+	if (alloc->next)
+		alloc->next->prev = alloc;
+	else
+		last = alloc;
+}
+
+/* Splits the area of alloc past its first size bytes off into a free allocation, if there is room
+   for one. */
+static void unsafe_split(struct heap_alloc *alloc, size_t size)
+{
+	uintptr_t end = (uintptr_t)(alloc + 1) + size;
+	size_t offset = (sizeof(void *) - end % sizeof(void *)) % sizeof(void *);
+	struct heap_alloc *rest;
+
+	if (alloc->size < size + offset + sizeof(struct heap_alloc) + HEAP_MIN_SPLIT)
+		return;
+
+	rest = (struct heap_alloc *)(end + offset);
+	rest->magic1 = HEAP_ALLOC_MAGIC;
+	rest->align_offset_size = offset;
+	rest->size = alloc->size - size - offset - sizeof(struct heap_alloc);
+	rest->free = true;
+	rest->magic2 = HEAP_ALLOC_MAGIC;
+
+	rest->prev = alloc;
+	rest->next = alloc->next;
+
+	if (rest->next)
+		rest->next->prev = rest;
+	else
+		last = rest;
+
+	alloc->next = rest;
+	alloc->size = size;
+
+	if (rest->next && rest->next->free)
+		unsafe_merge_next(rest);
+}
+
+/* Finds a free allocation the request fits in, with its area already aligned. */
+static struct heap_alloc *unsafe_find_free(uintptr_t alignment, size_t size)
+{
+	for (struct heap_alloc *p = first; p; p = p->next)
+	{
+		if (p->free && p->size >= size && ((uintptr_t)(p + 1)) % alignment == 0)
+			return p;
+	}
+
+	return NULL;
+}
+
 void init_kernel_heap(const struct vm_region *region)
 {
 	heap_region = region;
 	heap_size = 0;
-	/* The heap starts at the beginning of the region. */
+	cpu_spinlock_create(&spinlock, "heap");
+
+	/* The heap starts at the beginning of the region and gets a quarter of it. The slab pages get
+	   the next quarter and the vmalloc areas the upper half. */
 	heap = region->vbase;
+	heap_max_size = mask_to_page(region->size / 4);
 	first = NULL;
 	last = NULL;
+
+	init_slab(heap + heap_max_size, heap_max_size);
+
+	for (int i = 0; i < NOF_SIZE_CLASSES; i++)
+		kmem_cache_create(&size_caches[i], size_cache_names[i], KALLOC_MIN_CLASS << i,
+			KALLOC_MIN_CLASS << i);
+
+	init_vmalloc(heap + 2 * heap_max_size, mask_to_page(region->size - 2 * heap_max_size));
+
 	initialized = true;
 }
 
+/* Gets the size class for a request, or -1 if the request is too large for the caches. */
+static int size_class(uintptr_t alignment, size_t size)
+{
+	size_t wanted;
+	int i;
+
+	if ((alignment & (alignment - 1)) != 0)
+		return -1;
+
+	/* Objects of a class are aligned to the class size. */
+	wanted = kmax(size, (size_t)alignment);
+
+	if (wanted > KMEM_CACHE_MAX_SIZE)
+		return -1;
+
+	for (i = 0; ((size_t)KALLOC_MIN_CLASS << i) < wanted; i++)
+		;
+
+	return i;
+}
+
+/* Gets the magazine of the current CPU. Call with interrupts off. */
+static inline struct magazine *cpu_magazine(int class)
+{
+	return &(magazines[cpu_current()->num].classes[class]);
+}
+
+/* Allocates an object of the size class. Takes it from the CPU's magazine, if there is one.
+   Otherwise refills the magazine with a batch from the cache. */
+static vaddr_t magazine_alloc(int class)
+{
+	vaddr_t batch[MAGAZINE_BATCH];
+	struct magazine *mag;
+	vaddr_t v = NULL;
+	uint i;
+
+	push_no_interrupts();
+	mag = cpu_magazine(class);
+
+	if (mag->count > 0)
+		v = mag->objs[--(mag->count)];
+
+	pop_no_interrupts();
+
+	if (v)
+		return v;
+
+	/* The cache lock is taken with interrupts on, so that we can get TLB shootdown IPIs while
+	   spinning. We may end up on another CPU after this. */
+	kmem_cache_alloc_bulk(&size_caches[class], batch, MAGAZINE_BATCH);
+	v = batch[0];
+
+	push_no_interrupts();
+	mag = cpu_magazine(class);
+
+	for (i = 1; i < MAGAZINE_BATCH && mag->count < MAGAZINE_SIZE; i++)
+		mag->objs[(mag->count)++] = batch[i];
+
+	pop_no_interrupts();
+
+	/* The magazine has been refilled in the meantime. */
+	if (i < MAGAZINE_BATCH)
+		kmem_cache_free_bulk(&size_caches[class], batch + i, MAGAZINE_BATCH - i);
+
+	return v;
+}
+
+/* Frees an object of the size class into the CPU's magazine. A full magazine drains a batch back
+   to the cache first. */
+static void magazine_free(int class, vaddr_t v)
+{
+	vaddr_t batch[MAGAZINE_BATCH];
+	struct magazine *mag;
+	bool drain = false;
+
+	/* Objects of a class are aligned to the class size. */
+	if (((uintptr_t)v & ((KALLOC_MIN_CLASS << class) - 1)) != 0)
+		kpanic("kfree(): address is not at the start of an object");
+
+	push_no_interrupts();
+	mag = cpu_magazine(class);
+
+#ifdef KERNEL_DEBUG
+	for (uint i = 0; i < mag->count; i++)
+	{
+		if (mag->objs[i] == v)
+			kpanic("kfree(): double free");
+	}
+#endif
+
+	if (mag->count == MAGAZINE_SIZE)
+	{
+		mag->count -= MAGAZINE_BATCH;
+		kmemcpy(batch, mag->objs + mag->count, sizeof(batch));
+		drain = true;
+	}
+
+	mag->objs[(mag->count)++] = v;
+
+	pop_no_interrupts();
+
+	if (drain)
+		kmem_cache_free_bulk(&size_caches[class], batch, MAGAZINE_BATCH);
+}
+
 vaddr_t kalloc(int mode, uintptr_t alignment, size_t size)
 {
 	uintptr_t unaligned;
 	size_t offset;
 	struct heap_alloc *alloc;
+	int class;
 	vaddr_t v;
 
 	/* If we try to acquire the heap spinlock with interrupts off, we might run into a deadlock
@@ -168,15 +380,31 @@ vaddr_t kalloc(int mode, uintptr_t alignment, size_t size)
 	if (!is_using_kernel_page_tables())
 		kpanic("kalloc(): called with non-kernel page tables");
 
+	/* Most requests are small. Freed objects are reused by the caches. */
+	if ((class = size_class(alignment, size)) >= 0)
+		return magazine_alloc(class);
+
+	/* Requests of a page or more get pages of their own, which kfree() gives back. */
+	if (size >= PAGE_SIZE && PAGE_SIZE % alignment == 0)
+		return vmalloc(size);
+
 	cpu_spinlock_acquire(&spinlock);
 
-	/* TODO: Reuse freed allocations. */
 	/* TODO: Reuse heap lost due to alignment. */
 
 #ifdef KERNEL_DEBUG
 	unsafe_check_all();
 #endif
 
+	/* Reuse a freed allocation if one is large enough. What the request does not need stays free. */
+	if ((alloc = unsafe_find_free(alignment, size)) != NULL)
+	{
+		alloc->free = false;
+		unsafe_split(alloc, size);
+		cpu_spinlock_release(&spinlock);
+		return alloc + 1;
+	}
+
 	/* Calculate the next possible pointer with such alignment. */
 	unaligned = (uintptr_t)(heap + cur_size + sizeof(struct heap_alloc));
 	offset = alignment - 1 - (size_t)((unaligned + alignment - 1) % alignment);
@@ -220,15 +448,122 @@ vaddr_t kalloc(int mode, uintptr_t alignment, size_t size)
 	return v;
 }
 
-vaddr_t krealloc(__unused vaddr_t v, __unused int mode, __unused uintptr_t alignment, __unused size_t size)
+/* Resizes the allocation in place if possible. Returns false if it has to be moved. Requires the
+   heap lock. */
+static bool unsafe_resize(struct heap_alloc *alloc, size_t size)
 {
-	kpanic("krealloc(): unimplemented");
-	return v;
+	struct heap_alloc *next = alloc->next;
+	size_t grow;
+
+	/* Shrink. The rest is freed, or truncated if this is the last allocation. */
+	if (size <= alloc->size)
+	{
+		unsafe_split(alloc, size);
+		unsafe_truncate_heap();
+		return true;
+	}
+
+	/* The last allocation can grow into the rest of the heap. */
+	if (next == NULL)
+	{
+		grow = size - alloc->size;
+
+		if (heap_size < cur_size + grow)
+			unsafe_grow_heap(cur_size + grow);
+
+		cur_size += grow;
+		alloc->size = size;
+		return true;
+	}
+
+	/* Others can take over the free allocation following them. */
+	if (next->free && alloc->size + next->align_offset_size + sizeof(struct heap_alloc) + next->size
+		>= size)
+	{
+		unsafe_merge_next(alloc);
+		unsafe_split(alloc, size);
+		return true;
+	}
+
+	return false;
+}
+
+vaddr_t krealloc(vaddr_t v, int mode, uintptr_t alignment, size_t size)
+{
+	struct heap_alloc *alloc;
+	struct kmem_cache *cache;
+	size_t old_size;
+	vaddr_t n;
+
+	if (v == NULL)
+		return kalloc(mode, alignment, size);
+
+	/* We can check this because it only changes in initialization. */
+	if (!initialized)
+		kpanic("krealloc(): heap was not initialized");
+
+	if (!is_heap(v))
+		kpanic("krealloc(): given address is not in heap region");
+
+	if (is_slab_object(v))
+	{
+		/* An object covers the whole size of its class, so it can stay where it is as long as
+		   the request fits. */
+		cache = kmem_cache_of(v);
+
+		if (size <= cache->size && (uintptr_t)v % alignment == 0)
+			return v;
+
+		old_size = cache->size;
+		goto _krealloc_move;
+	}
+
+	if (is_vmalloc(v))
+	{
+		/* Smaller requests belong to the other allocators. */
+		if (size >= PAGE_SIZE && (uintptr_t)v % alignment == 0 && vmalloc_resize(v, size))
+			return v;
+
+		old_size = vmalloc_size(v);
+		goto _krealloc_move;
+	}
+
+	cpu_spinlock_acquire(&spinlock);
+
+#ifdef KERNEL_DEBUG
+	unsafe_check_all();
+#endif
+
+	alloc = v - sizeof(struct heap_alloc);
+
+	if (!unsafe_check(alloc) || alloc->free)
+		kpanic("krealloc(): bad address");
+
+	if ((uintptr_t)v % alignment == 0 && unsafe_resize(alloc, size))
+	{
+#ifdef KERNEL_DEBUG
+		unsafe_check_all();
+#endif
+		cpu_spinlock_release(&spinlock);
+		return v;
+	}
+
+	old_size = alloc->size;
+	cpu_spinlock_release(&spinlock);
+
+_krealloc_move:
+	/* Allocate, copy and free. */
+	n = kalloc(mode, alignment, size);
+	kmemcpy(n, v, kmin(old_size, size));
+	kfree(v);
+
+	return n;
 }
 
 void kfree(vaddr_t v)
 {
 	struct heap_alloc *alloc;
+	struct kmem_cache *cache;
 
 	/* We can check this because it only changes in initialization. */
 	if (!initialized)
@@ -237,6 +572,26 @@ void kfree(vaddr_t v)
 	if (!is_heap(v))
 		kpanic("kfree(): given address is not in heap region");
 
+	if (is_slab_object(v))
+	{
+		cache = kmem_cache_of(v);
+
+		/* Objects of the size classes go through the magazines. Other caches' objects may be freed
+		   with kfree() too. */
+		if (size_caches <= cache && cache < size_caches + NOF_SIZE_CLASSES)
+			magazine_free(cache - size_caches, v);
+		else
+			kmem_cache_free(cache, v);
+
+		return;
+	}
+
+	if (is_vmalloc(v))
+	{
+		vfree(v);
+		return;
+	}
+
 	cpu_spinlock_acquire(&spinlock);
 
 	alloc = v - sizeof(struct heap_alloc);
@@ -246,9 +601,18 @@ void kfree(vaddr_t v)
 
 	alloc->free = true;
 
-	/* It might be worth truncating the heap if we've free the last allocation or the next one is
-	   free as well. */
-	if (alloc->next == NULL || alloc->next->free == true)
+	/* Merge with free neighbours, so that larger requests can reuse the area. */
+	if (alloc->next && alloc->next->free)
+		unsafe_merge_next(alloc);
+
+	if (alloc->prev && alloc->prev->free)
+	{
+		alloc = alloc->prev;
+		unsafe_merge_next(alloc);
+	}
+
+	/* It might be worth truncating the heap if we've freed the last allocation. */
+	if (alloc->next == NULL)
 		unsafe_truncate_heap();
 
 	cpu_spinlock_release(&spinlock);
@@ -6,6 +6,7 @@
 #include <kernel/thread.h>
 #include <arch/interrupts.h>
 #include <arch/proc.h>
+#include <arch/scheduler.h>
 #include <arch/thread.h>
 #include <arch/cpu/apic.h>
 #include <arch/cpu/apic_types.h>
@@ -16,37 +17,85 @@
 
 #define X86_CPU_MAGIC 0x86
 
+/* Maximum number of CPUs. */
+#define X86_MAX_CPUS MAX_CPUS
+
+/* Number of MCS spinlocks a CPU can hold or wait on at the same time. */
+#define X86_CPU_MCS_NODES 8
+
+/* A function call to be run on another CPU, queued with the smp_call_function*() interface. The
+   target clears busy, so each call has a cache line of its own. */
+struct cpu_call
+{
+	void (*func)(void *arg);
+	void *arg;
+	struct cpu_call *next; /* Next call in the target CPU's queue. */
+	atomic_bool busy; /* Is the call queued or running? */
+} __cacheline_aligned;
+
+/*
+ * Each CPU object starts a cache line. The fields only the CPU itself writes in its hot paths come
+ * first. Fields written or polled by other CPUs start lines of their own, so that taking a run
+ * queue lock or queuing a call does not steal the line holding preempt_disabled or cli_stack.
+ */
 struct x86_cpu
 {
+	/* Local part. Only written by the CPU itself. */
+
 	int magic;
+	struct x86_cpu *self; /* Points at this object. Read through the per-CPU segment. */
 	int num;
+
+	bool int_enabled; /* Interrupts state when cli_stack was 0. */
+	int cli_stack; /* Number of cli push operations. */
+
+	int preempt_disabled;
+	bool timer_tick; /* Was the last timer interrupt a scheduler tick? */
+	struct thread *idle; /* Thread run when there is nothing else to run. */
+	struct thread *thread; /* Thread currently running on the CPU. */
+
+	uint mcs_nodes_used; /* Bitmap of the MCS nodes in use. */
+
+	/* Constant after the CPU has started. */
+
 	atomic_bool active;
 	lapic_id_t lapic_id;
 
 	vaddr_t stack_top;
 	size_t stack_size;
 
-	/* Interrupts */
-
-	bool int_enabled; /* Interrupts state when cli_stack was 0. */
-	int cli_stack; /* Number of cli push operations. */
-
 	/* Segmentation */
 
 	struct dtr gdtr;
 	seg_t gdt[YAOS2_GDT_NOF_ENTRIES];
 	volatile struct tss tss; /* TODO: Make sure TSS does not cross page boundary. (7.2.1 Vol. 3) */
 
-	/* Scheduler fields. */
-	int preempt_disabled;
-	struct thread scheduler_thread;
-	struct arch_thread scheduler_arch_thread;
-	struct thread *scheduler;
-	struct thread *thread;
-};
+	/* Shared part. Each group starts a cache line. */
+
+	/* MCS queue nodes. The previous holder of a lock hands it over by writing our node. */
+	struct cpu_mcs_node mcs_nodes[X86_CPU_MCS_NODES] __cacheline_aligned;
+
+	/* Page directory loaded on this CPU. Stored before CR3 is written. Read by TLB shootdowns. */
+	_Atomic paddr_t cr3 __cacheline_aligned;
+
+	/* Cross-CPU function calls */
+
+	struct cpu_call *_Atomic call_queue __cacheline_aligned; /* Calls queued to run on this CPU. */
+	struct cpu_call call_slots[X86_MAX_CPUS]; /* Calls issued by this CPU, one for each target. */
+
+	/* Scheduler. Other CPUs take the run queue lock to wake threads and steal work. */
+
+	struct run_queue rq __cacheline_aligned;
+	struct thread idle_thread;
+	struct arch_thread idle_arch_thread;
+} __cacheline_aligned;
 
 extern lapic_id_t boot_lapic_id;
 
+/* Set once init_gdt() has run on the boot CPU. APs run init_gdt() before anything that needs the
+   current CPU object, so from then on every CPU running kernel code has the per-CPU segment in %gs. */
+extern bool percpu_segment_ready;
+
 /* Adds a CPU. */
 void cpu_add(lapic_id_t lapic_id);
 
@@ -56,8 +105,37 @@ void cpu_set_boot_cpu(void);
 /* Enumerates other CPUs. Call with interrupts disabled. */
 void cpu_enumerate_other_cpus(void (*receiver)(struct x86_cpu *));
 
-/* Gets the current CPU object. */
-struct x86_cpu *cpu_current(void);
+/* Looks the current CPU object up by the LAPIC ID. Used before the per-CPU segment is set up. */
+struct x86_cpu *cpu_lookup_current(void);
+
+/* Reads a 32-bit field of the current CPU object with a single instruction, so that it cannot be
+   interrupted by a switch to another CPU. Requires the per-CPU segment. */
+#define percpu_read(field) \
+	({ \
+		typeof(((struct x86_cpu *)0)->field) __val; \
+		asm volatile ("movl %%gs:%c1, %0" : "=r" (__val) : "i" (offsetof(struct x86_cpu, field))); \
+		__val; \
+	})
+
+/* Gets the current CPU object with a single load through the per-CPU segment. Must not be called
+   before init_gdt(). Code that can run earlier uses cpu_current_early(). */
+static inline struct x86_cpu *cpu_current(void)
+{
+	return percpu_read(self);
+}
+
+/* Gets the current CPU object. Falls back to the LAPIC ID lookup before the per-CPU segment is set
+   up, so it is safe to call in early initialization. */
+static inline struct x86_cpu *cpu_current_early(void)
+{
+	if (percpu_segment_ready)
+		return percpu_read(self);
+
+	return cpu_lookup_current();
+}
+
+/* Gets the CPU object with the given number. */
+struct x86_cpu *cpu_get(unsigned int num);
 
 /* Checks if current CPU is boot CPU. */
 #define is_boot_cpu() (boot_lapic_id == lapic_get_id())
@@ -68,6 +146,9 @@ void cpu_set_active(bool flag);
 /* Flush TLB on current CPU. */
 void cpu_flush_tlb(void);
 
+/* Flush TLB on current CPU, including the global pages. */
+void cpu_flush_tlb_global(void);
+
 /* Set CR3 on current CPU. Note that this function avoids unnecessary CR3 switches. Use
    cpu_flush_tlb() to perform flushes. Returns previous CR3 value. */
 paddr_t cpu_set_cr3(paddr_t cr3);
@@ -88,6 +169,10 @@ void cpu_setup_tss(struct x86_cpu *cpu, struct thread *thread);
 /* An sti that does not update CPU object */
 #define cpu_force_sti() asm volatile("sti" : : : "memory")
 
+/* Enables interrupts and halts the CPU until the next interrupt. sti delays interrupts until after
+   the next instruction, so an interrupt pending before this will still wake the CPU up. */
+#define cpu_sti_hlt() asm volatile("sti; hlt" : : : "memory")
+
 /* Sets the desired interrupts state for current CPU. Returns previous state. Assumes the current
    CPU is the given CPU. */
 static inline bool cpu_set_interrupts_with_cpu(struct x86_cpu *cpu, bool state)
@@ -166,4 +251,15 @@ static inline void cpuid (uint32_t cat, uint32_t *eax, uint32_t *ebx, uint32_t *
 
 #define CPUID_FEATURES 1
 
+/* CPUID_FEATURES bits in ECX. */
+#define CPUID_FEATURES_ECX_TSC_DEADLINE (1 << 24)
+
+/* Writes a model-specific register. */
+static inline void cpu_wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile ("wrmsr" : : "c" (msr), "A" (val) : "memory");
+}
+
+#define MSR_TSC_DEADLINE 0x6e0
+
 #endif
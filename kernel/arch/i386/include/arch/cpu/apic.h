@@ -22,6 +22,13 @@ void lapic_ipi_wait(void);
 
 void lapic_start_ap(lapic_id_t id, uint16_t entry);
 
+/* Programs the timer of the current CPU's local APIC to fire once the TSC reaches the given
+   value. */
+void lapic_timer_arm(uint64_t tsc);
+
+/* Stops the timer of the current CPU's local APIC. */
+void lapic_timer_stop(void);
+
 /* I/O APIC */
 
 /* Registers an I/O APIC */
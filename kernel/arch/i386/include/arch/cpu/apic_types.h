@@ -30,7 +30,9 @@ typedef uint32_t lapic_reg_t;
 
 #define LAPIC_TIMER_X1			0x0000000B   // divide counts by 1
 #define LAPIC_TIMER_X16			0x00000003   // divide counts by 16
+#define LAPIC_TIMER_ONESHOT		0x00000000   // One-shot
 #define LAPIC_TIMER_PERIODIC	0x00020000   // Periodic
+#define LAPIC_TIMER_TSC_DEADLINE	0x00040000   // TSC-deadline
 
 #define LAPIC_REG_PCINT			(0x0340 / sizeof (lapic_reg_t))   // Performance Counter LVT
 #define LAPIC_REG_LINT0			(0x0350 / sizeof (lapic_reg_t))   // Local Vector Table 1 (LINT0)
@@ -2,7 +2,7 @@
 #ifndef ARCH_I386_CPU_SELECTORS_H
 #define ARCH_I386_CPU_SELECTORS_H
 
-#define YAOS2_GDT_NOF_ENTRIES 6
+#define YAOS2_GDT_NOF_ENTRIES 7
 
 #define KERNEL_CODE_SELECTOR 0x08
 #define KERNEL_DATA_SELECTOR 0x10
@@ -10,5 +10,6 @@
 #define USER_CODE_SELECTOR 0x1B
 #define USER_DATA_SELECTOR 0x23
 #define USER_TSS_SELECTOR 0x2B
+#define KERNEL_CPU_SELECTOR 0x30 /* Per-CPU segment, loaded into %gs in kernel mode. */
 
 #endif
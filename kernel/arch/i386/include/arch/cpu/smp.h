@@ -2,10 +2,30 @@
 #ifndef ARCH_I386_CPU_SMP_H
 #define ARCH_I386_CPU_SMP_H
 
+#include <kernel/cdefs.h>
+#include <kernel/cpu.h>
+
 /* Initialize SMP stuff. */
 void init_smp(void);
 
 /* Enumerate APs and start them one by one. */
 void start_aps(void);
 
+/*
+ * Cross-CPU function calls. The function runs in the interrupt handler of the target CPU, so it
+ * must not sleep. If wait is true, the call returns after all the targets have run the function.
+ * Otherwise, it returns once the calls are queued and arg must stay valid until they have run.
+ * Inactive CPUs are skipped. Other CPUs have to be able to interrupt the caller, as they may be
+ * waiting for it to run their calls in turn.
+ */
+
+/* Runs func(arg) on the CPUs in the mask. The current CPU, if included, runs it directly. */
+void smp_call_function_mask(cpu_mask_t mask, void (*func)(void *arg), void *arg, bool wait);
+
+/* Runs func(arg) on the CPU with the given number. */
+void smp_call_function_single(uint num, void (*func)(void *arg), void *arg, bool wait);
+
+/* Runs func(arg) on all the other CPUs. */
+void smp_call_function(void (*func)(void *arg), void *arg, bool wait);
+
 #endif
@@ -6,4 +6,30 @@
 
 void init_kernel_heap(const struct vm_region *region);
 
+/* Sets up the page pool of the slabs in [base, base + size). Called by the heap. */
+void init_slab(vaddr_t base, size_t size);
+
+/* Sets up the vmalloc areas in [base, base + size). Called by the heap. */
+void init_vmalloc(vaddr_t base, size_t size);
+
+/* Checks whether the address belongs to the vmalloc part of the heap region. */
+bool is_vmalloc(vaddr_t v);
+
+/* Maps fresh pages for size bytes, rounded up to pages. Returns a page-aligned address. */
+vaddr_t vmalloc(size_t size);
+
+/* Unmaps the area starting at v and frees its pages. */
+void vfree(vaddr_t v);
+
+/* Lets vfree() hand areas to the worker threads, and queues the areas freed before. Call once the
+   workers have started. */
+void init_vfree_deferred(void);
+
+/* Gets the mapped size of the area starting at v. */
+size_t vmalloc_size(vaddr_t v);
+
+/* Resizes the area starting at v to size bytes, rounded up to pages, without moving it. Returns
+   false if the following address space is taken. */
+bool vmalloc_resize(vaddr_t v, size_t size);
+
 #endif
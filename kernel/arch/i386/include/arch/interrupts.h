@@ -17,13 +17,16 @@
 /* Interrupt vector for a system call from user code. */
 #define INT_SYSCALL			0x80
 
-/* Interrupt vector for an IPI that commands a TLB flush due to page tables update. */
-#define INT_FLUSH_TLB_IPI	0x81
+/* IPI that makes a CPU run the function calls queued for it. */
+#define INT_CALL_FUNCTION_IPI	0x81
 
 /* IPI due to kernel panic. In response to this CPUs should disable interrupts and enter an infinite
    loop.*/
 #define INT_PANIC_IPI		0x82
 
+/* IPI that wakes up an idle CPU after a thread has been put in a run queue. */
+#define INT_RESCHEDULE_IPI	0x83
+
 #define ISR_MAX 256
 
 typedef uint32_t int_no_t;
@@ -2,15 +2,36 @@
 #ifndef ARCH_I386_KERNEL_CPU_H
 #define ARCH_I386_KERNEL_CPU_H
 
+/* Maximum number of CPUs. */
+#define MAX_CPUS 8
+
 /* Get the number of CPUs. */
 unsigned int get_nof_cpus(void);
 
 /* Get the number of active CPUs. */
 unsigned int get_nof_active_cpus(void);
 
+/* Size of a cache line. Data written by different CPUs should not share one. */
+#define CACHE_LINE_SIZE 64
+
+/* Aligns a type or a struct member to a cache line. */
+#define __cacheline_aligned __attribute__((aligned(CACHE_LINE_SIZE)))
+
+/* Gives a global variable a cache line of its own. The linker script keeps these variables in a
+   section of their own, padded to whole lines. */
+#define __cacheline_exclusive __attribute__((aligned(CACHE_LINE_SIZE), section(".data.cacheline")))
+
 /* Relax procedure to use when in a spin-loop */
 #define cpu_relax() asm volatile("pause": : :"memory")
 
+/* Reads the timestamp counter. */
+static inline uint64_t cpu_timestamp(void)
+{
+	uint64_t tsc;
+	asm volatile ("rdtsc" : "=A" (tsc));
+	return tsc;
+}
+
 /* Compile read-write barrier */
 #define cpu_memory_barrier() asm volatile ("" : : : "memory")
 
@@ -51,6 +51,32 @@ static inline bool is_using_kernel_page_tables(void)
 	return pd == phys_kernel_pd;
 }
 
+/*
+	TLB shootdowns.
+*/
+
+/* Number of pages a TLB batch flushes one by one. Larger batches flush the entire TLB. */
+#define TLB_BATCH_MAX_PAGES 32
+
+/* Changes in page tables, collected to be flushed from the TLBs of other CPUs at once. */
+struct tlb_batch
+{
+	paddr_t pd; /* The parent page directory's physical address. */
+	bool global; /* Do the changes contain the global bit? */
+	uint nof_pages; /* Number of modified pages. */
+	xvaddr_t pages[TLB_BATCH_MAX_PAGES]; /* The modified pages, if there are not more of them. */
+};
+
+/* Starts an empty batch of changes in the page tables pd. */
+void tlb_batch_init(struct tlb_batch *batch, paddr_t pd);
+
+/* Adds a modified page to the batch. global - true if the page has the global bit. */
+void tlb_batch_add(struct tlb_batch *batch, xvaddr_t v, bool global);
+
+/* Flushes the pages of the batch on all CPUs that use the page directory, the current one
+   included, and empties the batch. Returns after all of them have flushed. */
+void tlb_batch_flush(struct tlb_batch *batch);
+
 /*
 	General paging utilities.
 */
@@ -64,6 +90,19 @@ void paging_free_dir(paddr_t pd);
 /* Map physical page p to virtual address v using given flags for page tables in pd. */
 void paging_map(paddr_t pd, xvaddr_t v, paddr_t p, pflags_t flags);
 
+/* Map the virtual memory range [v, v + size) using given flags for page tables in pd. The range
+   is mapped to the physical pages starting at p. If p is PHYS_NULL, the pages that are not
+   present yet are mapped to newly allocated pages, and the present ones are left as they are.
+   Each page table is walked only once. The modified pages are added to batch, if not NULL. */
+void paging_map_range(paddr_t pd, xvaddr_t v, size_t size, paddr_t p, pflags_t flags,
+	struct tlb_batch *batch);
+
+/* Unmap the virtual memory range [v, v + size) in page tables pd. The unmapped pages are added to
+   batch. If free is true, the physical pages are also returned to palloc. That may only be done
+   once no CPU can reach them, so in that case the batch is flushed before the call returns. Page
+   tables are kept until the page directory is freed. */
+void paging_unmap_range(paddr_t pd, xvaddr_t v, size_t size, bool free, struct tlb_batch *batch);
+
 /* Get the entry of the virutal address v in page tables pd. */
 pte_t paging_get_entry(paddr_t pd, xvaddr_t v);
 
@@ -98,17 +137,12 @@ bool kp_lock_held(void);
 /* Map one physical page to one virtual page in kernel page tables. */
 void kp_map(vaddr_t v, paddr_t p);
 
-/*
-	Paging inter-processor communication.
-*/
-
-/* Initializes the paging IPI subsystem. */
-void init_paging_ipi(void);
+/* Map the virtual memory range [v, v + size) in kernel page tables, to the physical pages starting
+   at p, or to newly allocated pages if p is PHYS_NULL. Flushes the TLBs once for the whole range. */
+void kp_map_range(vaddr_t v, size_t size, paddr_t p);
 
-/* Propagates changes in page tables to other CPUs.
-   pd - the parent page directory's physical address,
-   v - non-NULL if we only modified this particular page,
-   global - true if the changes contain the global bit. */
-void paging_propagate_changes(paddr_t pd, xvaddr_t v, bool global);
+/* Unmap the virtual memory range [v, v + size) in kernel page tables and free its physical pages.
+   The caller must own the range, so that nothing else maps or unmaps it at the same time. */
+void kp_unmap_range(vaddr_t v, size_t size);
 
 #endif
@@ -5,12 +5,40 @@
 #include <kernel/cdefs.h>
 #include <kernel/cpu.h>
 #include <kernel/thread.h>
+#include <kernel/ticks.h>
+
+/* Queues of runnable threads, one for each priority level, with a bitmap of non-empty queues. */
+#define SCHED_MAX_LEVELS 8
+
+struct prio_array
+{
+	struct thread_queue queues[SCHED_MAX_LEVELS];
+	uint mask;
+};
+
+/* Per-CPU run queue. Threads are normally run by the CPU owning the queue, but idle CPUs steal
+   threads from busy ones and the load balancer moves threads between queues. */
+struct run_queue
+{
+	struct cpu_spinlock lock; /* Protects the queue and the threads assigned to the CPU. */
+	struct prio_array rt; /* Runnable SCHED_RT threads. */
+	struct prio_array mlfq; /* Runnable SCHED_MLFQ threads. */
+	uint mlfq_epoch; /* SCHED_MLFQ boost period of the queued threads' levels. */
+	atomic_uint length; /* Number of queued threads. Can be read without the lock. */
+	struct thread *sleepers; /* Pairing heap of sleeping threads, ordered by sleep_until. */
+	struct thread_queue dead; /* Exited threads, destroyed when the run queue lock is released. */
+	struct thread_queue migrating; /* Threads not allowed on the CPU anymore, moved to another CPU
+	                                  when the run queue lock is released. */
+	atomic_bool idle; /* Is the CPU halted, waiting for a reschedule IPI? */
+	atomic_bool need_resched; /* Has a thread that should preempt the running one been queued? */
+	ticks_t next_balance; /* Tick at which the CPU runs the load balancer next time. */
+};
 
 /* Initializes the global scheduler data and locks. */
 void init_global_scheduler(void);
 
-/* Enters the scheduler. This creates a scheduler thread in the kernel process for the current
-   CPU and starts the scheduler loop. This is final. */
+/* Enters the scheduler. This creates the idle thread in the kernel process for the current CPU
+   and starts the idle loop. This is final. */
 noreturn enter_scheduler(void);
 
 /* Entry point for kernel threads. */
@@ -19,11 +47,24 @@ void kthread_entry(void);
 /* Initial ring 0 switch entry point for user threads. */
 void uthread_switch_entry(void);
 
-/* Make the current thread wait on the given condition. A spinlock is unlocked and then relocked. */
+/* Make the current thread wait on the given condition. A spinlock is unlocked and then relocked.
+   Call with interrupts disabled, so that a notifier in an interrupt handler cannot run on this CPU
+   before the thread has switched out. */
 void sched_thread_wait(struct thread_cond *cond, struct cpu_spinlock *spinlock);
 
 /* Notify a thread waiting on the given cond that it is unlocked. Puts the thread at the beginning
-   of the thread queue. */
-void sched_thread_notify_one(struct thread_cond *cond);
+   of the thread queue. Returns the woken thread or NULL if nobody was waiting. */
+struct thread *sched_thread_notify_one(struct thread_cond *cond);
+
+/* Notify all threads waiting on the given cond. */
+void sched_thread_notify_all(struct thread_cond *cond);
+
+/* Charges a timer tick to the current thread. The thread is preempted if its time slice has run out
+   or a higher-priority thread is waiting. Called from the timer interrupt. */
+void sched_tick(void);
+
+/* Preempts the current thread if a higher-priority thread has become runnable on the current CPU.
+   Called from the reschedule IPI. */
+void sched_preempt(void);
 
 #endif
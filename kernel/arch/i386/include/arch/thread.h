@@ -36,6 +36,9 @@ struct arch_thread
 	xvaddr_t tentry; /* Entry point of the thread. This is what IRET will take the CPU to. */
 };
 
+/* Sets up the caches thread objects are allocated from. Call once the kernel heap is up. */
+void init_thread_cache(void);
+
 /* Builds an empty thread object. This has only one purpose - to create the first kernel thread
    on the CPU. */
 void x86_thread_construct_empty(struct thread *thread, const char *name, uint16_t cs, uint16_t ds);
@@ -0,0 +1,33 @@
+/* arch/time.h - x86 clocksource and timer events */
+#ifndef ARCH_I386_TIME_H
+#define ARCH_I386_TIME_H
+
+#include <kernel/cdefs.h>
+#include <kernel/ktime.h>
+#include <kernel/ticks.h>
+
+/* Length of a scheduler tick. */
+#define TICK_NSEC (NSEC_PER_SEC / TICKS_PER_SECOND)
+
+/* Sets up the TSC clocksource with the TSC frequency measured when calibrating the LAPIC timer.
+   The TSCs of all the CPUs are assumed to be synchronized. */
+void init_clocksource(uint64_t tsc_freq);
+
+/* Converts a time to the TSC value at which it is reached. */
+uint64_t ktime_to_tsc(ktime_t t);
+
+/* Starts the timer events of the current CPU, with the scheduler tick running. Called when the
+   CPU's LAPIC timer is set up. */
+void timer_start_cpu(void);
+
+/* Handles the timer interrupt of the current CPU. Runs the expired timers and programs the next
+   event. Returns true if a scheduler tick was due. */
+bool timer_interrupt(void);
+
+/* Stops the scheduler tick of the current CPU. Timers keep firing. Call with interrupts disabled. */
+void timer_suspend_tick(void);
+
+/* Restarts the scheduler tick of the current CPU. Call with interrupts disabled. */
+void timer_resume_tick(void);
+
+#endif
@@ -5,8 +5,10 @@
 #include <kernel/debug.h>
 #include <kernel/init.h>
 #include <kernel/proc.h>
+#include <kernel/rcu.h>
 #include <kernel/scheduler.h>
 #include <kernel/syscall_impl.h>
+#include <kernel/workqueue.h>
 #include <kernel/fs/devfs.h>
 #include <arch/cpu.h>
 #include <arch/heap.h>
@@ -57,6 +59,7 @@ noreturn generic_x86_init(void)
 	/* Initialize critical shared subsystems. */
 	init_paging();
 	init_kernel_heap(&(vm_map[VM_DYNAMIC_REGION]));
+	init_thread_cache();
 
 	pic_disable();
 	init_global_scheduler();
@@ -72,6 +75,7 @@ noreturn generic_x86_init(void)
 	init_smp();
 
 	/* Initialize driver registers. */
+	vfs_init();
 	devfs_init();
 	init_bdev();
 	cdev_init();
@@ -79,8 +83,15 @@ noreturn generic_x86_init(void)
 	/* Init x86-specific devices. */
 	mpt_enum_ioapics();
 	init_ioapics();
+
+	/* Start the worker threads before the drivers that defer work to them. */
+	init_workqueue();
+	init_vfree_deferred();
 	init_serial();
 
+	/* Start the RCU callback thread. */
+	init_rcu();
+
 	schedule_kernel_thread(early_kernel_main, NULL, "kernel_main");
 
 	/* The kernel has been initialized now. */
@@ -4,8 +4,10 @@
 #include <kernel/debug.h>
 #include <kernel/init.h>
 #include <kernel/proc.h>
+#include <kernel/rcu.h>
 #include <kernel/scheduler.h>
 #include <kernel/thread.h>
+#include <kernel/workqueue.h>
 #include <arch/cpu.h>
 #include <arch/interrupts.h>
 #include <arch/scheduler.h>
@@ -34,22 +36,36 @@ void generic_interrupt_handler(struct isr_frame *frame)
 	else
 		kpanic("unhandled interrupt");
 
-	/* Force thread to give up CPU on clock tick. */
-	if (frame->int_no == INT_IRQ_TIMER)
+	/* Charge clock ticks to the running thread. Timer events in between ticks do not count. */
+	if (frame->int_no == INT_IRQ_TIMER && cpu_current()->timer_tick)
 	{
+		/* Queue the delayed work that is due, even if we cannot be preempted right now. */
+		work_timer_tick();
+
 		cpu = cpu_current();
 
 		/* Do not give up CPU if we have disabled preemption. */
 		if (cpu->preempt_disabled)
 			return;
 
+		/* The interrupted code is not in an RCU read-side section. */
+		rcu_quiescent_state();
+
 		/* Exit thread if the parent process is exiting. */
 		if (cpu->thread && cpu->thread->parent->state == PROC_EXITING)
 			thread_exit();
 
-		/* Preempt. */
+		/* Preempt if the time slice is used up. */
 		if (cpu->thread && cpu->thread->state == THREAD_RUNNING)
-			thread_yield();
+			sched_tick();
+	}
+	else if (frame->int_no == INT_RESCHEDULE_IPI)
+	{
+		cpu = cpu_current();
+
+		/* A higher-priority thread may have been woken up. Otherwise the next tick handles it. */
+		if (!cpu->preempt_disabled && cpu->thread && cpu->thread->state == THREAD_RUNNING)
+			sched_preempt();
 	}
 }
 
@@ -1,6 +1,7 @@
 /* multiboot_init.c - multiboot x86 init */
 #include <kernel/cdefs.h>
 #include <kernel/debug.h>
+#include <kernel/init.h>
 #include <kernel/paging.h>
 #include <kernel/boot/multiboot.h>
 #include <arch/init.h>
@@ -48,6 +49,10 @@ noreturn multiboot_x86_init(struct multiboot_info *info, uint32_t magic)
 	/* Ensure the kernel has been loaded by multiboot. */
 	kassert(magic == MULTIBOOT_BOOTLOADER_MAGIC);
 
+	/* The command line may sit in memory that palloc hands out, so save it first. */
+	if (info->flags & MULTIBOOT_INFO_CMDLINE)
+		init_cmdline(km_vaddr(info->cmdline));
+
 	/* Walk the memory map to initialize palloc. */
 	kassert(mb_has_simple_mmap(info));
 	init_palloc();
@@ -111,31 +111,14 @@ void paging_free_dir(paddr_t pd)
 	pfree(pd);
 }
 
-/* Map physical page p to virtual address v using given flags for page tables in pd. */
-void paging_map(paddr_t pd, xvaddr_t v, paddr_t p, pflags_t flags)
+/* Gets the page table covering v in the page directory vpd, allocating it if there is none yet. */
+static pte_t *get_table(paddr_t pd, pde_t *vpd, xvaddr_t v, pflags_t flags)
 {
-	int pdi, pti;
 	pde_t *pde;
-	pte_t *pte;
 	paddr_t pt;
 
-	if ((flags & PAGE_BIT_GLOBAL) && pd != phys_kernel_pd)
-		kpanic("paging_map(): attempted to use the global flag in non-kernel page directory");
-
-	/* Potential deadlock because of our palloc() use. */
-	check_palloc_lock();
-
-	/* We need to read and write some physical pages. This has to be done with kernel page tables. */
-	kassert(is_using_kernel_page_tables());
-
-	v = (xvaddr_t)mask_to_page(v);
-
-	pdi = get_pd_index(v);
-	pti = get_pt_index(v);
-
 	/* Make sure the PD entry points at our PT. */
-	pde = translate_or_panic(pd);
-	pde = pde + pdi;
+	pde = vpd + get_pd_index(v);
 
 	/* Make sure the we do not overwrite kernel page structures! */
 	if (((*pde) & PAGE_BIT_GLOBAL) && pd != phys_kernel_pd)
@@ -156,13 +139,176 @@ void paging_map(paddr_t pd, xvaddr_t v, paddr_t p, pflags_t flags)
 
 	*pde |= flags | PAGE_BIT_PRESENT;
 
-	/* Modify the PT. */
-	pte = translate_or_panic(pde_get_paddr(*pde));
-	pte = pte + pti;
+	return translate_or_panic(pde_get_paddr(*pde));
+}
+
+/* Number of pages touched by the virtual memory range [v, v + size). */
+static inline size_t range_pages(xvaddr_t v, size_t size)
+{
+	return (get_sub_page_addr(v) + size + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+/* Map physical page p to virtual address v using given flags for page tables in pd. */
+void paging_map(paddr_t pd, xvaddr_t v, paddr_t p, pflags_t flags)
+{
+	kassert(p != PHYS_NULL);
+
+	paging_map_range(pd, v, PAGE_SIZE, p, flags, NULL);
+}
+
+/* Map the virtual memory range [v, v + size) using given flags for page tables in pd. The range
+   is mapped to the physical pages starting at p. If p is PHYS_NULL, the pages that are not
+   present yet are mapped to newly allocated pages, and the present ones are left as they are.
+   Each page table is walked only once. The modified pages are added to batch, if not NULL. */
+void paging_map_range(paddr_t pd, xvaddr_t v, size_t size, paddr_t p, pflags_t flags,
+	struct tlb_batch *batch)
+{
+	size_t n = range_pages(v, size);
+	pde_t *vpd;
+	pte_t *pt;
+	paddr_t page;
+
+	if ((flags & PAGE_BIT_GLOBAL) && pd != phys_kernel_pd)
+		kpanic("paging_map(): attempted to use the global flag in non-kernel page directory");
+
+	/* Potential deadlock because of our palloc() use. */
+	check_palloc_lock();
+
+	/* We need to read and write some physical pages. This has to be done with kernel page tables. */
+	kassert(is_using_kernel_page_tables());
+
+	v = (xvaddr_t)mask_to_page(v);
+	vpd = translate_or_panic(pd);
+
+	while (n > 0)
+	{
+		pt = get_table(pd, vpd, v, flags);
+
+		/* Fill the run of entries in this page table. */
+		for (uint pti = get_pt_index(v); pti < PT_LENGTH && n > 0; pti++, n--, v += PAGE_SIZE)
+		{
+			if (p != PHYS_NULL)
+			{
+				page = p;
+				p += PAGE_SIZE;
+			}
+			else if (pt[pti] & PAGE_BIT_PRESENT)
+			{
+				continue;
+			}
+			else if ((page = palloc()) == PHYS_NULL)
+			{
+				kpanic("paging_map(): out of physical memory");
+			}
+
+			pt[pti] = pte_construct(page, flags | PAGE_BIT_PRESENT);
+
+			if (batch)
+				tlb_batch_add(batch, v, flags & PAGE_BIT_GLOBAL);
+		}
+	}
+}
+
+/* Calls func on the present entries of the range [v, v + size) in the page directory vpd. */
+static void walk_present(pde_t *vpd, xvaddr_t v, size_t n, paddr_t pd,
+	void (*func)(pte_t *pte, xvaddr_t v, void *arg), void *arg)
+{
+	pde_t pde;
+	pte_t *pt;
+
+	while (n > 0)
+	{
+		pde = vpd[get_pd_index(v)];
+
+		if (pde_get_paddr(pde) != PHYS_NULL)
+		{
+			if ((pde & PAGE_BIT_GLOBAL) && pd != phys_kernel_pd)
+				kpanic("paging_unmap_range(): attempted to unmap global kernel pages in non-kernel PD");
+
+			pt = translate_or_panic(pde_get_paddr(pde));
+		}
+		else
+		{
+			pt = NULL;
+		}
+
+		for (uint pti = get_pt_index(v); pti < PT_LENGTH && n > 0; pti++, n--, v += PAGE_SIZE)
+		{
+			if (pt && (pt[pti] & PAGE_BIT_PRESENT))
+				func(&pt[pti], v, arg);
+		}
+	}
+}
+
+static void unmap_entry(pte_t *pte, xvaddr_t v, void *arg)
+{
+	struct tlb_batch *batch = arg;
+
+	tlb_batch_add(batch, v, (*pte) & PAGE_BIT_GLOBAL);
+	*pte = 0;
+}
+
+/* Stops using the entry, but keeps its address to free the page after the TLB flush. */
+static void retire_entry(pte_t *pte, xvaddr_t v, void *arg)
+{
+	struct tlb_batch *batch = arg;
 
-	*pte = pte_construct(p, flags | PAGE_BIT_PRESENT);
+	tlb_batch_add(batch, v, (*pte) & PAGE_BIT_GLOBAL);
+	*pte &= ~PAGE_BIT_PRESENT;
+}
+
+/* Frees the pages of the retired entries of the range, i.e. the ones with an address but not
+   present. */
+static void free_retired(pde_t *vpd, xvaddr_t v, size_t n)
+{
+	pte_t *pt;
+
+	while (n > 0)
+	{
+		pt = NULL;
+
+		if (pde_get_paddr(vpd[get_pd_index(v)]) != PHYS_NULL)
+			pt = translate_or_panic(pde_get_paddr(vpd[get_pd_index(v)]));
+
+		for (uint pti = get_pt_index(v); pti < PT_LENGTH && n > 0; pti++, n--, v += PAGE_SIZE)
+		{
+			if (pt && pte_get_paddr(pt[pti]) != PHYS_NULL)
+			{
+				kassert((pt[pti] & PAGE_BIT_PRESENT) == 0);
+				pfree(pte_get_paddr(pt[pti]));
+				pt[pti] = 0;
+			}
+		}
+	}
+}
+
+/* Unmap the virtual memory range [v, v + size) in page tables pd. The unmapped pages are added to
+   batch. If free is true, the physical pages are also returned to palloc. That may only be done
+   once no CPU can reach them, so in that case the batch is flushed before the call returns. Page
+   tables are kept until the page directory is freed. */
+void paging_unmap_range(paddr_t pd, xvaddr_t v, size_t size, bool free, struct tlb_batch *batch)
+{
+	size_t n = range_pages(v, size);
+	pde_t *vpd;
+
+	/* Potential deadlock because of our pfree() use. */
+	check_palloc_lock();
+
+	/* We need to read and write some physical pages. This has to be done with kernel page tables. */
+	kassert(is_using_kernel_page_tables());
+
+	v = (xvaddr_t)mask_to_page(v);
+	vpd = translate_or_panic(pd);
+
+	if (!free)
+	{
+		walk_present(vpd, v, n, pd, unmap_entry, batch);
+		return;
+	}
 
-	/* TODO: Propagate changes to other CPUs here? */
+	walk_present(vpd, v, n, pd, retire_entry, batch);
+	tlb_batch_flush(batch);
+	free_retired(vpd, v, n);
 }
 
 /* Get the entry of the virutal address v in page tables pd. */
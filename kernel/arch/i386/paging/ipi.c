@@ -1,82 +1,92 @@
-/* arch/i386/paging/ipi.c - paging IPI communication subsystem */
+/* arch/i386/paging/ipi.c - TLB shootdowns */
 #include <kernel/addr.h>
 #include <kernel/cdefs.h>
 #include <kernel/cpu.h>
 #include <arch/cpu.h>
-#include <arch/interrupts.h>
 #include <arch/paging.h>
-#include <arch/cpu/apic.h>
+#include <arch/cpu/smp.h>
 
-/* IPI spinlock. While held, only the CPU holding the lock can issue INT_FLUSH_TLB_IPIs. */
-static struct cpu_spinlock ipi_spinlock;
-static paddr_t ipi_updated_pd;
-static xvaddr_t ipi_updated_page;
-static bool ipi_global;
-static atomic_bool ipi_received;
+/* Starts an empty batch of changes in the page tables pd. */
+void tlb_batch_init(struct tlb_batch *batch, paddr_t pd)
+{
+	batch->pd = pd;
+	batch->global = false;
+	batch->nof_pages = 0;
+}
 
-static void ipi_flush_tlb_handler(__unused struct isr_frame *frame)
+/* Adds a modified page to the batch. global - true if the page has the global bit. */
+void tlb_batch_add(struct tlb_batch *batch, xvaddr_t v, bool global)
 {
-	uint32_t cr3;
+	/* Past the limit, only the count is kept and the whole TLB gets flushed. */
+	if (batch->nof_pages < TLB_BATCH_MAX_PAGES)
+		batch->pages[batch->nof_pages] = v;
 
-	preempt_disable();
+	batch->nof_pages++;
+	batch->global |= global;
+}
+
+/* Does the batch concern the page directory loaded on a CPU? */
+static bool batch_affects(struct tlb_batch *batch, paddr_t cr3)
+{
+	/* Global kernel pages are mapped in every page directory. */
+	if (batch->global && batch->pd == phys_kernel_pd)
+		return true;
+
+	return batch->pd == cr3;
+}
+
+static void flush_tlb_call(void *arg)
+{
+	struct tlb_batch *batch = arg;
 
-	cr3 = cpu_get_cr3();
+	/* The CPU might have switched to another page directory since the batch was sent. */
+	if (!batch_affects(batch, cpu_get_cr3()))
+		return;
 
-	if (ipi_global && ipi_updated_pd == phys_kernel_pd && cr3 != phys_kernel_pd)
+	if (batch->nof_pages <= TLB_BATCH_MAX_PAGES)
 	{
-		/* If kernel pages were modified with a global bit somehow, we need to do a TLB flush
-		   regardless. That will update the kernel part of our page tables. */
-		cpu_flush_tlb();
+		/* INVLPG drops global entries too. */
+		for (uint i = 0; i < batch->nof_pages; i++)
+			asm_invlpg(batch->pages[i]);
 	}
-	else if (ipi_updated_pd == cr3)
+	else if (batch->global)
 	{
-		/* Check if we can just update one page. Otherwise, flush TLB entirely. */
-		if (ipi_updated_page)
-			asm_invlpg(ipi_updated_page);
-		else
-			cpu_flush_tlb();
+		cpu_flush_tlb_global();
+	}
+	else
+	{
+		cpu_flush_tlb();
 	}
-
-	preempt_enable();
-
-	/* Send an EOI and atomically set the received flag. */
-	lapic_eoi();
-	atomic_store(&ipi_received, true);
 }
 
-static void unsafe_propagate_to_cpu(struct x86_cpu *cpu)
+/* Flushes the pages of the batch on all CPUs that use the page directory, the current one
+   included, and empties the batch. Returns after all of them have flushed. */
+void tlb_batch_flush(struct tlb_batch *batch)
 {
-	/* Ignore inactive CPUs. */
-	if (atomic_load(&(cpu->active)) == false)
+	cpu_mask_t mask = 0;
+
+	if (batch->nof_pages == 0)
 		return;
 
-	/* Issue the IPI and actively wait for the other CPU to set the received flag. */
-	atomic_store(&ipi_received, false);
-	lapic_ipi(cpu->lapic_id, INT_FLUSH_TLB_IPI, 0);
-	lapic_ipi_wait();
-	while (atomic_load(&ipi_received) == false)
-		cpu_relax();
-}
+	preempt_disable();
 
-/* Initializes the paging IPI subsystem. */
-void init_paging_ipi(void)
-{
-	cpu_spinlock_create(&ipi_spinlock, "flush TLB IPI");
-	isr_set_handler(INT_FLUSH_TLB_IPI, ipi_flush_tlb_handler);
-}
+	/* Order the page table writes before reading the loaded page directories. A CPU that loads
+	   the page directory after this misses the IPI, but it loads the new entries. Pairs with
+	   cpu_set_cr3(). */
+	atomic_thread_fence(memory_order_seq_cst);
 
-/* Propagates changes in page tables to other CPUs.
-   pd - the parent page directory's physical address,
-   v - non-NULL if we only modified this particular page,
-   global - true if the changes contain the global bit. */
-void paging_propagate_changes(paddr_t pd, xvaddr_t v, bool global)
-{
-	cpu_spinlock_acquire(&ipi_spinlock);
+	/* Most CPUs are not running the process, so they are left alone. */
+	for (uint i = 0; i < get_nof_cpus(); i++)
+	{
+		if (batch_affects(batch, atomic_load(&(cpu_get(i)->cr3))))
+			mask |= cpu_mask_bit(i);
+	}
+
+	/* All the CPUs flush in parallel. We wait, as the batch usually lives on the caller's stack. */
+	if (mask)
+		smp_call_function_mask(mask, flush_tlb_call, batch, true);
 
-	ipi_updated_pd = pd;
-	ipi_updated_page = v;
-	ipi_global = global;
-	cpu_enumerate_other_cpus(unsafe_propagate_to_cpu);
+	preempt_enable();
 
-	cpu_spinlock_release(&ipi_spinlock);
+	tlb_batch_init(batch, batch->pd);
 }
@@ -18,7 +18,6 @@ static struct cpu_spinlock kp_spinlock;
 void init_paging(void)
 {
 	cpu_spinlock_create(&kp_spinlock, "kernel page tables write");
-	init_paging_ipi();
 }
 
 /* Lock kernel paging structures. This ensures they do not change. */
@@ -42,9 +41,21 @@ bool kp_lock_held(void)
 /* Map one physical page to one virtual page in kernel page tables. */
 void kp_map(vaddr_t v, paddr_t p)
 {
+	kassert(p != PHYS_NULL);
+
+	kp_map_range(v, PAGE_SIZE, p);
+}
+
+/* Map the virtual memory range [v, v + size) in kernel page tables, to the physical pages starting
+   at p, or to newly allocated pages if p is PHYS_NULL. Flushes the TLBs once for the whole range. */
+void kp_map_range(vaddr_t v, size_t size, paddr_t p)
+{
+	struct tlb_batch batch;
 	paddr_t prev_cr3;
 	pflags_t flags = vm_get_pflags(v);
 
+	tlb_batch_init(&batch, phys_kernel_pd);
+
 	cpu_spinlock_acquire(&kp_spinlock);
 
 	/* We need to use the kernel page tables, because we might call palloc to allocate a page
@@ -52,13 +63,31 @@ void kp_map(vaddr_t v, paddr_t p)
 	   memory space. */
 	prev_cr3 = cpu_set_cr3(phys_kernel_pd);
 
-	paging_map(phys_kernel_pd, (xvaddr_t)v, p, flags);
-	/* Notify other CPUs of these changes. */
-	paging_propagate_changes(phys_kernel_pd, (xvaddr_t)v, flags & PAGE_BIT_GLOBAL);
-	/* If we think we're not going to switch CR3, we should do INVLPG */
-	if (prev_cr3 == phys_kernel_pd)
-		asm_invlpg(v);
+	/* The whole range has to lie in one region of the virtual memory map, as it gets its flags. */
+	paging_map_range(phys_kernel_pd, (xvaddr_t)v, size, p, flags, &batch);
 	cpu_set_cr3(prev_cr3);
 
 	cpu_spinlock_release(&kp_spinlock);
+
+	/* Notify other CPUs of these changes, and this one if it uses the kernel page tables. */
+	tlb_batch_flush(&batch);
+}
+
+/* Unmap the virtual memory range [v, v + size) in kernel page tables and free its physical pages.
+   The caller must own the range, so that nothing else maps or unmaps it at the same time. */
+void kp_unmap_range(vaddr_t v, size_t size)
+{
+	struct tlb_batch batch;
+	paddr_t prev_cr3;
+
+	tlb_batch_init(&batch, phys_kernel_pd);
+
+	/* The pages may only be freed once all CPUs have flushed them, and we must not wait for that
+	   with interrupts off. So the write lock is not taken. Only the entries of the range change,
+	   and page tables are never freed, so kp_map_range() of other ranges is not affected. */
+	preempt_disable();
+	prev_cr3 = cpu_set_cr3(phys_kernel_pd);
+	paging_unmap_range(phys_kernel_pd, (xvaddr_t)v, size, true, &batch);
+	cpu_set_cr3(prev_cr3);
+	preempt_enable();
 }
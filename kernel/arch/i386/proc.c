@@ -28,7 +28,7 @@ struct proc *proc_alloc(const char *name)
 	kassert(is_using_kernel_page_tables());
 
 	/* Allocate the object on the heap. */
-	proc = kzualloc(HEAP_NORMAL, sizeof(struct proc));
+	proc = kzalloc(HEAP_NORMAL, CACHE_LINE_SIZE, sizeof(struct proc));
 	proc->arch = kzualloc(HEAP_NORMAL, sizeof(struct arch_proc));
 
 	/* Copy the name. */
@@ -37,6 +37,9 @@ struct proc *proc_alloc(const char *name)
 	proc->name[len] = 0;
 
 	LIST_INIT(&(proc->threads));
+	LIST_INIT(&(proc->children));
+	LIST_INIT(&(proc->defunct_children));
+	STAILQ_INIT(&(proc->waiters));
 
 	thread_mutex_create(&(proc->mutex));
 
@@ -90,20 +93,21 @@ void proc_free(struct proc *proc)
 	kfree(proc);
 }
 
-static void unsafe_vmreserve(struct proc *proc, uvaddr_t v, uint flags)
+/* Reserves the pages of [v, v + size) that are not present yet. Adds them to the batch, which the
+   caller flushes. */
+static void unsafe_vmreserve(struct proc *proc, uvaddr_t v, size_t size, uint flags,
+	struct tlb_batch *batch)
 {
-	paddr_t p;
 	pflags_t pflags;
+	uvaddr_t vto;
 
-	/* Get the virtual memory page. */
-	v = (uvaddr_t)mask_to_page(v);
-
-	/* Check if we have to do anything. */
-	p = paging_get(proc->arch->pd, v);
-
-	if (p)
+	if (size == 0)
 		return;
 
+	/* Get the first and the last virtual memory page. */
+	vto = (uvaddr_t)mask_to_page(v + size - 1);
+	v = (uvaddr_t)mask_to_page(v);
+
 	/* Map flags to paging flags. */
 	pflags = PAGE_BIT_PRESENT;
 
@@ -113,29 +117,34 @@ static void unsafe_vmreserve(struct proc *proc, uvaddr_t v, uint flags)
 	if (flags & VM_WRITE)
 		pflags |= PAGE_BIT_RW;
 
-	/* Allocate a physical page and map it. */
-	paging_map(proc->arch->pd, v, palloc(), pflags);
+	/* Allocate physical pages for the missing ones and map them. */
+	paging_map_range(proc->arch->pd, v, (size_t)(vto - v) + PAGE_SIZE, PHYS_NULL, pflags, batch);
 
 	/* Update VM pointers. */
 	if (proc->arch->vfrom == UVNULL)
 		proc->arch->vfrom = v;
 
 	if (proc->arch->vto == UVNULL)
-		proc->arch->vto= v;
+		proc->arch->vto= vto;
 
 	if (proc->arch->vfrom > v)
 		proc->arch->vfrom = v;
 
-	if (proc->arch->vto < v)
-		proc->arch->vto = v;
-
-	/* Notify other CPUs of the changes. */
-	paging_propagate_changes(proc->arch->pd, v, false);
+	if (proc->arch->vto < vto)
+		proc->arch->vto = vto;
 }
 
 /* Reserves a physical page for the virtual memory page pointed at by v. */
 void proc_vmreserve(struct proc *proc, uvaddr_t v, uint flags)
 {
+	proc_vmreserve_range(proc, v, 1, flags);
+}
+
+/* Reserves physical pages for all the virtual memory pages in [v, v + size). */
+void proc_vmreserve_range(struct proc *proc, uvaddr_t v, size_t size, uint flags)
+{
+	struct tlb_batch batch;
+
 	/* We need to read/write some physical pages. This has to be done with kernel page tables. */
 	kassert(is_using_kernel_page_tables());
 
@@ -144,7 +153,9 @@ void proc_vmreserve(struct proc *proc, uvaddr_t v, uint flags)
 		kpanic("proc_vmreserve(): holding palloc lock");
 
 	thread_mutex_acquire(&(proc->arch->pd_mutex));
-	unsafe_vmreserve(proc, v, flags);
+	tlb_batch_init(&batch, proc->arch->pd);
+	unsafe_vmreserve(proc, v, size, flags, &batch);
+	tlb_batch_flush(&batch);
 	thread_mutex_release(&(proc->arch->pd_mutex));
 }
 
@@ -224,6 +235,7 @@ static int unsafe_brk(struct proc *proc, uvaddr_t v)
 {
 	uvaddr_t vfrom;
 	uvaddr_t vto;
+	struct tlb_batch batch;
 
 	/* Make sure we do not go lower than the base break address, and we do not place the new break
 	   address in a kernel-occupied virtual memory region. */
@@ -238,16 +250,26 @@ static int unsafe_brk(struct proc *proc, uvaddr_t v)
 		return -EUNSPEC;
 	}
 
-	/* Reserve new pages. */
 	vfrom = (uvaddr_t)mask_to_page(proc->arch->cur_vbreak);
 	vto = (uvaddr_t)mask_to_page(v);
 
-	while (vfrom <= vto)
+	tlb_batch_init(&batch, proc->arch->pd);
+
+	if (vto >= vfrom)
+	{
+		/* Reserve new pages. */
+		unsafe_vmreserve(proc, vfrom, (size_t)(vto - vfrom) + PAGE_SIZE, VM_USER | VM_WRITE,
+			&batch);
+	}
+	else
 	{
-		unsafe_vmreserve(proc, vfrom, VM_USER | VM_WRITE);
-		vfrom += PAGE_SIZE;
+		/* Release the pages above the new break. The page holding it stays. */
+		paging_unmap_range(proc->arch->pd, vto + PAGE_SIZE, (size_t)(vfrom - vto), true, &batch);
 	}
 
+	/* Notify the CPUs running the process of all the changes at once. */
+	tlb_batch_flush(&batch);
+
 	/* Update VM pointers. */
 	proc->arch->cur_vbreak = v;
 
@@ -0,0 +1,169 @@
+/* rcu.c - x86 implementation of read-copy-update grace periods */
+#include <kernel/cdefs.h>
+#include <kernel/cpu.h>
+#include <kernel/debug.h>
+#include <kernel/rcu.h>
+#include <kernel/scheduler.h>
+#include <kernel/thread.h>
+#include <arch/cpu.h>
+#include <arch/scheduler.h>
+
+/* Interval in milliseconds at which the RCU thread checks for finished grace periods. */
+#define RCU_POLL_MS 10
+
+/* Protects the callback lists and starting grace periods. Held with interrupts disabled, so that
+   call_rcu() can be used in interrupt handlers. */
+static struct cpu_spinlock rcu_lock;
+
+/* Callbacks queued for the next grace period. */
+static struct rcu_head *rcu_next;
+static struct rcu_head **rcu_next_tail;
+
+/* Callbacks waiting for the current grace period to end. */
+static struct rcu_head *rcu_current;
+
+/* Grace periods are numbered. One is in progress if the counters differ. */
+static atomic_uint rcu_gp_started;
+static atomic_uint rcu_gp_completed;
+
+/* CPUs that have not passed a quiescent state in the current grace period. */
+static atomic_uint rcu_cpus_pending;
+
+struct rcu_sync
+{
+	struct rcu_head head;
+	atomic_bool done;
+};
+
+/* Mask of the CPUs that have to pass a quiescent state. CPUs that are not active yet cannot be
+   in a read-side section. Neither can idle CPUs, which may stay halted for a long time. Readers on
+   a CPU that leaves the idle loop after this see the data as it was when the grace period
+   started. */
+static cpu_mask_t active_cpus(void)
+{
+	cpu_mask_t mask = 0;
+	struct x86_cpu *cpu;
+
+	for (uint i = 0; i < get_nof_cpus(); i++)
+	{
+		cpu = cpu_get(i);
+
+		if (atomic_load(&(cpu->active)) && !atomic_load(&(cpu->rq.idle)))
+			mask |= cpu_mask_bit(i);
+	}
+
+	return mask;
+}
+
+/* Starts a grace period for the callbacks queued so far. Requires the RCU lock. */
+static void unsafe_start_grace_period(void)
+{
+	kassert(atomic_load(&rcu_gp_started) == atomic_load(&rcu_gp_completed));
+
+	rcu_current = rcu_next;
+	rcu_next = NULL;
+	rcu_next_tail = &rcu_next;
+
+	/* The counter goes first, so that the CPU clearing the last pending bit completes this grace
+	   period. */
+	atomic_fetch_add(&rcu_gp_started, 1);
+	atomic_store(&rcu_cpus_pending, active_cpus());
+}
+
+/* Runs the callbacks of a finished grace period and starts the next one. */
+static void rcu_process_callbacks(void)
+{
+	struct rcu_head *done = NULL, *head;
+
+	cpu_spinlock_acquire(&rcu_lock);
+	push_no_interrupts();
+
+	if (atomic_load(&rcu_gp_started) == atomic_load(&rcu_gp_completed))
+	{
+		done = rcu_current;
+		rcu_current = NULL;
+
+		if (rcu_next)
+			unsafe_start_grace_period();
+	}
+
+	pop_no_interrupts();
+	cpu_spinlock_release(&rcu_lock);
+
+	while ((head = done) != NULL)
+	{
+		done = head->next;
+		head->func(head);
+	}
+}
+
+static void rcu_main(__unused void *cookie)
+{
+	while (1)
+	{
+		thread_sleep(RCU_POLL_MS);
+		rcu_process_callbacks();
+	}
+}
+
+/* Initializes RCU and starts the thread running the grace period callbacks. */
+void init_rcu(void)
+{
+	cpu_spinlock_create(&rcu_lock, "RCU");
+	rcu_next = NULL;
+	rcu_next_tail = &rcu_next;
+	rcu_current = NULL;
+	atomic_init(&rcu_gp_started, 0);
+	atomic_init(&rcu_gp_completed, 0);
+	atomic_init(&rcu_cpus_pending, 0);
+
+	schedule_kernel_thread(rcu_main, NULL, "rcu");
+}
+
+/* Calls func(head) from a kernel thread once a grace period has passed. Can be called from any
+   context. */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+	head->next = NULL;
+	head->func = func;
+
+	cpu_spinlock_acquire(&rcu_lock);
+	push_no_interrupts();
+	*rcu_next_tail = head;
+	rcu_next_tail = &(head->next);
+	pop_no_interrupts();
+	cpu_spinlock_release(&rcu_lock);
+}
+
+static void rcu_sync_done(struct rcu_head *head)
+{
+	struct rcu_sync *sync = (struct rcu_sync *)head;
+	atomic_store(&(sync->done), true);
+}
+
+/* Sleeps until a grace period has passed. */
+void synchronize_rcu(void)
+{
+	struct rcu_sync sync;
+
+	atomic_init(&(sync.done), false);
+	call_rcu(&(sync.head), rcu_sync_done);
+
+	while (atomic_load(&(sync.done)) == false)
+		thread_sleep(RCU_POLL_MS);
+}
+
+/* Reports a quiescent state of the current CPU. Called by the scheduler with interrupts disabled,
+   when the CPU is not in a read-side section. */
+void rcu_quiescent_state(void)
+{
+	cpu_mask_t bit = cpu_mask_bit(cpu_current()->num);
+
+	/* Cheap check first, this is called on every reschedule and tick. */
+	if ((atomic_load(&rcu_cpus_pending) & bit) == 0)
+		return;
+
+	/* The last CPU to pass a quiescent state ends the grace period. */
+	if (atomic_fetch_and(&rcu_cpus_pending, ~bit) == bit)
+		atomic_store(&rcu_gp_completed, atomic_load(&rcu_gp_started));
+}
@@ -1,22 +1,28 @@
-/* proc.c - x86 process structures and process list manager */
+/* scheduler.c - x86 scheduler, run queues and process list manager */
 #include <kernel/cdefs.h>
 #include <kernel/cpu.h>
 #include <kernel/debug.h>
 #include <kernel/heap.h>
+#include <kernel/init.h>
 #include <kernel/proc.h>
+#include <kernel/rcu.h>
 #include <kernel/scheduler.h>
 #include <kernel/thread.h>
 #include <kernel/ticks.h>
 #include <arch/cpu.h>
+#include <arch/interrupts.h>
 #include <arch/paging.h>
 #include <arch/proc.h>
 #include <arch/thread.h>
+#include <arch/time.h>
+#include <arch/cpu/apic.h>
 #include <arch/cpu/selectors.h>
 
 #include <user/yaos2/kernel/errno.h>
 
-/* Scheduler lock. This applies to all structures used by the scheduler on all CPUs. */
-static struct cpu_spinlock global_scheduler_lock;
+/* Scheduler lock. Protects the process list, the thread lists of processes and process states.
+   Run queues are protected by per-CPU locks, which have to be acquired after this one. */
+static struct cpu_spinlock global_scheduler_lock __cacheline_exclusive;
 
 /* Scheduler checkpoint used to ensure all CPUs enter the scheduler at the same time. */
 static struct cpu_checkpoint scheduler_checkpoint;
@@ -25,47 +31,820 @@ static struct cpu_checkpoint scheduler_checkpoint;
 static struct proc kernel_process;
 static struct arch_proc _kernel_arch_process;
 static struct proc_list processes;
-static atomic_uint next_pid = 1;
-static atomic_uint next_tid = 1;
 
-/* Thread queue. */
-static STAILQ_HEAD(thread_queue, thread) queue;
+/* Every CPU creating processes or threads bumps these, so they do not share lines with anything. */
+static atomic_uint next_pid __cacheline_exclusive = 1;
+static atomic_uint next_tid __cacheline_exclusive = 1;
+
+/* Hash table of processes, by PID. */
+#define PROC_HASH_SIZE 64
+#define proc_hash_bucket(pid) (&(proc_hash[(pid) % PROC_HASH_SIZE]))
+static struct proc_list proc_hash[PROC_HASH_SIZE];
+
+/* CPUs reserved for threads pinned to them. */
+static atomic_uint isolated_cpus;
+
+/* How often each CPU runs the load balancer. */
+#define BALANCE_INTERVAL (10 * TICKS_PER_MILLISECOND)
+
+/* A running thread is preempted once it has used up the time slice of its class, or when a
+   higher-priority thread becomes runnable. A SCHED_MLFQ thread at level L gets the slice << L and is
+   moved a level down when it uses it up. Every MLFQ_BOOST_INTERVAL ticks all threads go back to
+   their base level, so that CPU-bound threads do not starve. */
+#define RT_DEFAULT_SLICE (10 * TICKS_PER_MILLISECOND)
+#define MLFQ_DEFAULT_SLICE (1 * TICKS_PER_MILLISECOND)
+#define MLFQ_BOOST_INTERVAL (1000 * TICKS_PER_MILLISECOND)
+
+/* Longest time slice that can be configured. Keeps the slices of the lowest SCHED_MLFQ level from
+   overflowing. */
+#define SCHED_MAX_SLICE (1000 * TICKS_PER_MILLISECOND)
+
+/* Time slices in ticks, indexed by policy. Can be set on the kernel command line. */
+static atomic_uint time_slices[] = {
+	[SCHED_RT] = RT_DEFAULT_SLICE,
+	[SCHED_MLFQ] = MLFQ_DEFAULT_SLICE,
+};
+
+#define mlfq_current_epoch() ((uint)(ticks_get() / MLFQ_BOOST_INTERVAL))
+
+static void ipi_reschedule_handler(__unused struct isr_frame *frame)
+{
+	/* Nothing to do. The IPI only brings the CPU out of the halt in cpu_idle(). */
+	lapic_eoi();
+}
+
+/* Scheduling policies */
+
+static void prio_array_init(struct prio_array *array)
+{
+	for (int i = 0; i < SCHED_MAX_LEVELS; i++)
+		STAILQ_INIT(&(array->queues[i]));
+
+	array->mask = 0;
+}
+
+/* Puts the thread in the queue of its current level. */
+static void prio_array_push(struct prio_array *array, struct thread *thread, bool head)
+{
+	struct thread_queue *queue = &(array->queues[thread->level]);
+
+	if (head)
+		STAILQ_INSERT_HEAD(queue, thread, sqptrs);
+	else
+		STAILQ_INSERT_TAIL(queue, thread, sqptrs);
+
+	array->mask |= 1u << thread->level;
+}
+
+/* Pops the first thread from the highest non-empty level. */
+static struct thread *prio_array_pop(struct prio_array *array)
+{
+	struct thread_queue *queue;
+	struct thread *thread;
+	int level;
+
+	if (array->mask == 0)
+		return NULL;
+
+	level = __builtin_ctz(array->mask);
+	queue = &(array->queues[level]);
+
+	thread = STAILQ_FIRST(queue);
+	STAILQ_REMOVE_HEAD(queue, sqptrs);
+
+	if (STAILQ_EMPTY(queue))
+		array->mask &= ~(1u << level);
+
+	return thread;
+}
+
+static void prio_array_remove(struct prio_array *array, struct thread *thread)
+{
+	struct thread_queue *queue = &(array->queues[thread->level]);
+
+	STAILQ_REMOVE(queue, thread, thread, sqptrs);
+
+	if (STAILQ_EMPTY(queue))
+		array->mask &= ~(1u << thread->level);
+}
+
+/* Scheduling class. Implements the run queue operations of one scheduling policy. All operations
+   require the run queue lock. */
+struct sched_class
+{
+	/* Puts a runnable thread in the run queue. */
+	void (*enqueue)(struct run_queue *rq, struct thread *thread, bool head);
+
+	/* Takes the thread that should run next out of the run queue. Returns NULL if there is none. */
+	struct thread *(*pick)(struct run_queue *rq);
+
+	/* Takes the given thread out of the run queue. */
+	void (*remove)(struct run_queue *rq, struct thread *thread);
+
+	/* Charges a timer tick to the running thread. Returns true if the thread has used up its time
+	   slice. */
+	bool (*tick)(struct thread *thread);
+};
+
+/* SCHED_RT - fixed priorities, round-robin within a priority. */
+
+static void rt_enqueue(struct run_queue *rq, struct thread *thread, bool head)
+{
+	thread->level = thread->priority;
+	prio_array_push(&(rq->rt), thread, head);
+}
+
+static struct thread *rt_pick(struct run_queue *rq)
+{
+	return prio_array_pop(&(rq->rt));
+}
+
+static void rt_remove(struct run_queue *rq, struct thread *thread)
+{
+	prio_array_remove(&(rq->rt), thread);
+}
+
+static bool rt_tick(struct thread *thread)
+{
+	/* Real-time threads keep their priority. They only take turns within it. */
+	if (++thread->ticks_used < atomic_load(&time_slices[SCHED_RT]))
+		return false;
+
+	thread->ticks_used = 0;
+	return true;
+}
+
+static const struct sched_class rt_class = {
+	.enqueue = rt_enqueue,
+	.pick = rt_pick,
+	.remove = rt_remove,
+	.tick = rt_tick,
+};
+
+/* SCHED_MLFQ - multilevel feedback queue. */
+
+/* Moves the thread back to its base level if a boost period has passed since it was last
+   accounted. */
+static void mlfq_account(struct thread *thread)
+{
+	uint epoch = mlfq_current_epoch();
+
+	if (thread->boost_epoch == epoch)
+		return;
+
+	thread->boost_epoch = epoch;
+	thread->level = thread->priority;
+	thread->ticks_used = 0;
+}
+
+static void mlfq_enqueue(struct run_queue *rq, struct thread *thread, bool head)
+{
+	mlfq_account(thread);
+	prio_array_push(&(rq->mlfq), thread, head);
+}
+
+static struct thread *mlfq_pick(struct run_queue *rq)
+{
+	struct thread_queue boosted;
+	struct thread *thread;
+
+	/* Boost the queued threads once per period. */
+	if (rq->mlfq_epoch != mlfq_current_epoch())
+	{
+		rq->mlfq_epoch = mlfq_current_epoch();
+
+		STAILQ_INIT(&boosted);
+
+		while ((thread = prio_array_pop(&(rq->mlfq))) != NULL)
+			STAILQ_INSERT_TAIL(&boosted, thread, sqptrs);
+
+		while ((thread = STAILQ_FIRST(&boosted)) != NULL)
+		{
+			STAILQ_REMOVE_HEAD(&boosted, sqptrs);
+			mlfq_enqueue(rq, thread, false);
+		}
+	}
+
+	return prio_array_pop(&(rq->mlfq));
+}
+
+static void mlfq_remove(struct run_queue *rq, struct thread *thread)
+{
+	prio_array_remove(&(rq->mlfq), thread);
+}
+
+static bool mlfq_tick(struct thread *thread)
+{
+	mlfq_account(thread);
+
+	if (++thread->ticks_used < (atomic_load(&time_slices[SCHED_MLFQ]) << thread->level))
+		return false;
+
+	/* The thread has used up its slice. Move it down a level. Threads that block before that keep
+	   their level. */
+	thread->ticks_used = 0;
+
+	if (thread->level < SCHED_MLFQ_PRIORITIES - 1)
+		thread->level++;
+
+	return true;
+}
+
+static const struct sched_class mlfq_class = {
+	.enqueue = mlfq_enqueue,
+	.pick = mlfq_pick,
+	.remove = mlfq_remove,
+	.tick = mlfq_tick,
+};
+
+/* Scheduling classes, indexed by policy. Runnable threads of a class always run before threads of
+   the following classes. */
+static const struct sched_class *sched_classes[] = {
+	[SCHED_RT] = &rt_class,
+	[SCHED_MLFQ] = &mlfq_class,
+};
+
+#define NOF_SCHED_CLASSES (sizeof(sched_classes) / sizeof(sched_classes[0]))
+
+/* Time slices */
+
+/* Applies the time slices given on the kernel command line, in microseconds. */
+static void load_boot_time_slices(void)
+{
+	static const char *options[] = {
+		[SCHED_RT] = "sched.rt_slice_us",
+		[SCHED_MLFQ] = "sched.mlfq_slice_us",
+	};
+	uint microseconds;
+
+	for (uint i = 0; i < NOF_SCHED_CLASSES; i++)
+	{
+		if (!cmdline_get_uint(options[i], &microseconds))
+			continue;
+
+		if (sched_set_time_slice(i, microseconds) < 0)
+			kdprintf("Scheduler: invalid %s\n", options[i]);
+	}
+}
 
 /* arch/scheduler.h interface */
 
 /* Initializes the global scheduler data and locks. */
 void init_global_scheduler(void)
 {
-	cpu_spinlock_create(&global_scheduler_lock, "global scheduler");
+	/* Every CPU takes the global lock, so hand it out in FIFO order to keep CPUs from starving.
+	   The run queue locks stay test-and-set, as interrupt handlers take them to wake threads. */
+	cpu_spinlock_create_type(&global_scheduler_lock, "global scheduler", CPU_SPINLOCK_TICKET);
 
 	cpu_checkpoint_create(&scheduler_checkpoint);
 
 	_kernel_arch_process.pd = phys_kernel_pd;
 	kernel_process.arch = &_kernel_arch_process;
 	LIST_INIT(&(kernel_process.threads));
+	LIST_INIT(&(kernel_process.children));
+	LIST_INIT(&(kernel_process.defunct_children));
+	STAILQ_INIT(&(kernel_process.waiters));
 	kernel_process.pid = PID_KERNEL;
 	kernel_process.state = PROC_NEW;
 
 	LIST_INIT(&processes);
 	LIST_INSERT_HEAD(&processes, &kernel_process, pointers);
 
-	STAILQ_INIT(&queue);
+	for (int i = 0; i < PROC_HASH_SIZE; i++)
+		LIST_INIT(&(proc_hash[i]));
+
+	LIST_INSERT_HEAD(proc_hash_bucket(PID_KERNEL), &kernel_process, hptrs);
+
+	/* Initialize the run queues of all CPUs. */
+	for (unsigned int i = 0; i < get_nof_cpus(); i++)
+	{
+		struct run_queue *rq = &(cpu_get(i)->rq);
+
+		cpu_spinlock_create(&(rq->lock), "run queue");
+		prio_array_init(&(rq->rt));
+		prio_array_init(&(rq->mlfq));
+		rq->mlfq_epoch = 0;
+		STAILQ_INIT(&(rq->dead));
+		STAILQ_INIT(&(rq->migrating));
+		atomic_init(&(rq->length), 0);
+		rq->sleepers = NULL;
+		rq->next_balance = 0;
+		atomic_init(&(rq->idle), false);
+		atomic_init(&(rq->need_resched), false);
+	}
+
+	load_boot_time_slices();
+
+	atomic_init(&isolated_cpus, 0);
+
+	isr_set_handler(INT_RESCHEDULE_IPI, ipi_reschedule_handler);
+}
+
+/* CPU affinity */
+
+/* Mask of all existing CPUs. */
+static inline cpu_mask_t all_cpus_mask(void)
+{
+	return cpu_mask_bit(get_nof_cpus()) - 1;
+}
+
+/* Checks whether the given thread may run on the CPU with the given number. An isolated CPU only
+   runs threads that cannot run anywhere else. */
+static bool cpu_allowed(struct thread *thread, int num)
+{
+	cpu_mask_t bit = cpu_mask_bit(num);
+	cpu_mask_t isolated = atomic_load(&isolated_cpus);
+
+	if ((thread->affinity & bit) == 0)
+		return false;
+
+	if ((isolated & bit) && (thread->affinity & all_cpus_mask() & ~isolated))
+		return false;
+
+	return true;
+}
+
+/* Run queue management */
+
+/*
+ * Interrupt handlers wake threads, so they take run queue locks. Spinlocks are recursive and do
+ * not keep interrupts off while held, so a handler would get the lock of its CPU right away and
+ * find the run queue half edited. Run queue locks are therefore only held with interrupts
+ * disabled. A thread switches out holding the lock, so the next thread resumes with interrupts
+ * disabled, too, and enables them once it releases the lock.
+ */
+
+/* Locks the run queue of the given CPU. */
+static void lock_cpu(struct x86_cpu *cpu)
+{
+	cpu_spinlock_acquire(&(cpu->rq.lock));
+	push_no_interrupts();
+}
+
+/* Unlocks the run queue of the given CPU. */
+static void unlock_cpu(struct x86_cpu *cpu)
+{
+	pop_no_interrupts();
+	cpu_spinlock_release(&(cpu->rq.lock));
+}
+
+/* Locks the run queue of the current CPU and returns the CPU. */
+static struct x86_cpu *lock_this_cpu(void)
+{
+	struct x86_cpu *cpu;
+
+	/* Don't want to get rescheduled between cpu_current and the acquire. */
+	preempt_disable();
+	cpu = cpu_current();
+	lock_cpu(cpu);
+	preempt_enable();
+
+	return cpu;
+}
+
+/* Locks the run queue of the CPU the given thread is assigned to and returns the CPU. */
+static struct x86_cpu *lock_thread_cpu(struct thread *thread)
+{
+	struct x86_cpu *cpu;
+
+	while (true)
+	{
+		cpu = cpu_get(thread->cpu);
+		lock_cpu(cpu);
+
+		/* The thread could have been moved to a different CPU before we got the lock. */
+		if (thread->cpu == cpu->num)
+			return cpu;
+
+		unlock_cpu(cpu);
+	}
+}
+
+/* Locks the run queues of two CPUs. Run queue locks are always taken in the order of CPU numbers
+   to avoid dead-locks. */
+static void lock_two_cpus(struct x86_cpu *a, struct x86_cpu *b)
+{
+	if (a->num < b->num)
+	{
+		lock_cpu(a);
+		lock_cpu(b);
+	}
+	else
+	{
+		lock_cpu(b);
+		lock_cpu(a);
+	}
+}
+
+static void unlock_two_cpus(struct x86_cpu *a, struct x86_cpu *b)
+{
+	unlock_cpu(a);
+	unlock_cpu(b);
+}
+
+/* Puts the thread in the run queue of the given CPU. Requires the CPU's run queue lock. */
+static void rq_enqueue(struct x86_cpu *cpu, struct thread *thread, bool head)
+{
+	kassert(cpu_spinlock_held(&(cpu->rq.lock)));
+
+	thread->cpu = cpu->num;
+	sched_classes[thread->policy]->enqueue(&(cpu->rq), thread, head);
+	atomic_fetch_add(&(cpu->rq.length), 1);
+}
+
+/* Pops the thread that should run next from the run queue of the given CPU. Requires the CPU's run
+   queue lock. */
+static struct thread *rq_dequeue(struct x86_cpu *cpu)
+{
+	struct thread *thread;
+
+	kassert(cpu_spinlock_held(&(cpu->rq.lock)));
+
+	for (unsigned int i = 0; i < NOF_SCHED_CLASSES; i++)
+	{
+		thread = sched_classes[i]->pick(&(cpu->rq));
+
+		if (thread)
+		{
+			atomic_fetch_sub(&(cpu->rq.length), 1);
+			return thread;
+		}
+	}
+
+	return NULL;
+}
+
+/* Should the given thread run before the other one? Classes come first, then queue levels. */
+static bool sched_before(struct thread *thread, struct thread *other)
+{
+	if (thread->policy != other->policy)
+		return thread->policy < other->policy;
+
+	return thread->level < other->level;
 }
 
-/* Adds the given thread to the given process and sets both to READY. Requires the process table
+/* Takes the given READY thread out of the run queue of the given CPU. Requires the CPU's run queue
    lock. */
+static void rq_remove(struct x86_cpu *cpu, struct thread *thread)
+{
+	kassert(cpu_spinlock_held(&(cpu->rq.lock)));
+	kassert(thread->state == THREAD_READY && thread->cpu == cpu->num);
+
+	sched_classes[thread->policy]->remove(&(cpu->rq), thread);
+	atomic_fetch_sub(&(cpu->rq.length), 1);
+}
+
+/* Sleep heap management. Sleeping threads are kept in a pairing heap, so that the scheduler only
+   has to look at the root to find out whether any thread should be woken up. */
+
+/* Melds two sleep heaps. Returns the new root. */
+static struct thread *sleep_heap_meld(struct thread *a, struct thread *b)
+{
+	struct thread *tmp;
+
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+
+	/* Make a the root with the earlier wake-up tick. */
+	if (b->sleep_until < a->sleep_until)
+	{
+		tmp = a;
+		a = b;
+		b = tmp;
+	}
+
+	b->sleep_sibling = a->sleep_child;
+	a->sleep_child = b;
+
+	return a;
+}
+
+/* Puts the thread in the sleep heap of the given CPU. Requires the CPU's run queue lock. */
+static void sleep_heap_insert(struct x86_cpu *cpu, struct thread *thread)
+{
+	kassert(cpu_spinlock_held(&(cpu->rq.lock)));
+
+	thread->cpu = cpu->num;
+	thread->sleep_child = NULL;
+	thread->sleep_sibling = NULL;
+	cpu->rq.sleepers = sleep_heap_meld(cpu->rq.sleepers, thread);
+}
+
+/* Pops the thread with the earliest wake-up tick from the sleep heap of the given CPU. Requires the
+   CPU's run queue lock. */
+static struct thread *sleep_heap_pop(struct x86_cpu *cpu)
+{
+	struct thread *root, *a, *b, *next, *pairs;
+
+	kassert(cpu_spinlock_held(&(cpu->rq.lock)));
+
+	root = cpu->rq.sleepers;
+
+	if (root == NULL)
+		return NULL;
+
+	/* First pass: meld the children in pairs, from left to right. The results are put in a list,
+	   linked in reverse order. */
+	pairs = NULL;
+	a = root->sleep_child;
+
+	while (a)
+	{
+		b = a->sleep_sibling;
+		next = b ? b->sleep_sibling : NULL;
+
+		a->sleep_sibling = NULL;
+		if (b)
+			b->sleep_sibling = NULL;
+
+		a = sleep_heap_meld(a, b);
+		a->sleep_sibling = pairs;
+		pairs = a;
+
+		a = next;
+	}
+
+	/* Second pass: meld the pairs into one heap, from right to left. */
+	cpu->rq.sleepers = NULL;
+
+	while (pairs)
+	{
+		next = pairs->sleep_sibling;
+		pairs->sleep_sibling = NULL;
+		cpu->rq.sleepers = sleep_heap_meld(cpu->rq.sleepers, pairs);
+		pairs = next;
+	}
+
+	root->sleep_child = NULL;
+
+	return root;
+}
+
+/* Moves threads with an expired sleep from the sleep heap to the run queue of the given CPU.
+   Requires the CPU's run queue lock. Returns true if a woken thread should run before the one
+   running on the CPU. */
+static bool wake_sleepers(struct x86_cpu *cpu)
+{
+	struct thread *thread;
+	ticks_t now = ticks_get();
+	bool preempt = false;
+
+	while (cpu->rq.sleepers && cpu->rq.sleepers->sleep_until <= now)
+	{
+		thread = sleep_heap_pop(cpu);
+		thread->sleep_since = 0;
+		thread->sleep_until = 0;
+
+		if (cpu_allowed(thread, cpu->num))
+		{
+			thread->state = THREAD_READY;
+			rq_enqueue(cpu, thread, false);
+
+			if (cpu->thread && cpu->thread != cpu->idle && sched_before(thread, cpu->thread))
+				preempt = true;
+		}
+		else
+		{
+			thread->state = THREAD_MIGRATING;
+			STAILQ_INSERT_TAIL(&(cpu->rq.migrating), thread, sqptrs);
+		}
+	}
+
+	return preempt;
+}
+
+/* Sends a reschedule IPI to the given CPU. */
+static void send_reschedule_ipi(struct x86_cpu *cpu)
+{
+	/* An interrupt handler could issue another IPI between the ICR writes. */
+	push_no_interrupts();
+	lapic_ipi(cpu->lapic_id, INT_RESCHEDULE_IPI, 0);
+	lapic_ipi_wait();
+	pop_no_interrupts();
+}
+
+/* Lets idle CPUs know that the given thread has been put in the run queue of the given CPU. If that
+   CPU is idle, it is woken up. Otherwise, another idle CPU the thread may run on is woken up to
+   steal the thread. */
+static void kick_idle_cpu(struct x86_cpu *cpu, struct thread *thread)
+{
+	struct x86_cpu *other;
+
+	if (atomic_load(&(cpu->rq.idle)))
+	{
+		send_reschedule_ipi(cpu);
+		return;
+	}
+
+	for (unsigned int i = 0; i < get_nof_cpus(); i++)
+	{
+		other = cpu_get(i);
+
+		if (other != cpu && atomic_load(&(other->rq.idle)) && cpu_allowed(thread, other->num))
+		{
+			send_reschedule_ipi(other);
+			return;
+		}
+	}
+}
+
+/* Chooses the CPU with the shortest run queue among the CPUs the given thread may run on. */
+static struct x86_cpu *select_cpu(struct thread *thread)
+{
+	struct x86_cpu *cpu, *best = NULL;
+	uint best_length = 0, length;
+
+	for (unsigned int i = 0; i < get_nof_cpus(); i++)
+	{
+		cpu = cpu_get(i);
+
+		if (!cpu_allowed(thread, cpu->num))
+			continue;
+
+		length = atomic_load(&(cpu->rq.length));
+
+		if (best == NULL || length < best_length)
+		{
+			best = cpu;
+			best_length = length;
+		}
+	}
+
+	if (best == NULL)
+		kpanic("select_cpu(): no CPU allowed for the thread");
+
+	return best;
+}
+
+/* Makes the given thread READY and puts it in the run queue of the CPU it is assigned to. If the
+   thread may not run on that CPU anymore, it is put on another one. */
+static void wake_thread(struct thread *thread, bool head)
+{
+	struct x86_cpu *cpu;
+
+	cpu = lock_thread_cpu(thread);
+
+	if (!cpu_allowed(thread, cpu->num))
+	{
+		/* The thread is not in any queue, so nobody else will move it in the meantime. */
+		thread->cpu = select_cpu(thread)->num;
+		unlock_cpu(cpu);
+		cpu = lock_thread_cpu(thread);
+	}
+
+	thread->state = THREAD_READY;
+	rq_enqueue(cpu, thread, head);
+	kick_idle_cpu(cpu, thread);
+
+	/* The running thread does not wait for the end of its slice if the woken one goes first. */
+	if (cpu->thread && cpu->thread != cpu->idle && sched_before(thread, cpu->thread) &&
+		!atomic_exchange(&(cpu->rq.need_resched), true))
+		send_reschedule_ipi(cpu);
+
+	unlock_cpu(cpu);
+}
+
+/* Chooses the CPU, other than the given one, with the longest run queue. */
+static struct x86_cpu *select_busiest_cpu(struct x86_cpu *self)
+{
+	struct x86_cpu *cpu, *busiest = NULL;
+	uint busiest_length = 0, length;
+
+	for (unsigned int i = 0; i < get_nof_cpus(); i++)
+	{
+		cpu = cpu_get(i);
+
+		if (cpu == self)
+			continue;
+
+		length = atomic_load(&(cpu->rq.length));
+
+		if (length > busiest_length)
+		{
+			busiest = cpu;
+			busiest_length = length;
+		}
+	}
+
+	return busiest;
+}
+
+/* Moves up to max threads, which may run on the given CPU, from the head of the victim's run queue
+   to the tail of the given CPU's run queue. Returns the number of moved threads. */
+static uint pull_threads(struct x86_cpu *cpu, struct x86_cpu *victim, uint max)
+{
+	struct thread_queue skipped;
+	struct thread *thread;
+	uint num = 0;
+
+	STAILQ_INIT(&skipped);
+	lock_two_cpus(cpu, victim);
+
+	while (num < max && (thread = rq_dequeue(victim)) != NULL)
+	{
+		if (cpu_allowed(thread, cpu->num))
+		{
+			rq_enqueue(cpu, thread, false);
+			num++;
+		}
+		else
+		{
+			/* Inserted at the head, so that putting them back restores the victim's order. */
+			STAILQ_INSERT_HEAD(&skipped, thread, sqptrs);
+		}
+	}
+
+	while ((thread = STAILQ_FIRST(&skipped)) != NULL)
+	{
+		STAILQ_REMOVE_HEAD(&skipped, sqptrs);
+		rq_enqueue(victim, thread, true);
+	}
+
+	unlock_two_cpus(cpu, victim);
+
+	return num;
+}
+
+/* Steals half of the threads from the first CPU that has threads the given CPU may run, starting
+   with the busiest CPU. Called by the idle thread. Returns the number of stolen threads. */
+static uint steal_threads(struct x86_cpu *cpu)
+{
+	struct x86_cpu *busiest, *victim;
+	uint length, num;
+
+	busiest = select_busiest_cpu(cpu);
+
+	if (busiest == NULL)
+		return 0;
+
+	length = atomic_load(&(busiest->rq.length));
+	num = pull_threads(cpu, busiest, (length + 1) / 2);
+
+	/* The busiest CPU might only have threads pinned to other CPUs. */
+	for (unsigned int i = 0; num == 0 && i < get_nof_cpus(); i++)
+	{
+		victim = cpu_get(i);
+		length = atomic_load(&(victim->rq.length));
+
+		if (victim == cpu || victim == busiest || length == 0)
+			continue;
+
+		num = pull_threads(cpu, victim, (length + 1) / 2);
+	}
+
+	return num;
+}
+
+/* Evens out the run queue lengths of the given CPU and the busiest CPU. Called periodically on
+   preemption and by the idle thread. */
+static void balance_threads(struct x86_cpu *cpu)
+{
+	struct x86_cpu *victim;
+	uint length, victim_length;
+
+	cpu->rq.next_balance = ticks_get() + BALANCE_INTERVAL;
+
+	victim = select_busiest_cpu(cpu);
+
+	if (victim == NULL)
+		return;
+
+	length = atomic_load(&(cpu->rq.length));
+	victim_length = atomic_load(&(victim->rq.length));
+
+	if (victim_length > length + 1)
+		pull_threads(cpu, victim, (victim_length - length) / 2);
+}
+
+/* Adds the given thread to the given process and sets both to READY. The thread is put in the
+   run queue of the least loaded CPU. Requires the process table lock. */
 static void insert_thread(struct proc *proc, struct thread *thread)
 {
 	kassert(cpu_spinlock_held(&global_scheduler_lock));
 
 	LIST_INSERT_HEAD(&(proc->threads), thread, lptrs);
 
-	thread->state = THREAD_READY;
 	proc->state = PROC_READY;
 	proc->exit_status = -ENOSTATUS;
 
-	if (thread->state == THREAD_READY)
-		STAILQ_INSERT_TAIL(&queue, thread, sqptrs);
+	thread->cpu = select_cpu(thread)->num;
+	wake_thread(thread, false);
+}
+
+/* Finds the process with the given PID. Requires the process table lock. */
+static struct proc *find_proc(pid_t pid)
+{
+	struct proc *proc;
+
+	kassert(cpu_spinlock_held(&global_scheduler_lock));
+
+	LIST_FOREACH(proc, proc_hash_bucket(pid), hptrs)
+		if (proc->pid == pid)
+			return proc;
+
+	return NULL;
 }
 
 static void collect_process(struct proc *proc)
@@ -74,18 +853,34 @@ static void collect_process(struct proc *proc)
 
 	proc->state = PROC_TRUNCATE;
 
+	/* Take the process off its parent's list and the process table. */
+	LIST_REMOVE(proc, cptrs);
+	LIST_REMOVE(proc, hptrs);
+	LIST_REMOVE(proc, pointers);
+
 	/* TODO: Actually free the process. */
 }
 
 static void make_process_defunct(struct proc *proc)
 {
-	struct proc *parent_proc;
-	struct thread *parent_thread;
-	bool collected;
+	struct proc *parent, *child;
+	struct thread *waiter;
 
 	kassert(cpu_spinlock_held(&global_scheduler_lock));
 	proc->state = PROC_DEFUNCT;
 
+	/* Nobody will wait for our children anymore. Give the running ones to the kernel process and
+	   collect the ones that have already exited. */
+	while ((child = LIST_FIRST(&(proc->children))) != NULL)
+	{
+		LIST_REMOVE(child, cptrs);
+		child->parent = PID_KERNEL;
+		LIST_INSERT_HEAD(&(kernel_process.children), child, cptrs);
+	}
+
+	while ((child = LIST_FIRST(&(proc->defunct_children))) != NULL)
+		collect_process(child);
+
 	/* The process has no real parent. Collect it immediately. */
 	if (proc->parent == PID_KERNEL)
 	{
@@ -93,32 +888,26 @@ static void make_process_defunct(struct proc *proc)
 		return;
 	}
 
-	/* Try to wake up a thread waiting in the parent process. */
-	collected = false;
+	parent = find_proc(proc->parent);
+	kassert(parent);
 
-	LIST_FOREACH(parent_proc, &processes, pointers)
-	{
-		if (parent_proc->pid != proc->parent)
-			continue;
-
-		LIST_FOREACH(parent_thread, &(parent_proc->threads), lptrs)
-		{
-			if (parent_thread->state != THREAD_WAITING)
-				continue;
-
-			/* TODO: Should we actually wake up multiple threads? */
-			parent_thread->collected_pid = proc->pid;
-			parent_thread->collected_status = proc->exit_status;
-			parent_thread->state = THREAD_READY;
-			/* Reschedule the thread. */
-			STAILQ_INSERT_TAIL(&queue, parent_thread, sqptrs);
-			collected = true;
-		}
-	}
+	/* Hand the process straight to a thread waiting in the parent process, if there is one.
+	   Otherwise, leave it for the next wait(). */
+	waiter = STAILQ_FIRST(&(parent->waiters));
 
-	/* If we have woken up a thread, collect the process. */
-	if (collected)
+	if (waiter)
+	{
+		STAILQ_REMOVE_HEAD(&(parent->waiters), cqptrs);
+		waiter->collected_pid = proc->pid;
+		waiter->collected_status = proc->exit_status;
 		collect_process(proc);
+		wake_thread(waiter, false);
+	}
+	else
+	{
+		LIST_REMOVE(proc, cptrs);
+		LIST_INSERT_HEAD(&(parent->defunct_children), proc, cptrs);
+	}
 }
 
 
@@ -148,6 +937,83 @@ static void destroy_thread(struct thread *thread)
 	}
 }
 
+/* Unlocks the run queue of the current CPU, moves threads that may not run on it anymore to other
+   CPUs and destroys threads that have exited on it. Note that after a reschedule() this may be a
+   different CPU than the one locked by lock_this_cpu(). */
+static void unlock_this_cpu(void)
+{
+	struct x86_cpu *cpu;
+	struct thread_queue dead, migrating;
+	struct thread *thread;
+
+	STAILQ_INIT(&dead);
+	STAILQ_INIT(&migrating);
+
+	cpu = cpu_current();
+	STAILQ_CONCAT(&dead, &(cpu->rq.dead));
+	STAILQ_CONCAT(&migrating, &(cpu->rq.migrating));
+	unlock_cpu(cpu);
+
+	/* The migrating threads have been switched out, so another CPU can pick them up. */
+	while ((thread = STAILQ_FIRST(&migrating)) != NULL)
+	{
+		STAILQ_REMOVE_HEAD(&migrating, sqptrs);
+		wake_thread(thread, false);
+	}
+
+	if (STAILQ_EMPTY(&dead))
+		return;
+
+	/* The exited threads have been switched out, so their stacks can be freed. This is done
+	   outside of the run queue lock, as the process list lock has to be taken first. */
+	cpu_spinlock_acquire(&global_scheduler_lock);
+
+	while ((thread = STAILQ_FIRST(&dead)) != NULL)
+	{
+		STAILQ_REMOVE_HEAD(&dead, sqptrs);
+		destroy_thread(thread);
+	}
+
+	cpu_spinlock_release(&global_scheduler_lock);
+}
+
+/* Halts the CPU until an interrupt arrives, unless there is work to be done. Called by the idle
+   thread when the run queue is empty. */
+static void cpu_idle(struct x86_cpu *cpu)
+{
+	bool tickless;
+
+	push_no_interrupts();
+
+	/* Announce that we are idle before checking for work. Whoever queues a thread after this
+	   point will send us a reschedule IPI. */
+	atomic_store(&(cpu->rq.idle), true);
+
+	if (atomic_load(&(cpu->rq.length)) > 0 || steal_threads(cpu) > 0)
+		goto _cpu_idle_done;
+
+	/* We do not need the tick if no thread is sleeping on this CPU. The boot CPU keeps it, as it
+	   maintains the ticks count. */
+	tickless = !is_boot_cpu() && cpu->rq.sleepers == NULL;
+
+	if (tickless)
+		timer_suspend_tick();
+
+	/* A grace period may have started before we announced that we are idle. We might not
+	   reschedule or take a tick for a long time, so do not hold it up. */
+	rcu_quiescent_state();
+
+	cpu_sti_hlt();
+	cpu_force_cli();
+
+	if (tickless)
+		timer_resume_tick();
+
+_cpu_idle_done:
+	atomic_store(&(cpu->rq.idle), false);
+	pop_no_interrupts();
+}
+
 static inline void store_interrupts(struct thread *thread, struct x86_cpu *cpu)
 {
 	thread->arch->int_enabled = cpu->int_enabled;
@@ -165,151 +1031,158 @@ static inline void restore_interrupts(struct thread *thread, struct x86_cpu *cpu
 		cpu_force_cli();
 }
 
-/* Enters the scheduler. This creates a scheduler thread in the kernel process for the current
-   CPU and starts the scheduler loop. This is final. */
-noreturn enter_scheduler(void)
+/* Switches from the previous thread to the next thread on the given CPU. The run queue lock is
+   handed over to the next thread. */
+static void switch_to(struct x86_cpu *cpu, struct thread *prev, struct thread *next)
 {
-	struct x86_cpu *cpu;
-	struct thread *thread;
+	next->sched_count++;
 
-	cpu = cpu_current();
+	/* Remember the previous thread's state of interrupts and which CR3 it was using. */
+	store_interrupts(prev, cpu);
+	prev->arch->cr3 = cpu_get_cr3();
 
-	/* Create the scheduler thread. */
-	cpu_spinlock_acquire(&global_scheduler_lock);
-	cpu->scheduler_thread.arch = &(cpu->scheduler_arch_thread);
-	x86_thread_construct_empty(&(cpu->scheduler_thread), "scheduler thread", KERNEL_CODE_SELECTOR,
-		KERNEL_DATA_SELECTOR);
-	cpu->scheduler_thread.parent = &kernel_process;
-	cpu->scheduler = &(cpu->scheduler_thread);
-	insert_thread(&kernel_process, cpu->scheduler);
-	/* The scheduler thread should not be scheduled! */
-	cpu->scheduler->state = THREAD_SCHEDULER;
-	cpu_spinlock_release(&global_scheduler_lock);
+	cpu->thread = next;
 
-	/* Set the scheduler fields in the CPU. */
-	cpu->thread = NULL;
-	thread = NULL;
+	if (next != cpu->idle)
+		next->state = THREAD_RUNNING;
 
-	/* Wait for all other CPUs to enter the scheduler loop. */
-	cpu_checkpoint_enter(&scheduler_checkpoint);
+	/* Restore the next thread's state of the interrupts. */
+	restore_interrupts(next, cpu);
 
-	while (true)
-	{
-		/* Enable interrupts on this CPU. */
-		if ((cpu_get_eflags() & EFLAGS_IF) == 0)
-			cpu_set_interrupts_with_cpu(cpu, true);
+	/* Setup TSS for execution of the next thread on the CPU. CR3 is only reloaded if the address
+	   space changes. */
+	cpu_setup_tss(cpu, next);
+	cpu_set_cr3(next->arch->cr3);
+
+	x86_thread_switch(prev->arch, next->arch);
+}
 
-		cpu_spinlock_acquire(&global_scheduler_lock);
+/* Picks the next thread to run on the current CPU and switches to it. The current thread should
+   have changed its state before calling this. Requires the current CPU's run queue lock. */
+static void reschedule(void)
+{
+	struct x86_cpu *cpu = cpu_current();
+	struct thread *prev = cpu->thread;
+	struct thread *next;
 
-		/* Pop a thread from the queue. */
-		thread = STAILQ_FIRST(&queue);
+	/* We should not hold more than the run queue lock. Otherwise we can run into issues if the
+	   thread ends up on a different CPU. */
+	if (cpu->preempt_disabled > 1)
+		kpanic("reschedule(): preemption was disabled");
 
-		if (!thread)
-			goto _scheduler_continue;
+	if (prev == NULL)
+		kpanic("reschedule(): no thread is running");
+	if (!cpu_spinlock_held(&(cpu->rq.lock)))
+		kpanic("reschedule(): run queue lock not held");
+	if (prev->state == THREAD_RUNNING)
+		kpanic("reschedule(): bad thread state");
 
-		STAILQ_REMOVE_HEAD(&queue, sqptrs);
+	/* Read-side sections cannot span a reschedule, so this is a quiescent state. */
+	rcu_quiescent_state();
 
-		/* Do some thread queue management. */
-		if (thread->state == THREAD_EXITED)
-		{
-			/* Thread has exited. Destroy it and try getting a new thread from the queue. */
-			destroy_thread(thread);
-			goto _scheduler_continue;
-		}
+	/* We pick the best thread now, so a pending preemption request is served. */
+	atomic_store(&(cpu->rq.need_resched), false);
 
-		if (thread->state == THREAD_SLEEPING)
-		{
-			if (thread->sleep_until < ticks_get())
-			{
-				/* We can now run it. */
-				thread->state = THREAD_READY;
-				thread->sleep_since = 0;
-				thread->sleep_until = 0;
-			}
-			else
-			{
-				/* Still sleeping. Put it back in the queue. */
-				STAILQ_INSERT_TAIL(&queue, thread, sqptrs);
-				goto _scheduler_continue;
-			}
-		}
+	/* A thread that may not run on this CPU anymore goes to another one. */
+	if (prev->state == THREAD_READY && !cpu_allowed(prev, cpu->num))
+		prev->state = THREAD_MIGRATING;
 
-		/* Try running the thread. */
-		if (thread->state == THREAD_READY)
-		{
-			thread->sched_count++;
+	/* Wake up threads whose sleep has expired, so that they can be picked. */
+	wake_sleepers(cpu);
 
-			/* Store the original state of the interrupts in the scheduler thread. */
-			store_interrupts(cpu->scheduler, cpu);
+	next = rq_dequeue(cpu);
 
-			/* Switch to chosen thread. It is the thread's job to release the process list lock and
-			   reaquire it before switching back to scheduler. */
-			cpu->thread = thread;
+	if (next == NULL)
+	{
+		/* Nothing else to run. A yielding thread simply keeps running. */
+		if (prev == cpu->idle)
+			return;
 
-			/* Restore the thread's state of the interrupts. */
-			restore_interrupts(cpu->thread, cpu);
+		if (prev->state == THREAD_READY)
+		{
+			prev->state = THREAD_RUNNING;
+			return;
+		}
 
-			/* Setup TSS for execution of the given thread on the CPU. */
-			cpu_setup_tss(cpu, thread);
-			cpu_set_cr3(thread->arch->cr3);
+		next = cpu->idle;
+	}
 
-			thread->state = THREAD_RUNNING;
+	/* Put the previous thread back on this CPU's queue or in the sleep heap. Migrating threads are
+	   moved and exited threads are destroyed by whoever releases the run queue lock after the
+	   switch. */
+	if (prev->state == THREAD_READY)
+		rq_enqueue(cpu, prev, false);
+	else if (prev->state == THREAD_SLEEPING)
+		sleep_heap_insert(cpu, prev);
+	else if (prev->state == THREAD_MIGRATING)
+		STAILQ_INSERT_TAIL(&(cpu->rq.migrating), prev, sqptrs);
+	else if (prev->state == THREAD_EXITED)
+		STAILQ_INSERT_TAIL(&(cpu->rq.dead), prev, sqptrs);
+
+	switch_to(cpu, prev, next);
+}
 
-			x86_thread_switch(cpu->scheduler->arch, thread->arch);
+/* Enters the scheduler. This creates the idle thread in the kernel process for the current CPU
+   and starts the idle loop. This is final. */
+noreturn enter_scheduler(void)
+{
+	struct x86_cpu *cpu;
 
-			/* Remember which CR3 we were using. */
-			cpu->thread->arch->cr3 = cpu_get_cr3();
+	cpu = cpu_current();
 
-			/* Switch back to kernel CR3. */
-			cpu_set_cr3(phys_kernel_pd);
+	/* Create the idle thread. The idle thread should not be scheduled, so it is never put in any
+	   run queue. Threads switch to it when there is nothing else to run. */
+	cpu_spinlock_acquire(&global_scheduler_lock);
+	cpu->idle_thread.arch = &(cpu->idle_arch_thread);
+	x86_thread_construct_empty(&(cpu->idle_thread), "idle thread", KERNEL_CODE_SELECTOR,
+		KERNEL_DATA_SELECTOR);
+	cpu->idle_thread.parent = &kernel_process;
+	cpu->idle_thread.cpu = cpu->num;
+	cpu->idle = &(cpu->idle_thread);
+	LIST_INSERT_HEAD(&(kernel_process.threads), cpu->idle, lptrs);
+	cpu->idle->state = THREAD_IDLE;
+	cpu_spinlock_release(&global_scheduler_lock);
 
-			/* Store the thread's state of interrupts. */
-			store_interrupts(cpu->thread, cpu);
+	/* From now on, the CPU is running the idle thread. */
+	cpu->thread = cpu->idle;
 
-			/* Thread is done running for now. It should have changed its state before coming
-			   back. */
-			cpu->thread = NULL;
+	/* Wait for all other CPUs to enter the idle loop. */
+	cpu_checkpoint_enter(&scheduler_checkpoint);
 
-			/* Restore the original state of the interrupts from the scheduler thread. */
-			restore_interrupts(cpu->scheduler, cpu);
-		}
-_scheduler_continue:
-		cpu_spinlock_release(&global_scheduler_lock);
-	}
+	while (true)
+	{
+		/* Enable interrupts on this CPU. */
+		if ((cpu_get_eflags() & EFLAGS_IF) == 0)
+			cpu_set_interrupts_with_cpu(cpu, true);
 
-	kpanic("enter_scheduler(): scheduler exited");
-}
+		/* Look for work on other CPUs if we have nothing to do. Otherwise, even out the load from
+		   time to time. */
+		if (atomic_load(&(cpu->rq.length)) == 0)
+			steal_threads(cpu);
+		else if (ticks_get() >= cpu->rq.next_balance)
+			balance_threads(cpu);
 
-static void reschedule(void)
-{
-	struct x86_cpu *cpu = cpu_current();
-	struct thread *thread = cpu->thread;
+		lock_this_cpu();
 
-	/* We should not hold more than the global scheduler lock. Otherwise we can run into issues
-	   if the thread ends up on a different CPU. */
-	if (cpu->preempt_disabled > 1)
-		kpanic("reschedule(): preemption was disabled");
+		/* Run other threads until there is nothing left to run. */
+		if (atomic_load(&(cpu->rq.length)) > 0 || cpu->rq.sleepers)
+			reschedule();
 
-	if (thread == NULL)
-		kpanic("reschedule(): no thread is running");
-	if (!cpu_spinlock_held(&global_scheduler_lock))
-		kpanic("reschedule(): process list lock not held");
-	if (thread->state == THREAD_RUNNING)
-		kpanic("reschedule(): bad thread state");
+		unlock_this_cpu();
 
-	/* Put the thread back on the scheduler's queue. */
-	if (thread->state != THREAD_BLOCKED && thread->state != THREAD_WAITING)
-		STAILQ_INSERT_TAIL(&queue, thread, sqptrs);
+		/* Nothing to run. Halt until something changes. */
+		cpu_idle(cpu);
+	}
 
-	/* Do the switch. The scheduler loop takes care of interrupts stack. */
-	x86_thread_switch(thread->arch, cpu->scheduler->arch);
+	kpanic("enter_scheduler(): scheduler exited");
 }
 
 /* Entry point for kernel threads. */
 void kthread_entry(void)
 {
-	/* We enter with the global scheduler lock. We have to release it for other schedulers to work. */
-	cpu_spinlock_release(&global_scheduler_lock);
+	/* We enter with the run queue lock and interrupts disabled. We have to release it for the
+	   scheduler to work. */
+	unlock_this_cpu();
 
 	if((cpu_get_eflags() & EFLAGS_IF) == 0)
 		kpanic("thread_entry(): interrupts not enabled");
@@ -322,13 +1195,63 @@ void kthread_entry(void)
 /* Entry point for user threads. */
 void uthread_switch_entry(void)
 {
-	/* We enter with the global scheduler lock. We have to release it for other schedulers to work. */
-	cpu_spinlock_release(&global_scheduler_lock);
+	/* We enter with the run queue lock and interrupts disabled. We have to release it for the
+	   scheduler to work. */
+	unlock_this_cpu();
 
 	if((cpu_get_eflags() & EFLAGS_IF) == 0)
 		kpanic("thread_entry(): interrupts not enabled");
 }
 
+/* Makes the current thread give up the CPU. On a timer tick, the tick is charged to the thread and
+   it only gives up the CPU if its time slice has run out or a higher-priority thread is waiting. */
+static void yield(bool tick)
+{
+	struct x86_cpu *cpu;
+	struct thread *thread;
+
+	/* Even out the load from time to time. This has to be done before taking our run queue lock,
+	   as it needs the lock of another CPU. */
+	preempt_disable();
+	cpu = cpu_current();
+	if (ticks_get() >= cpu->rq.next_balance)
+		balance_threads(cpu);
+	preempt_enable();
+
+	cpu = lock_this_cpu();
+	thread = get_current_thread();
+
+	/* Sleepers are otherwise only woken up by reschedule(), which could be a whole slice away. */
+	if (tick && wake_sleepers(cpu))
+		atomic_store(&(cpu->rq.need_resched), true);
+
+	if (tick && !sched_classes[thread->policy]->tick(thread) &&
+		!atomic_load(&(cpu->rq.need_resched)))
+	{
+		unlock_this_cpu();
+		return;
+	}
+
+	thread->state = THREAD_READY;
+	reschedule();
+	unlock_this_cpu();
+}
+
+/* Charges a timer tick to the current thread. The thread is preempted if its time slice has run out
+   or a higher-priority thread is waiting. Called from the timer interrupt. */
+void sched_tick(void)
+{
+	yield(true);
+}
+
+/* Preempts the current thread if a higher-priority thread has become runnable on the current CPU.
+   Called from the reschedule IPI. */
+void sched_preempt(void)
+{
+	if (atomic_load(&(cpu_current()->rq.need_resched)))
+		yield(false);
+}
+
 /* Make the current thread wait on the given condition. A spinlock is unlocked and then relocked. */
 void sched_thread_wait(struct thread_cond *cond, struct cpu_spinlock *spinlock)
 {
@@ -336,58 +1259,89 @@ void sched_thread_wait(struct thread_cond *cond, struct cpu_spinlock *spinlock)
 
 	kassert(cond && spinlock);
 
-	 /* We release the spinlock while holding the global scheduler lock. This way we can be sure no
-		other thread notifies the condition between spinlock release and reschedule() */
-	if (spinlock != &global_scheduler_lock)
-	{
-		cpu_spinlock_acquire(&global_scheduler_lock);
-		cpu_spinlock_release(spinlock);
-	}
+	/* With interrupts on, a notifier in an interrupt handler on this CPU could wake us before we
+	   are BLOCKED or while we are still running. */
+	kassert((cpu_get_eflags() & EFLAGS_IF) == 0);
 
+	/* We release the spinlock while holding the run queue lock. The notifier has to take the run
+	   queue lock to wake us up, so it will not do that between spinlock release and
+	   reschedule(). */
+	lock_this_cpu();
 	thread = get_current_thread();
 	atomic_fetch_add(&(cond->num_waiting), 1);
 	thread->state = THREAD_BLOCKED;
 	thread->cond = cond;
+
+	cpu_spinlock_acquire(&(cond->lock));
+	STAILQ_INSERT_TAIL(&(cond->waiters), thread, cqptrs);
+	cpu_spinlock_release(&(cond->lock));
+
+	cpu_spinlock_release(spinlock);
+
 	reschedule();
+
 	atomic_fetch_sub(&(cond->num_waiting), 1);
 	thread->cond = NULL;
 
+	/* We wait on the spinlock outside of the section where we hold the run queue lock. This way we
+	   can avoid getting stuck on acquire and never being able to schedule the thread currently
+	   holding it. */
+	unlock_this_cpu();
+	cpu_spinlock_acquire(spinlock);
+}
 
-	/* We wait on the spinlock outside of the section where we hold the global scheduler lock. This
-	   way we can avoid getting stuck on acquire and never being able to schedule the thread
-	   currently holding it. */
-	if (spinlock != &global_scheduler_lock)
-	{
-		cpu_spinlock_release(&global_scheduler_lock);
-		cpu_spinlock_acquire(spinlock);
-	}
+/* Wakes up a thread taken off a condition's waiters queue. */
+static void wake_waiter(struct thread *thread)
+{
+	/* The waiter holds its run queue lock from before it was put in the waiters queue until it
+	   has switched out, so once we get the lock the thread is guaranteed to be THREAD_BLOCKED.
+	   That is true for notifiers in interrupt handlers on the waiter's CPU, too, as it waits with
+	   interrupts disabled and the run queue lock is only held with interrupts disabled. A
+	   handler would otherwise get the recursive lock while the waiter is still running. */
+	wake_thread(thread, true);
 }
 
 /* Notify a thread waiting on the given mutex that it is unlocked. Puts the thread at the beginning
-   of the thread queue. */
-void sched_thread_notify_one(struct thread_cond *cond)
+   of the thread queue. Returns the woken thread or NULL if nobody was waiting. */
+struct thread *sched_thread_notify_one(struct thread_cond *cond)
 {
-	struct proc *proc;
 	struct thread *thread;
 
-	cpu_spinlock_acquire(&global_scheduler_lock);
+	/* The cond lock is never held while taking a run queue lock. Interrupt handlers notify, so it
+	   is held with interrupts disabled. */
+	cpu_spinlock_acquire(&(cond->lock));
+	push_no_interrupts();
+	thread = STAILQ_FIRST(&(cond->waiters));
+	if (thread)
+		STAILQ_REMOVE_HEAD(&(cond->waiters), cqptrs);
+	pop_no_interrupts();
+	cpu_spinlock_release(&(cond->lock));
 
-	LIST_FOREACH(proc, &processes, pointers)
+	if (thread)
+		wake_waiter(thread);
+
+	return thread;
+}
+
+/* Notify all threads waiting on the given cond. */
+void sched_thread_notify_all(struct thread_cond *cond)
+{
+	struct thread_queue waiters;
+	struct thread *thread;
+
+	/* Take all the waiters at once. */
+	STAILQ_INIT(&waiters);
+	cpu_spinlock_acquire(&(cond->lock));
+	push_no_interrupts();
+	STAILQ_CONCAT(&waiters, &(cond->waiters));
+	pop_no_interrupts();
+	cpu_spinlock_release(&(cond->lock));
+
+	while ((thread = STAILQ_FIRST(&waiters)) != NULL)
 	{
-		LIST_FOREACH(thread, &(proc->threads), lptrs)
-		{
-			if (thread->cond == cond && thread->state == THREAD_BLOCKED)
-			{
-				thread->state = THREAD_READY;
-				STAILQ_INSERT_HEAD(&queue, thread, sqptrs);
-				/* We were only supposed to notify one thread. */
-				goto notified;
-			}
-		}
+		STAILQ_REMOVE_HEAD(&waiters, cqptrs);
+		wake_waiter(thread);
 	}
-
-notified:
-	cpu_spinlock_release(&global_scheduler_lock);
 }
 
 /* kernel/scheduler.h */
@@ -398,9 +1352,13 @@ struct thread *get_current_thread(void)
 	struct x86_cpu *cpu;
 	struct thread *thread;
 
+	/* A single read through the per-CPU segment cannot be split by a switch to another CPU. */
+	if (percpu_segment_ready)
+		return percpu_read(thread);
+
 	/* Don't want to get rescheduled between cpu_current and cpu->thread access. */
 	preempt_disable();
-	cpu = cpu_current();
+	cpu = cpu_current_early();
 	thread = cpu->thread;
 	preempt_enable();
 
@@ -415,9 +1373,10 @@ struct proc *sheduler_get_proc(pid_t pid)
 
 	cpu_spinlock_acquire(&global_scheduler_lock);
 
-	LIST_FOREACH(proc, &processes, pointers)
-		if (proc->pid == pid)
-			return proc;
+	proc = find_proc(pid);
+
+	if (proc)
+		return proc;
 
 	cpu_spinlock_release(&global_scheduler_lock);
 
@@ -458,6 +1417,8 @@ pid_t schedule_proc(struct proc *parent, struct proc *proc, struct thread *threa
 	/* Insert the process and the thread. */
 	cpu_spinlock_acquire(&global_scheduler_lock);
 	LIST_INSERT_HEAD(&processes, proc, pointers);
+	LIST_INSERT_HEAD(proc_hash_bucket(pid), proc, hptrs);
+	LIST_INSERT_HEAD(parent ? &(parent->children) : &(kernel_process.children), proc, cptrs);
 	insert_thread(proc, thread);
 	cpu_spinlock_release(&global_scheduler_lock);
 
@@ -490,6 +1451,199 @@ tid_t schedule_thread(pid_t pid, struct thread *thread)
 	return tid;
 }
 
+/* Sets the scheduling policy and priority of the given thread. Returns 0 on success, -EPARAM if the
+   policy or priority is invalid. */
+int sched_set_policy(struct thread *thread, int policy, int priority)
+{
+	struct x86_cpu *cpu;
+	bool queued;
+
+	if (policy == SCHED_RT)
+	{
+		if (priority < 0 || priority >= SCHED_RT_PRIORITIES)
+			return -EPARAM;
+	}
+	else if (policy == SCHED_MLFQ)
+	{
+		if (priority < 0 || priority >= SCHED_MLFQ_PRIORITIES)
+			return -EPARAM;
+	}
+	else
+	{
+		return -EPARAM;
+	}
+
+	cpu = lock_thread_cpu(thread);
+
+	/* A READY thread sits in a run queue of its old policy. Move it. */
+	queued = thread->state == THREAD_READY;
+
+	if (queued)
+		rq_remove(cpu, thread);
+
+	thread->policy = policy;
+	thread->priority = priority;
+	thread->level = priority;
+	thread->ticks_used = 0;
+	thread->boost_epoch = mlfq_current_epoch();
+
+	if (queued)
+		rq_enqueue(cpu, thread, false);
+
+	unlock_cpu(cpu);
+
+	return 0;
+}
+
+/* Sets the time slice of the given policy in microseconds. It is rounded up to whole ticks. Returns 0
+   on success, -EPARAM if the policy or the length is invalid. */
+int sched_set_time_slice(int policy, uint microseconds)
+{
+	uint64_t ticks;
+
+	if (policy < 0 || policy >= (int)NOF_SCHED_CLASSES || microseconds == 0)
+		return -EPARAM;
+
+	ticks = ((uint64_t)microseconds * TICKS_PER_SECOND + 999999) / 1000000;
+
+	if (ticks > SCHED_MAX_SLICE)
+		return -EPARAM;
+
+	atomic_store(&time_slices[policy], (uint)ticks);
+	return 0;
+}
+
+/* Gets the time slice of the given policy in microseconds. Returns 0 if the policy is invalid. */
+uint sched_get_time_slice(int policy)
+{
+	if (policy < 0 || policy >= (int)NOF_SCHED_CLASSES)
+		return 0;
+
+	return atomic_load(&time_slices[policy]) * (1000000 / TICKS_PER_SECOND);
+}
+
+/* Gets the scheduling policy and priority of the given thread. */
+void sched_get_policy(struct thread *thread, int *policy, int *priority)
+{
+	*policy = thread->policy;
+	*priority = thread->priority;
+}
+
+/* Sets the CPUs the given thread may run on. The thread is moved off a CPU that is not in the mask
+   anymore. Returns 0 on success, -EPARAM if the mask contains no existing CPU. */
+int sched_set_affinity(struct thread *thread, cpu_mask_t mask)
+{
+	struct x86_cpu *cpu;
+
+	mask &= all_cpus_mask();
+
+	if (mask == 0)
+		return -EPARAM;
+
+	cpu = lock_thread_cpu(thread);
+	thread->affinity = mask;
+
+	/* A READY thread is moved right away. A running thread moves when it is rescheduled and a
+	   waiting one when it wakes up. */
+	if (thread->state == THREAD_READY && !cpu_allowed(thread, cpu->num))
+	{
+		rq_remove(cpu, thread);
+		thread->state = THREAD_MIGRATING;
+		unlock_cpu(cpu);
+		wake_thread(thread, false);
+		return 0;
+	}
+
+	unlock_cpu(cpu);
+
+	/* Do not wait for the next tick to leave a CPU we may not run on. */
+	if (thread == get_current_thread())
+	{
+		preempt_disable();
+		cpu = cpu_current();
+		preempt_enable();
+
+		if (!cpu_allowed(thread, cpu->num))
+			thread_yield();
+	}
+
+	return 0;
+}
+
+/* Gets the CPUs the given thread may run on. */
+cpu_mask_t sched_get_affinity(struct thread *thread)
+{
+	return thread->affinity;
+}
+
+/* Moves the READY threads that may not run on the given CPU anymore to other CPUs. */
+static void evict_threads(struct x86_cpu *cpu)
+{
+	struct thread_queue kept, migrating;
+	struct thread *thread;
+
+	STAILQ_INIT(&kept);
+	STAILQ_INIT(&migrating);
+
+	lock_cpu(cpu);
+
+	while ((thread = rq_dequeue(cpu)) != NULL)
+	{
+		if (cpu_allowed(thread, cpu->num))
+		{
+			STAILQ_INSERT_TAIL(&kept, thread, sqptrs);
+		}
+		else
+		{
+			thread->state = THREAD_MIGRATING;
+			STAILQ_INSERT_TAIL(&migrating, thread, sqptrs);
+		}
+	}
+
+	while ((thread = STAILQ_FIRST(&kept)) != NULL)
+	{
+		STAILQ_REMOVE_HEAD(&kept, sqptrs);
+		rq_enqueue(cpu, thread, false);
+	}
+
+	unlock_cpu(cpu);
+
+	while ((thread = STAILQ_FIRST(&migrating)) != NULL)
+	{
+		STAILQ_REMOVE_HEAD(&migrating, sqptrs);
+		wake_thread(thread, false);
+	}
+}
+
+/* Reserves the given CPUs for threads pinned to them. Threads whose affinity allows any CPU outside
+   of the mask are kept off these CPUs. Returns 0 on success, -EPARAM if no CPU would be left for
+   other threads. */
+int sched_isolate_cpus(cpu_mask_t mask)
+{
+	mask &= all_cpus_mask();
+
+	if (mask == all_cpus_mask())
+		return -EPARAM;
+
+	atomic_store(&isolated_cpus, mask);
+
+	/* Running threads leave the isolated CPUs when they are rescheduled and waiting threads when
+	   they wake up. Queued threads are moved now. */
+	for (unsigned int i = 0; i < get_nof_cpus(); i++)
+	{
+		if (mask & cpu_mask_bit(i))
+			evict_threads(cpu_get(i));
+	}
+
+	return 0;
+}
+
+/* Gets the isolated CPUs. */
+cpu_mask_t sched_get_isolated_cpus(void)
+{
+	return atomic_load(&isolated_cpus);
+}
+
 /* Reset performance counters. */
 void schedule_reset_perf_counters(void)
 {
@@ -514,16 +1668,13 @@ void schedule_reset_perf_counters(void)
 /* Forces the current thread to be rescheduled. */
 void thread_yield(void)
 {
-	cpu_spinlock_acquire(&global_scheduler_lock);
-	get_current_thread()->state = THREAD_READY;
-	reschedule();
-	cpu_spinlock_release(&global_scheduler_lock);
+	yield(false);
 }
 
 /* Exits the current thread. */
 noreturn thread_exit(void)
 {
-	cpu_spinlock_acquire(&global_scheduler_lock);
+	lock_this_cpu();
 	get_current_thread()->state = THREAD_EXITED;
 	reschedule();
 	kpanic("thread_exit(): thread returned");
@@ -535,14 +1686,14 @@ void thread_sleep(unsigned int milliseconds)
 	struct thread *thread;
 	ticks_t cur;
 
-	cpu_spinlock_acquire(&global_scheduler_lock);
+	lock_this_cpu();
 	thread = get_current_thread();
 	thread->state = THREAD_SLEEPING;
 	cur = ticks_get();
 	thread->sleep_since = cur;
 	thread->sleep_until = cur + (milliseconds * TICKS_PER_MILLISECOND);
 	reschedule();
-	cpu_spinlock_release(&global_scheduler_lock);
+	unlock_this_cpu();
 }
 
 /* kernel/proc.h */
@@ -565,6 +1716,9 @@ noreturn proc_exit(int status)
 	thread = get_current_thread();
 	thread->parent->state = PROC_EXITING;
 	thread->parent->exit_status = status;
+	cpu_spinlock_release(&global_scheduler_lock);
+
+	lock_this_cpu();
 	thread->state = THREAD_EXITED;
 	reschedule();
 	kpanic("proc_exit(): process returned");
@@ -574,39 +1728,43 @@ pid_t proc_wait(int *status)
 {
 	struct thread *thread;
 	struct proc *proc, *child;
-	bool collected = false;
 	pid_t pid = PID_KERNEL;
 
 	cpu_spinlock_acquire(&global_scheduler_lock);
 	thread = get_current_thread();
 	proc = thread->parent;
 
-	/* Look for child processes and collect the first PROC_DEFUNCT process. */
-	LIST_FOREACH(child, &processes, pointers)
+	/* Collect the first PROC_DEFUNCT child process. */
+	child = LIST_FIRST(&(proc->defunct_children));
+
+	if (child)
 	{
-		if (child->parent == proc->pid && child->state == PROC_DEFUNCT)
-		{
-			pid = child->pid;
-			*status = child->exit_status;
-			collect_process(child);
-			collected = true;
-			break;
-		}
+		pid = child->pid;
+		*status = child->exit_status;
+		collect_process(child);
 	}
 
 	/*
-	 * We did not collect a process. Wait for the scheduler to let us know about a PROC_DEFUNCT
-	 * process.
+	 * We did not collect a process. Wait for the scheduler to hand us a PROC_DEFUNCT process.
 	 */
-	if (!collected)
+	if (child == NULL)
 	{
+		/* Go to sleep under the run queue lock, after releasing the process list lock. The
+		   scheduler needs the latter to wake us up, but it will not do that until we have
+		   switched out. */
+		lock_this_cpu();
 		thread->state = THREAD_WAITING;
+		STAILQ_INSERT_TAIL(&(proc->waiters), thread, cqptrs);
+		cpu_spinlock_release(&global_scheduler_lock);
 		reschedule();
 		*status = thread->collected_status;
 		pid = thread->collected_pid;
+		unlock_this_cpu();
+	}
+	else
+	{
+		cpu_spinlock_release(&global_scheduler_lock);
 	}
-
-	cpu_spinlock_release(&global_scheduler_lock);
 
 	return pid;
 }
@@ -4,11 +4,10 @@
 #include <kernel/cpu.h>
 #include <kernel/debug.h>
 #include <kernel/exclusive_buffer.h>
-#include <kernel/proc.h>
-#include <kernel/scheduler.h>
 #include <kernel/thread.h>
 #include <kernel/utils.h>
 #include <kernel/vfs.h>
+#include <kernel/workqueue.h>
 #include <arch/cpu.h>
 #include <arch/interrupts.h>
 #include <arch/serial.h>
@@ -20,11 +19,10 @@
 
 struct serial
 {
+	struct work work; /* Services the port. First member, so that the work is the serial object. */
 	uint16_t port;
 
-	tid_t handler;
 	struct thread_mutex mutex;
-	struct thread_cond data_available;
 
 	struct exclusive_buffer *input_subscribers[MAX_SUBSCRIBERS];
 	struct exclusive_buffer *output_subscribers[MAX_SUBSCRIBERS];
@@ -60,7 +58,8 @@ static inline void write_serial(uint16_t port, uint8_t byte)
 	pio_outb(COM_DATA_REGISTER(port), byte);
 }
 
-static void try_serial_write(struct serial *s)
+/* Returns the number of bytes written. */
+static int try_serial_write(struct serial *s)
 {
 	int i, p;
 	bool read;
@@ -69,7 +68,9 @@ static void try_serial_write(struct serial *s)
 
 	/* Check for break interrupt bit. If set, it means there's likely nothing on the other side. */
 	if (serial_break(s->port))
-		return;
+		return 0;
+
+	p = 0;
 
 	if (is_transmit_empty(s->port))
 	{
@@ -100,6 +101,8 @@ static void try_serial_write(struct serial *s)
 		for (i = 0; i < p; i++)
 			write_serial(s->port, data[i]);
 	}
+
+	return p;
 }
 
 static void try_serial_read(struct serial *s)
@@ -131,7 +134,7 @@ static void try_serial_read(struct serial *s)
 
 static void com_irq_handler(struct serial *s, __unused struct isr_frame *frame)
 {
-	thread_cond_notify(&(s->data_available));
+	work_queue(&(s->work));
 	lapic_eoi();
 }
 
@@ -172,26 +175,29 @@ static void unsubscribe(struct exclusive_buffer **subs, struct exclusive_buffer
 			subs[i] = NULL;
 }
 
-static void serial_handler_main(void *cookie)
+static void serial_work(struct work *work)
 {
-	struct serial *s = (struct serial *)cookie;
+	struct serial *s = (struct serial *)work;
+	bool progress = true;
 
-	while (1)
-	{
-		thread_mutex_acquire(&(s->mutex));
+	thread_mutex_acquire(&(s->mutex));
 
-		/* Wait until we have data available. */
-		while (!serial_received(s->port) && !is_transmit_empty(s->port))
-			thread_cond_wait(&(s->data_available), &(s->mutex));
+	/* Keep going while the port has something for us. */
+	while (progress)
+	{
+		progress = false;
 
 		if (serial_received(s->port))
+		{
 			try_serial_read(s);
+			progress = true;
+		}
 
-		if (is_transmit_empty(s->port))
-			try_serial_write(s);
-
-		thread_mutex_release(&(s->mutex));
+		if (is_transmit_empty(s->port) && try_serial_write(s) > 0)
+			progress = true;
 	}
+
+	thread_mutex_release(&(s->mutex));
 }
 
 /* Initialization */
@@ -199,9 +205,12 @@ static void serial_handler_main(void *cookie)
 static void init_port(struct serial *s, uint16_t port, uint16_t divisor)
 {
 	s->port = port;
-	thread_cond_create(&(s->data_available));
 	thread_mutex_create(&(s->mutex));
 
+	/* The port is serviced by the worker threads, which run in the real-time class, so that
+	   console latency does not suffer when the CPUs are busy. */
+	work_create(&(s->work), serial_work);
+
 	/* Initialize the controller. */
 	/* TODO: Magic numbers... */
 	pio_outb(COM_INT_ENABL_REG(port), 0); /* Disable interrupts. */
@@ -212,9 +221,6 @@ static void init_port(struct serial *s, uint16_t port, uint16_t divisor)
 	pio_outb(COM_INT_FIFO_REG(port), 0xc7); /* Enable FIFO, 14 byte treshold (?). */
 	pio_outb(COM_MODM_CTL_REG(port), 0x0b); /* IRQs enabled, RTS/DSR set (?). */
 	pio_outb(COM_INT_ENABL_REG(port), COM_IER_INPUT_BIT | COM_IER_NO_OUTPUT_BIT); /* Enable some interrupts. */
-
-	/* Create handler thread. */
-	s->handler = schedule_kernel_thread(serial_handler_main, s, "serial port handler");
 }
 
 /* arch/serial.h interface */
@@ -273,12 +279,12 @@ void serial_unsubscribe_output(struct serial *com, struct exclusive_buffer *buff
 
 void serial_read(struct serial *com)
 {
-	thread_cond_notify(&(com->data_available));
+	work_queue(&(com->work));
 }
 
 void serial_write(struct serial *com)
 {
-	thread_cond_notify(&(com->data_available));
+	work_queue(&(com->work));
 }
 
 /* char_dev interface */
@@ -0,0 +1,295 @@
+/* slab.c - x86 object caches */
+#include <kernel/addr.h>
+#include <kernel/cdefs.h>
+#include <kernel/cpu.h>
+#include <kernel/debug.h>
+#include <kernel/paging.h>
+#include <kernel/slab.h>
+#include <kernel/utils.h>
+#include <arch/heap.h>
+#include <arch/palloc.h>
+#include <arch/paging.h>
+
+#define SLAB_MAGIC 0x51AB51AB
+
+/* Empty slabs a cache keeps for reuse before giving their pages back to the pool. */
+#define KMEM_CACHE_MAX_EMPTY 2
+
+/* Slab header. It sits at the end of the slab's page, the objects fill the page from its start. This
+   way objects whose size is a power of two are aligned to their size. */
+struct slab
+{
+	uint32_t magic;
+	struct kmem_cache *cache;
+	void *free; /* First free object. Each free object holds a pointer to the next one. */
+	uint inuse; /* Number of allocated objects. */
+	LIST_ENTRY(slab) ptrs; /* Pointers in one of the cache's lists. */
+};
+
+#define slab_page(v) ((vaddr_t)mask_to_page(v))
+#define slab_of(v) ((struct slab *)(slab_page(v) + PAGE_SIZE - sizeof(struct slab)))
+
+/*
+ * Page pool. Slab pages are taken from their own part of the heap region. Pages of released slabs
+ * stay mapped and are linked through their first word, so that any cache can reuse them.
+ */
+
+static struct cpu_spinlock pool_lock;
+static vaddr_t pool_base; /* Start of the slab part of the heap region. */
+static vaddr_t pool_end; /* End of the slab part of the heap region. */
+static vaddr_t pool_top; /* Pages below this have been mapped. */
+static void *pool_free; /* Released pages. */
+
+/* Sets up the page pool of the slabs in [base, base + size). Called by the heap. */
+void init_slab(vaddr_t base, size_t size)
+{
+	kassert(is_aligned_to_page_size(base));
+	kassert(is_aligned_to_page_size(size));
+
+	cpu_spinlock_create(&pool_lock, "slab pool");
+	pool_base = base;
+	pool_end = base + size;
+	pool_top = base;
+	pool_free = NULL;
+}
+
+static vaddr_t pool_get_page(void)
+{
+	vaddr_t page;
+
+	cpu_spinlock_acquire(&pool_lock);
+
+	if (pool_free)
+	{
+		page = pool_free;
+		pool_free = *(void **)page;
+		goto _pool_get_page_done;
+	}
+
+	if (pool_top >= pool_end)
+		kpanic("slab pages exceeded their part of the heap region");
+
+	/* Same rules as for growing the rest of the heap. */
+	if (palloc_lock_held())
+		kpanic("holding palloc lock while using the kernel heap allocator");
+	if (kp_lock_held())
+		kpanic("holding kernel page tables write lock while using the kernel heap allocator");
+
+	page = pool_top;
+	kp_map_range(page, PAGE_SIZE, PHYS_NULL);
+	pool_top += PAGE_SIZE;
+
+_pool_get_page_done:
+	cpu_spinlock_release(&pool_lock);
+
+	return page;
+}
+
+static void pool_put_page(vaddr_t page)
+{
+	cpu_spinlock_acquire(&pool_lock);
+	*(void **)page = pool_free;
+	pool_free = page;
+	cpu_spinlock_release(&pool_lock);
+}
+
+/* Checks whether the address belongs to a slab, rather than to the rest of the kernel heap. */
+bool is_slab_object(vaddr_t v)
+{
+	return pool_base <= v && v < pool_end;
+}
+
+/* Gets the cache the given object was allocated from. */
+struct kmem_cache *kmem_cache_of(vaddr_t v)
+{
+	struct slab *slab = slab_of(v);
+
+	if (!is_slab_object(v) || slab->magic != SLAB_MAGIC)
+		kpanic("kmem_cache_of(): not a slab object");
+
+	return slab->cache;
+}
+
+/* Initializes a cache of objects with the given size and alignment. The alignment must be a power
+   of two. */
+void kmem_cache_create(struct kmem_cache *cache, const char *name, size_t size, size_t align)
+{
+	kassert(align > 0 && (align & (align - 1)) == 0);
+
+	/* Free objects have to hold the free list pointer. */
+	size = kmax(size, sizeof(void *));
+	size = (size + align - 1) & ~(align - 1);
+
+	if (size > KMEM_CACHE_MAX_SIZE)
+		kpanic("kmem_cache_create(): object too large");
+
+	cache->name = name;
+	cache->size = size;
+	cache->objs_per_slab = (PAGE_SIZE - sizeof(struct slab)) / size;
+
+	cpu_spinlock_create(&(cache->lock), "kmem cache");
+	LIST_INIT(&(cache->partial));
+	LIST_INIT(&(cache->full));
+	LIST_INIT(&(cache->empty));
+	cache->nof_empty = 0;
+}
+
+/* Carves a new page into free objects. Requires the cache lock. */
+static struct slab *unsafe_new_slab(struct kmem_cache *cache)
+{
+	vaddr_t page = pool_get_page();
+	struct slab *slab = slab_of(page);
+	void **obj;
+
+	slab->magic = SLAB_MAGIC;
+	slab->cache = cache;
+	slab->inuse = 0;
+	slab->free = page;
+
+	for (uint i = 0; i < cache->objs_per_slab; i++)
+	{
+		obj = page + i * cache->size;
+		*obj = (i + 1 < cache->objs_per_slab) ? page + (i + 1) * cache->size : NULL;
+	}
+
+	return slab;
+}
+
+/* Takes an object off the cache's slabs. Requires the cache lock. */
+static vaddr_t unsafe_alloc(struct kmem_cache *cache)
+{
+	struct slab *slab;
+	vaddr_t v;
+
+	/* Fill partial slabs first, so that the others can go empty. */
+	slab = LIST_FIRST(&(cache->partial));
+
+	if (slab == NULL)
+	{
+		slab = LIST_FIRST(&(cache->empty));
+
+		if (slab)
+		{
+			LIST_REMOVE(slab, ptrs);
+			cache->nof_empty--;
+		}
+		else
+		{
+			slab = unsafe_new_slab(cache);
+		}
+
+		LIST_INSERT_HEAD(&(cache->partial), slab, ptrs);
+	}
+
+	v = slab->free;
+	slab->free = *(void **)v;
+	slab->inuse++;
+
+	if (slab->free == NULL)
+	{
+		LIST_REMOVE(slab, ptrs);
+		LIST_INSERT_HEAD(&(cache->full), slab, ptrs);
+	}
+
+	return v;
+}
+
+/* Checks that the object can be returned to the cache. */
+static void check_free(struct kmem_cache *cache, vaddr_t v)
+{
+	struct slab *slab = slab_of(v);
+
+	if (!is_slab_object(v) || slab->magic != SLAB_MAGIC || slab->cache != cache)
+		kpanic("kmem_cache_free(): bad address");
+
+	if ((size_t)(v - slab_page(v)) % cache->size != 0)
+		kpanic("kmem_cache_free(): address is not at the start of an object");
+}
+
+/* Puts an object back on its slab. Requires the cache lock. */
+static void unsafe_free(struct kmem_cache *cache, vaddr_t v)
+{
+	struct slab *slab = slab_of(v);
+	bool was_full;
+
+#ifdef KERNEL_DEBUG
+	for (void *p = slab->free; p != NULL; p = *(void **)p)
+	{
+		if (p == v)
+			kpanic("kmem_cache_free(): double free");
+	}
+#endif
+
+	was_full = slab->free == NULL;
+	*(void **)v = slab->free;
+	slab->free = v;
+	slab->inuse--;
+
+	if (slab->inuse == 0)
+	{
+		LIST_REMOVE(slab, ptrs);
+
+		if (cache->nof_empty < KMEM_CACHE_MAX_EMPTY)
+		{
+			LIST_INSERT_HEAD(&(cache->empty), slab, ptrs);
+			cache->nof_empty++;
+		}
+		else
+		{
+			slab->magic = 0;
+			pool_put_page(slab_page(v));
+		}
+	}
+	else if (was_full)
+	{
+		LIST_REMOVE(slab, ptrs);
+		LIST_INSERT_HEAD(&(cache->partial), slab, ptrs);
+	}
+}
+
+/* Allocates an object from the cache. */
+vaddr_t kmem_cache_alloc(struct kmem_cache *cache)
+{
+	vaddr_t v;
+
+	cpu_spinlock_acquire(&(cache->lock));
+	v = unsafe_alloc(cache);
+	cpu_spinlock_release(&(cache->lock));
+
+	return v;
+}
+
+/* Allocates n objects from the cache into objs, taking the cache lock once. */
+void kmem_cache_alloc_bulk(struct kmem_cache *cache, vaddr_t *objs, uint n)
+{
+	cpu_spinlock_acquire(&(cache->lock));
+
+	for (uint i = 0; i < n; i++)
+		objs[i] = unsafe_alloc(cache);
+
+	cpu_spinlock_release(&(cache->lock));
+}
+
+/* Returns an object to the cache it was allocated from. */
+void kmem_cache_free(struct kmem_cache *cache, vaddr_t v)
+{
+	check_free(cache, v);
+
+	cpu_spinlock_acquire(&(cache->lock));
+	unsafe_free(cache, v);
+	cpu_spinlock_release(&(cache->lock));
+}
+
+/* Returns n objects in objs to the cache they were allocated from, taking the cache lock once. */
+void kmem_cache_free_bulk(struct kmem_cache *cache, vaddr_t *objs, uint n)
+{
+	for (uint i = 0; i < n; i++)
+		check_free(cache, objs[i]);
+
+	cpu_spinlock_acquire(&(cache->lock));
+
+	for (uint i = 0; i < n; i++)
+		unsafe_free(cache, objs[i]);
+
+	cpu_spinlock_release(&(cache->lock));
+}
@@ -25,6 +25,18 @@ static void syscall_handler(struct isr_frame *frame)
 	case SYSCALL_GETPID:
 		frame->eax = (uint32_t)syscall_getpid();
 		break;
+	case SYSCALL_SCHED_SET:
+		frame->eax = (uint32_t)syscall_sched_set((int)frame->ebx, (int)frame->ecx);
+		break;
+	case SYSCALL_SCHED_GET:
+		frame->eax = (uint32_t)syscall_sched_get((uvaddr_t)frame->ebx, (uvaddr_t)frame->ecx);
+		break;
+	case SYSCALL_SCHED_SETAFFINITY:
+		frame->eax = (uint32_t)syscall_sched_setaffinity((unsigned int)frame->ebx);
+		break;
+	case SYSCALL_SCHED_GETAFFINITY:
+		frame->eax = (uint32_t)syscall_sched_getaffinity((uvaddr_t)frame->ebx);
+		break;
 
 	case SYSCALL_BRK:
 		frame->eax = (uint32_t)syscall_brk((uvaddr_t)frame->ebx);
@@ -4,6 +4,7 @@
 #include <kernel/debug.h>
 #include <kernel/heap.h>
 #include <kernel/proc.h>
+#include <kernel/slab.h>
 #include <kernel/thread.h>
 #include <kernel/utils.h>
 #include <arch/cpu.h>
@@ -16,6 +17,8 @@
 
 uint32_t struct_x86_thread_offsetof_esp0 = offsetof(struct arch_thread, esp0);
 static atomic_uint current_thread_no = 1;
+static struct kmem_cache thread_cache;
+static struct kmem_cache arch_thread_cache;
 
 #ifdef KERNEL_DEBUG
 #define MAX_THREADS 128
@@ -51,10 +54,19 @@ void x86_thread_construct_empty(struct thread *thread, const char *name, uint16_
 #endif
 
 	thread->state = THREAD_NEW;
+	thread->cpu = 0;
+	thread->policy = SCHED_MLFQ;
+	thread->priority = 0;
+	thread->level = 0;
+	thread->ticks_used = 0;
+	thread->boost_epoch = 0;
+	thread->affinity = CPU_MASK_ALL;
 	thread->collected_pid = 0;
 	thread->collected_status = 0;
 	thread->sleep_since = 0;
 	thread->sleep_until = 0;
+	thread->sleep_child = NULL;
+	thread->sleep_sibling = NULL;
 	thread->cond = NULL;
 	thread->sched_count = 0;
 
@@ -109,8 +121,10 @@ static void x86_thread_construct_thread(struct thread *thread,
 	thread->arch->ebp0 = (uint32_t)thread->arch->stack0 + stack0_size;
 	thread->arch->esp0 = thread->arch->ebp0;
 
+	/* The thread starts holding the run queue lock, which is held with interrupts disabled. The
+	   entry function enables them when it releases the lock. */
 	thread->arch->int_enabled = int_enabled;
-	thread->arch->cli_stack = 0;
+	thread->arch->cli_stack = 1;
 	thread->arch->cr3 = cr3;
 }
 
@@ -130,13 +144,14 @@ static void setup_kthread_stack(struct thread *thread)
 	isr_frame->ds = thread->arch->ds;
 	isr_frame->es = thread->arch->ds;
 	isr_frame->fs = 0;
-	isr_frame->gs = 0;
+	isr_frame->gs = KERNEL_CPU_SELECTOR;
 
 	/* IRET stack. No need to specify SS:ESP for kernel threads. */
 	isr_frame->ss = 0;
 	isr_frame->esp = 0;
 
-	isr_frame->eflags = thread->arch->int_enabled ? EFLAGS_IF : 0;
+	/* We return to kthread_entry, which still holds the run queue lock. */
+	isr_frame->eflags = 0;
 	isr_frame->cs = thread->arch->cs;
 	isr_frame->eip = (uint32_t)thread->arch->tentry;
 
@@ -149,6 +164,13 @@ static void setup_kthread_stack(struct thread *thread)
 	switch_frame->eip = (uint32_t)isr_exit;
 }
 
+/* Initializes the caches of thread objects. */
+void init_thread_cache(void)
+{
+	kmem_cache_create(&thread_cache, "thread", sizeof(struct thread), CACHE_LINE_SIZE);
+	kmem_cache_create(&arch_thread_cache, "arch thread", sizeof(struct arch_thread), sizeof(void *));
+}
+
 /* Creates a kernel thread. */
 struct thread *kthread_create(void (*entry)(void *), void *cookie, const char *name)
 {
@@ -156,8 +178,8 @@ struct thread *kthread_create(void (*entry)(void *), void *cookie, const char *n
 	vaddr_t stack;
 
 	stack = kalloc(HEAP_NORMAL, 16, 4096);
-	thread = kalloc(HEAP_NORMAL, HEAP_NO_ALIGN, sizeof(struct thread));
-	thread->arch = kalloc(HEAP_NORMAL, HEAP_NO_ALIGN, sizeof(struct arch_thread));
+	thread = kmem_cache_alloc(&thread_cache);
+	thread->arch = kmem_cache_alloc(&arch_thread_cache);
 	x86_thread_construct_thread(thread, name, stack, 4096, UVNULL, 0, (xvaddr_t)&kthread_entry, entry, cookie,
 		true, KERNEL_CODE_SELECTOR, KERNEL_DATA_SELECTOR, phys_kernel_pd);
 	setup_kthread_stack(thread);
@@ -221,8 +243,8 @@ struct thread *uthread_create(uvaddr_t tentry, uvaddr_t stack, size_t stack_size
 	vaddr_t stack0;
 
 	stack0 = kalloc(HEAP_NORMAL, 16, 4096);
-	thread = kalloc(HEAP_NORMAL, HEAP_NO_ALIGN, sizeof(struct thread));
-	thread->arch = kalloc(HEAP_NORMAL, HEAP_NO_ALIGN, sizeof(struct arch_thread));
+	thread = kmem_cache_alloc(&thread_cache);
+	thread->arch = kmem_cache_alloc(&arch_thread_cache);
 	x86_thread_construct_thread(thread, name, stack0, 4096, stack, stack_size, tentry, NULL, NULL,
 		true, USER_CODE_SELECTOR, USER_DATA_SELECTOR, parent->arch->pd);
 	setup_uthread_stack(thread, NULL);
@@ -245,8 +267,8 @@ struct thread *uthread_fork_create(struct proc *new_proc, struct thread *templat
 	 * the same state as the current thread.
 	 */
 	stack0 = kalloc(HEAP_NORMAL, 16, 4096);
-	thread = kalloc(HEAP_NORMAL, HEAP_NO_ALIGN, sizeof(struct thread));
-	thread->arch = kalloc(HEAP_NORMAL, HEAP_NO_ALIGN, sizeof(struct arch_thread));
+	thread = kmem_cache_alloc(&thread_cache);
+	thread->arch = kmem_cache_alloc(&arch_thread_cache);
 	x86_thread_construct_thread(thread, template->name, stack0, 4096, new_proc->arch->vstack,
 			new_proc->arch->stack_size, template->arch->tentry, NULL, NULL,
 			true, USER_CODE_SELECTOR, USER_DATA_SELECTOR, new_proc->arch->pd);
@@ -264,6 +286,6 @@ void thread_free(struct thread *thread)
 #endif
 	/* We do not free the N ring stack because it does not belong to thread.c. */
 	kfree(thread->arch->stack0);
-	kfree(thread->arch);
-	kfree(thread);
+	kmem_cache_free(&arch_thread_cache, thread->arch);
+	kmem_cache_free(&thread_cache, thread);
 }
@@ -1,7 +1,8 @@
-/* thread_mutex.c - x86 implementation of thread_mutex */
+/* thread_mutex.c - x86 implementation of thread_mutex, thread_cond and thread_rwlock */
 #include <kernel/cdefs.h>
 #include <kernel/cpu.h>
 #include <kernel/debug.h>
+#include <kernel/lockstat.h>
 #include <kernel/scheduler.h>
 #include <kernel/thread.h>
 #include <arch/cpu.h>
@@ -10,12 +11,22 @@
 
 /* TODO: Perhaps use some lighter alternative instead of preempt_disable/push_no_interrupts */
 
+/* A contended acquire polls the mutex MUTEX_SPIN_ROUNDS times, MUTEX_SPIN_PAUSES pause instructions
+   apart, as long as the holder is running on another CPU. Only then the thread blocks. */
+#define MUTEX_SPIN_ROUNDS 64
+#define MUTEX_SPIN_PAUSES 32
+
 void _thread_mutex_create(struct thread_mutex *mutex, const char *file, unsigned int line)
 {
 	cpu_spinlock_create(&(mutex->spinlock), "thread mutex spinlock");
 	thread_cond_create(&(mutex->wait_cond));
 	mutex->locked = false;
 	mutex->tid = TID_INVALID;
+	mutex->owner = NULL;
+#ifdef KERNEL_LOCKSTAT
+	mutex->lockstat = lockstat_get_creation_class(LOCKSTAT_MUTEX, file, line);
+	mutex->lockstat_since = 0;
+#endif
 #ifdef KERNEL_DEBUG
 	mutex->creation_file = file;
 	mutex->creation_line = line;
@@ -35,9 +46,21 @@ static inline bool unsafe_mutex_held(struct thread_mutex *mutex)
 	return mutex->locked && (mutex->tid == thread->tid);
 }
 
+/* Checks whether the holder of the mutex is running, so it is worth spinning. The state is read
+   without the run queue lock, so this is only a hint. */
+static inline bool unsafe_mutex_owner_running(struct thread_mutex *mutex)
+{
+	return mutex->owner && mutex->owner->state == THREAD_RUNNING;
+}
+
 static inline void unsafe_mutex_acquire(struct thread_mutex *mutex)
 {
 	struct thread *thread;
+	int rounds = 0;
+#ifdef KERNEL_LOCKSTAT
+	uint64_t wait_start = cpu_timestamp();
+	bool contended = mutex->locked;
+#endif
 
 	thread = get_current_thread();
 
@@ -47,13 +70,35 @@ static inline void unsafe_mutex_acquire(struct thread_mutex *mutex)
 	if (unsafe_mutex_held(mutex))
 		kpanic("thread_mutex_acquire(): on held lock");
 
-	/* Check in a loop if we have locked the mutex with an atomic exchange. If not, go into blocked
-	   state. Another thread calling release on this mutex will notify and wake us up. */
-	while (mutex->locked)
+	/* The holder is running on another CPU and will probably release the mutex soon. Blocking
+	   would cost two context switches, so spin for a while instead. */
+	while (mutex->locked && rounds < MUTEX_SPIN_ROUNDS && unsafe_mutex_owner_running(mutex))
+	{
+		pop_no_interrupts();
+		cpu_spinlock_release(&(mutex->spinlock));
+
+		for (int i = 0; i < MUTEX_SPIN_PAUSES; i++)
+			cpu_relax();
+
+		cpu_spinlock_acquire(&(mutex->spinlock));
+		push_no_interrupts();
+		rounds++;
+	}
+
+	/* Go into blocked state. A thread releasing the mutex hands it over to the first waiter, so
+	   once we are woken up the mutex is ours. */
+	while (mutex->locked && mutex->owner != thread)
 		sched_thread_wait(&(mutex->wait_cond), &(mutex->spinlock));
 
 	mutex->locked = true;
 	mutex->tid = thread->tid;
+	mutex->owner = thread;
+
+#ifdef KERNEL_LOCKSTAT
+	mutex->lockstat_since = cpu_timestamp();
+	lockstat_acquired(mutex->lockstat, cpu_current()->num, contended,
+		mutex->lockstat_since - wait_start);
+#endif
 
 #ifdef KERNEL_DEBUG
 	debug_fill_call_stack(&(mutex->lock_call_stack));
@@ -75,18 +120,38 @@ void thread_mutex_acquire(struct thread_mutex *mutex)
 
 static inline void unsafe_mutex_release(struct thread_mutex *mutex)
 {
+	struct thread *waiter;
+
 	if (mutex->tid == TID_INVALID)
 		kpanic("thread_mutex_release(): called on an unheld mutex");
 
 	if (mutex->tid != TID_INVALID && !unsafe_mutex_held(mutex))
 		kpanic("thread_mutex_release(): called on an unheld mutex");
 
-	mutex->tid = TID_INVALID;
+#ifdef KERNEL_LOCKSTAT
+	lockstat_released(mutex->lockstat, cpu_current()->num,
+		cpu_timestamp() - mutex->lockstat_since);
+#endif
 
 #ifdef KERNEL_DEBUG
 	debug_clear_call_stack(&(mutex->lock_call_stack));
 #endif
 
+	/* Hand the mutex over to the first waiter, so that it does not have to compete for it with
+	   other threads after waking up. The waiter needs the mutex spinlock to return, so it will see
+	   the new owner. */
+	waiter = sched_thread_notify_one(&(mutex->wait_cond));
+
+	if (waiter)
+	{
+		mutex->tid = waiter->tid;
+		mutex->owner = waiter;
+		return;
+	}
+
+	mutex->tid = TID_INVALID;
+	mutex->owner = NULL;
+
 	/* Actually release the mutex. */
 	mutex->locked = false;
 }
@@ -100,9 +165,6 @@ void thread_mutex_release(struct thread_mutex *mutex)
 
 	unsafe_mutex_release(mutex);
 
-	/* Notify a thread waiting on the internal conditon. */
-	sched_thread_notify_one(&(mutex->wait_cond));
-
 	pop_no_interrupts();
 	cpu_spinlock_release(&(mutex->spinlock));
 }
@@ -126,6 +188,8 @@ bool thread_mutex_held(struct thread_mutex *mutex)
 
 void _thread_cond_create(struct thread_cond *cond, const char *file, unsigned int line)
 {
+	cpu_spinlock_create(&(cond->lock), "thread cond spinlock");
+	STAILQ_INIT(&(cond->waiters));
 	atomic_store(&(cond->num_waiting), 0);
 #ifdef KERNEL_DEBUG
 	cond->creation_file = file;
@@ -145,9 +209,6 @@ void thread_cond_wait(struct thread_cond *cond, struct thread_mutex *mutex)
 
 	unsafe_mutex_release(mutex);
 
-	/* Notify a thread waiting on the internal conditon. */
-	sched_thread_notify_one(&(mutex->wait_cond));
-
 	sched_thread_wait(cond, &(mutex->spinlock));
 
 	unsafe_mutex_acquire(mutex);
@@ -160,3 +221,173 @@ void thread_cond_notify(struct thread_cond *cond)
 {
 	sched_thread_notify_one(cond);
 }
+
+void thread_cond_broadcast(struct thread_cond *cond)
+{
+	sched_thread_notify_all(cond);
+}
+
+void _thread_rwlock_create(struct thread_rwlock *rwlock, const char *file, unsigned int line)
+{
+	cpu_spinlock_create(&(rwlock->spinlock), "thread rwlock spinlock");
+	thread_cond_create(&(rwlock->read_cond));
+	thread_cond_create(&(rwlock->write_cond));
+	rwlock->readers = 0;
+	rwlock->writers_waiting = 0;
+	rwlock->writer = TID_INVALID;
+#ifdef KERNEL_LOCKSTAT
+	rwlock->lockstat = lockstat_get_creation_class(LOCKSTAT_RWLOCK, file, line);
+	rwlock->lockstat_since = 0;
+#endif
+#ifdef KERNEL_DEBUG
+	rwlock->creation_file = file;
+	rwlock->creation_line = line;
+#endif
+}
+
+void thread_rwlock_acquire_read(struct thread_rwlock *rwlock)
+{
+#ifdef KERNEL_LOCKSTAT
+	uint64_t wait_start = cpu_timestamp();
+	bool contended;
+#endif
+
+	/* Acquiring a spinlock no longer disables interrupts. To protect from weird behaviour if an
+	   interrupt handler uses the same lock, temporarily disable interrupts */
+	cpu_spinlock_acquire(&(rwlock->spinlock));
+	push_no_interrupts();
+
+	if (rwlock->writer == get_current_thread()->tid)
+		kpanic("thread_rwlock_acquire_read(): lock held for writing");
+
+#ifdef KERNEL_LOCKSTAT
+	contended = rwlock->writer != TID_INVALID || rwlock->writers_waiting > 0;
+#endif
+
+	/* Let waiting writers go first, so that a stream of readers does not starve them. */
+	while (rwlock->writer != TID_INVALID || rwlock->writers_waiting > 0)
+		sched_thread_wait(&(rwlock->read_cond), &(rwlock->spinlock));
+
+	rwlock->readers++;
+
+	/* Hold times are only recorded for writers, as readers overlap. */
+#ifdef KERNEL_LOCKSTAT
+	lockstat_acquired(rwlock->lockstat, cpu_current()->num, contended,
+		cpu_timestamp() - wait_start);
+#endif
+
+	pop_no_interrupts();
+	cpu_spinlock_release(&(rwlock->spinlock));
+}
+
+void thread_rwlock_release_read(struct thread_rwlock *rwlock)
+{
+	cpu_spinlock_acquire(&(rwlock->spinlock));
+	push_no_interrupts();
+
+	if (rwlock->readers == 0)
+		kpanic("thread_rwlock_release_read(): lock not held for reading");
+
+	rwlock->readers--;
+
+	/* The last reader lets a writer in. */
+	if (rwlock->readers == 0)
+		sched_thread_notify_one(&(rwlock->write_cond));
+
+	pop_no_interrupts();
+	cpu_spinlock_release(&(rwlock->spinlock));
+}
+
+void thread_rwlock_acquire_write(struct thread_rwlock *rwlock)
+{
+	struct thread *thread;
+#ifdef KERNEL_LOCKSTAT
+	uint64_t wait_start = cpu_timestamp();
+	bool contended;
+#endif
+
+	cpu_spinlock_acquire(&(rwlock->spinlock));
+	push_no_interrupts();
+
+	thread = get_current_thread();
+
+	if (rwlock->writer == thread->tid)
+		kpanic("thread_rwlock_acquire_write(): on held lock");
+
+	rwlock->writers_waiting++;
+
+#ifdef KERNEL_LOCKSTAT
+	contended = rwlock->writer != TID_INVALID || rwlock->readers > 0;
+#endif
+
+	while (rwlock->writer != TID_INVALID || rwlock->readers > 0)
+		sched_thread_wait(&(rwlock->write_cond), &(rwlock->spinlock));
+
+	rwlock->writers_waiting--;
+	rwlock->writer = thread->tid;
+
+#ifdef KERNEL_LOCKSTAT
+	rwlock->lockstat_since = cpu_timestamp();
+	lockstat_acquired(rwlock->lockstat, cpu_current()->num, contended,
+		rwlock->lockstat_since - wait_start);
+#endif
+
+	pop_no_interrupts();
+	cpu_spinlock_release(&(rwlock->spinlock));
+}
+
+void thread_rwlock_release_write(struct thread_rwlock *rwlock)
+{
+	cpu_spinlock_acquire(&(rwlock->spinlock));
+	push_no_interrupts();
+
+	if (rwlock->writer != get_current_thread()->tid)
+		kpanic("thread_rwlock_release_write(): lock not held for writing");
+
+#ifdef KERNEL_LOCKSTAT
+	lockstat_released(rwlock->lockstat, cpu_current()->num,
+		cpu_timestamp() - rwlock->lockstat_since);
+#endif
+
+	rwlock->writer = TID_INVALID;
+
+	/* Prefer the next writer. Otherwise, let all the readers in at once. */
+	if (rwlock->writers_waiting > 0)
+		sched_thread_notify_one(&(rwlock->write_cond));
+	else
+		sched_thread_notify_all(&(rwlock->read_cond));
+
+	pop_no_interrupts();
+	cpu_spinlock_release(&(rwlock->spinlock));
+}
+
+bool thread_rwlock_write_held(struct thread_rwlock *rwlock)
+{
+	bool ret;
+
+	cpu_spinlock_acquire(&(rwlock->spinlock));
+	push_no_interrupts();
+
+	ret = rwlock->writer == get_current_thread()->tid;
+
+	pop_no_interrupts();
+	cpu_spinlock_release(&(rwlock->spinlock));
+
+	return ret;
+}
+
+/* Checks whether the lock is held by anyone, for reading or writing. */
+bool thread_rwlock_locked(struct thread_rwlock *rwlock)
+{
+	bool ret;
+
+	cpu_spinlock_acquire(&(rwlock->spinlock));
+	push_no_interrupts();
+
+	ret = rwlock->readers > 0 || rwlock->writer != TID_INVALID;
+
+	pop_no_interrupts();
+	cpu_spinlock_release(&(rwlock->spinlock));
+
+	return ret;
+}
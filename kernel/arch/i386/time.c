@@ -0,0 +1,329 @@
+/* time.c - x86 TSC clocksource and one-shot timer events */
+#include <kernel/cdefs.h>
+#include <kernel/cpu.h>
+#include <kernel/debug.h>
+#include <kernel/ktime.h>
+#include <kernel/thread.h>
+#include <kernel/ticks.h>
+#include <arch/cpu.h>
+#include <arch/scheduler.h>
+#include <arch/time.h>
+#include <arch/cpu/apic.h>
+
+TAILQ_HEAD(ktimer_list, ktimer);
+
+struct timer_base
+{
+	struct cpu_spinlock lock; /* Protects the timers pending on the CPU. */
+	struct ktimer_list timers; /* Pending timers, ordered by expiry time. */
+	ktime_t next_tick; /* Time of the next scheduler tick. */
+	bool ticking; /* Is the scheduler tick running? */
+};
+
+static struct timer_base bases[X86_MAX_CPUS];
+
+static uint64_t tsc_freq = 0;
+static uint64_t tsc_base = 0;
+
+/* Sets up the TSC clocksource with the TSC frequency measured when calibrating the LAPIC timer.
+   The TSCs of all the CPUs are assumed to be synchronized. */
+void init_clocksource(uint64_t freq)
+{
+	kassert(freq != 0);
+
+	for (uint i = 0; i < X86_MAX_CPUS; i++)
+	{
+		cpu_spinlock_create(&(bases[i].lock), "timer");
+		TAILQ_INIT(&(bases[i].timers));
+		bases[i].next_tick = KTIME_MAX;
+		bases[i].ticking = false;
+	}
+
+	tsc_base = cpu_timestamp();
+	tsc_freq = freq;
+}
+
+/* Gets the current time in nanoseconds. Returns 0 before the clocksource is calibrated. */
+ktime_t ktime_get(void)
+{
+	uint64_t d;
+
+	if (tsc_freq == 0)
+		return 0;
+
+	/* Split the division so that the multiplication does not overflow. */
+	d = cpu_timestamp() - tsc_base;
+	return (d / tsc_freq) * NSEC_PER_SEC + ((d % tsc_freq) * NSEC_PER_SEC) / tsc_freq;
+}
+
+/* Converts a time to the TSC value at which it is reached. */
+uint64_t ktime_to_tsc(ktime_t t)
+{
+	return tsc_base + (t / NSEC_PER_SEC) * tsc_freq + ((t % NSEC_PER_SEC) * tsc_freq) / NSEC_PER_SEC;
+}
+
+/* Busy-waits for the given number of nanoseconds. For contexts that cannot sleep and for delays
+   too short to be worth sleeping. */
+void ktime_delay(ktime_t ns)
+{
+	ktime_t until = ktime_get() + ns;
+
+	while (ktime_get() < until)
+		cpu_relax();
+}
+
+/*
+ * The timer interrupt takes the base lock of its CPU. Spinlocks are recursive and do not keep
+ * interrupts off while held, so the interrupt would get the lock right away and find the list half
+ * edited. Everyone else disables interrupts for as long as they hold a base lock.
+ */
+
+/* Programs the CPU's timer for the earliest event. Requires the base lock. */
+static void unsafe_rearm(struct timer_base *base)
+{
+	struct ktimer *first = TAILQ_FIRST(&(base->timers));
+	ktime_t next = base->ticking ? base->next_tick : KTIME_MAX;
+
+	if (first && first->expires < next)
+		next = first->expires;
+
+	if (next == KTIME_MAX)
+		lapic_timer_stop();
+	else
+		lapic_timer_arm(ktime_to_tsc(next));
+}
+
+/* Starts the timer events of the current CPU, with the scheduler tick running. Called when the
+   CPU's LAPIC timer is set up. */
+void timer_start_cpu(void)
+{
+	struct timer_base *base = &bases[cpu_current()->num];
+
+	cpu_spinlock_acquire(&(base->lock));
+	push_no_interrupts();
+	base->ticking = true;
+	base->next_tick = ktime_get() + TICK_NSEC;
+	unsafe_rearm(base);
+	pop_no_interrupts();
+	cpu_spinlock_release(&(base->lock));
+}
+
+/* Handles the timer interrupt of the current CPU. Runs the expired timers and programs the next
+   event. Returns true if a scheduler tick was due. Called with interrupts disabled. */
+bool timer_interrupt(void)
+{
+	struct timer_base *base = &bases[cpu_current()->num];
+	struct ktimer *timer;
+	bool tick = false;
+	ktime_t now;
+
+	cpu_spinlock_acquire(&(base->lock));
+	now = ktime_get();
+
+	if (base->ticking && base->next_tick <= now)
+	{
+		tick = true;
+
+		if (is_boot_cpu())
+		{
+			/* The boot CPU maintains the ticks count, so ticks missed while interrupts were
+			   disabled are caught up. */
+			while (base->next_tick <= now)
+			{
+				ticks_increment();
+				base->next_tick += TICK_NSEC;
+			}
+		}
+		else
+		{
+			base->next_tick = now + TICK_NSEC;
+		}
+	}
+
+	while ((timer = TAILQ_FIRST(&(base->timers))) != NULL && timer->expires <= now)
+	{
+		/* The timer stops being pending before it runs, so that it can start itself again. */
+		TAILQ_REMOVE(&(base->timers), timer, ptrs);
+		atomic_store(&(timer->cpu), KTIMER_IDLE);
+
+		cpu_spinlock_release(&(base->lock));
+		timer->func(timer);
+		cpu_spinlock_acquire(&(base->lock));
+	}
+
+	unsafe_rearm(base);
+	cpu_spinlock_release(&(base->lock));
+
+	return tick;
+}
+
+/* Stops the scheduler tick of the current CPU. Timers keep firing. Call with interrupts disabled. */
+void timer_suspend_tick(void)
+{
+	struct timer_base *base = &bases[cpu_current()->num];
+
+	cpu_spinlock_acquire(&(base->lock));
+	push_no_interrupts();
+	base->ticking = false;
+	unsafe_rearm(base);
+	pop_no_interrupts();
+	cpu_spinlock_release(&(base->lock));
+}
+
+/* Restarts the scheduler tick of the current CPU. Call with interrupts disabled. */
+void timer_resume_tick(void)
+{
+	struct timer_base *base = &bases[cpu_current()->num];
+
+	cpu_spinlock_acquire(&(base->lock));
+	push_no_interrupts();
+	base->ticking = true;
+	base->next_tick = ktime_get() + TICK_NSEC;
+	unsafe_rearm(base);
+	pop_no_interrupts();
+	cpu_spinlock_release(&(base->lock));
+}
+
+/* kernel/ktime.h */
+
+/* Initializes a timer that calls func(timer). */
+void ktimer_create(struct ktimer *timer, void (*func)(struct ktimer *timer))
+{
+	timer->func = func;
+	timer->expires = 0;
+	atomic_init(&(timer->cpu), KTIMER_IDLE);
+}
+
+/* Starts the timer on the current CPU, to expire at the given time. Returns false if it was
+   already pending. */
+bool ktimer_start(struct ktimer *timer, ktime_t expires)
+{
+	struct timer_base *base;
+	struct ktimer *next;
+	int idle = KTIMER_IDLE;
+	bool started = false;
+	uint num;
+
+	preempt_disable();
+	num = cpu_current()->num;
+	base = &bases[num];
+
+	/* Claimed under the base lock, like work items, so that holding the lock of the base a timer
+	   is pending on means it is in the base's list. */
+	cpu_spinlock_acquire(&(base->lock));
+	push_no_interrupts();
+
+	if (atomic_compare_exchange_strong(&(timer->cpu), &idle, (int)num))
+	{
+		timer->expires = expires;
+
+		TAILQ_FOREACH(next, &(base->timers), ptrs)
+		{
+			if (next->expires > expires)
+			{
+				TAILQ_INSERT_BEFORE(next, timer, ptrs);
+				goto inserted;
+			}
+		}
+
+		TAILQ_INSERT_TAIL(&(base->timers), timer, ptrs);
+
+inserted:
+		/* Only a new first timer moves the next event. */
+		if (TAILQ_FIRST(&(base->timers)) == timer)
+			unsafe_rearm(base);
+
+		started = true;
+	}
+
+	pop_no_interrupts();
+	cpu_spinlock_release(&(base->lock));
+	preempt_enable();
+
+	return started;
+}
+
+/* Stops the timer if it is pending. Returns true if it was. Does not wait for the function if it is
+   already running. */
+bool ktimer_cancel(struct ktimer *timer)
+{
+	struct timer_base *base;
+	int num;
+
+	/* The timer may expire and start elsewhere while we get the lock, so check again under it. A
+	   canceled first timer leaves the hardware armed, the interrupt then finds nothing to run. */
+	while ((num = atomic_load(&(timer->cpu))) != KTIMER_IDLE)
+	{
+		base = &bases[num];
+		cpu_spinlock_acquire(&(base->lock));
+		push_no_interrupts();
+
+		if (atomic_load(&(timer->cpu)) == num)
+		{
+			TAILQ_REMOVE(&(base->timers), timer, ptrs);
+			atomic_store(&(timer->cpu), KTIMER_IDLE);
+			pop_no_interrupts();
+			cpu_spinlock_release(&(base->lock));
+			return true;
+		}
+
+		pop_no_interrupts();
+		cpu_spinlock_release(&(base->lock));
+	}
+
+	return false;
+}
+
+/* kernel/thread.h */
+
+struct usleep
+{
+	struct ktimer timer;
+	struct cpu_spinlock lock;
+	struct thread_cond cond;
+	bool expired;
+};
+
+static void usleep_expired(struct ktimer *timer)
+{
+	struct usleep *sleep = (struct usleep *)timer;
+
+	cpu_spinlock_acquire(&(sleep->lock));
+	sleep->expired = true;
+	sched_thread_notify_one(&(sleep->cond));
+	cpu_spinlock_release(&(sleep->lock));
+}
+
+/* Puts the current thread to sleep for a given number of microseconds. Unlike thread_sleep(), the
+   wakeup is not rounded up to scheduler ticks. */
+void thread_usleep(unsigned int microseconds)
+{
+	ktime_t ns = (ktime_t)microseconds * NSEC_PER_USEC;
+	struct usleep sleep;
+
+	/* Blocking costs two context switches. That is more than a delay shorter than a tick. */
+	if (ns < TICK_NSEC)
+	{
+		ktime_delay(ns);
+		return;
+	}
+
+	/* The lock lives for one sleep only, so it is not worth tracking in lockstat. */
+	ktimer_create(&(sleep.timer), usleep_expired);
+	cpu_spinlock_create(&(sleep.lock), NULL);
+	thread_cond_create(&(sleep.cond));
+	sleep.expired = false;
+
+	/* The timer is started on this CPU. With interrupts disabled until we have switched out, its
+	   function cannot run before we wait. */
+	cpu_spinlock_acquire(&(sleep.lock));
+	push_no_interrupts();
+	ktimer_start(&(sleep.timer), ktime_get() + ns);
+
+	while (!sleep.expired)
+		sched_thread_wait(&(sleep.cond), &(sleep.lock));
+
+	/* Getting the lock back means the function is done with our stack. */
+	pop_no_interrupts();
+	cpu_spinlock_release(&(sleep.lock));
+}
@@ -0,0 +1,280 @@
+/* vmalloc.c - x86 page-granular kernel allocations */
+#include <kernel/addr.h>
+#include <kernel/cdefs.h>
+#include <kernel/cpu.h>
+#include <kernel/debug.h>
+#include <kernel/paging.h>
+#include <kernel/queue.h>
+#include <kernel/slab.h>
+#include <kernel/utils.h>
+#include <kernel/workqueue.h>
+#include <arch/cpu.h>
+#include <arch/heap.h>
+#include <arch/palloc.h>
+#include <arch/paging.h>
+
+/*
+ * Allocations of a page or more get pages of their own in the vmalloc part of the heap region.
+ * Fresh pages are mapped on allocation, and unmapped and freed on kfree(), so the memory goes back
+ * to palloc() once a burst of large allocations is over. Each area is followed by an unmapped guard
+ * page, which catches overflows.
+ *
+ * Unmapping waits for a TLB shootdown, which other CPUs answer with an IPI. A CPU spinning on a
+ * lock with interrupts off never answers it, so the wait must not happen while we hold a spinlock
+ * or have interrupts off. Such frees are left to a worker thread. Frees before the workers have
+ * started wait for init_vfree_deferred().
+ */
+
+struct vm_area
+{
+	vaddr_t base;
+	size_t size; /* Mapped size in bytes. A multiple of the page size. */
+	TAILQ_ENTRY(vm_area) ptrs; /* Pointers in the area list. */
+	TAILQ_ENTRY(vm_area) dptrs; /* Pointers in the deferred list. */
+};
+
+TAILQ_HEAD(vm_area_list, vm_area);
+
+static struct cpu_spinlock vm_lock; /* Protects the area list. */
+static vaddr_t vm_base; /* Start of the vmalloc part of the heap region. */
+static vaddr_t vm_end; /* End of the vmalloc part of the heap region. */
+static struct vm_area_list vm_areas; /* Areas in use, sorted by address. */
+static struct vm_area_list vm_deferred; /* Freed areas, to be unmapped by a worker. */
+static struct work vm_deferred_work;
+static bool vm_workers_started; /* Can vm_deferred_work be queued? Protected by the lock. */
+static struct kmem_cache vm_area_cache;
+
+static void vfree_deferred(struct work *work);
+
+/* Sets up the vmalloc areas in [base, base + size). Called by the heap. */
+void init_vmalloc(vaddr_t base, size_t size)
+{
+	kassert(is_aligned_to_page_size(base));
+	kassert(is_aligned_to_page_size(size));
+
+	cpu_spinlock_create(&vm_lock, "vmalloc");
+	vm_base = base;
+	vm_end = base + size;
+	TAILQ_INIT(&vm_areas);
+	TAILQ_INIT(&vm_deferred);
+	work_create(&vm_deferred_work, vfree_deferred);
+	kmem_cache_create(&vm_area_cache, "vm area", sizeof(struct vm_area), sizeof(void *));
+}
+
+/* Checks whether the address belongs to the vmalloc part of the heap region. */
+bool is_vmalloc(vaddr_t v)
+{
+	return vm_base <= v && v < vm_end;
+}
+
+/* Finds the area starting at v. Requires the vmalloc lock. */
+static struct vm_area *unsafe_find(vaddr_t v)
+{
+	struct vm_area *area;
+
+	TAILQ_FOREACH(area, &vm_areas, ptrs)
+	{
+		if (area->base == v)
+			return area;
+	}
+
+	kpanic("vmalloc: not the start of an area");
+}
+
+/* Gets the end of the address space the area may grow into, guard page excluded. Requires the
+   vmalloc lock. */
+static vaddr_t unsafe_limit(struct vm_area *area)
+{
+	struct vm_area *next = TAILQ_NEXT(area, ptrs);
+
+	return (next ? next->base : vm_end) - PAGE_SIZE;
+}
+
+/* Maps fresh pages for size bytes, rounded up to pages. Returns a page-aligned address. */
+vaddr_t vmalloc(size_t size)
+{
+	struct vm_area *area, *p;
+	vaddr_t start = vm_base;
+	size_t span;
+
+	/* Same rules as for growing the rest of the heap. */
+	if (palloc_lock_held())
+		kpanic("holding palloc lock while using the kernel heap allocator");
+	if (kp_lock_held())
+		kpanic("holding kernel page tables write lock while using the kernel heap allocator");
+
+	area = kmem_cache_alloc(&vm_area_cache);
+	area->size = align_to_next_page(size);
+	span = area->size + PAGE_SIZE;
+
+	cpu_spinlock_acquire(&vm_lock);
+
+	/* First fit. */
+	TAILQ_FOREACH(p, &vm_areas, ptrs)
+	{
+		if ((size_t)(p->base - start) >= span)
+			break;
+
+		start = p->base + p->size + PAGE_SIZE;
+	}
+
+	if (p == NULL && (size_t)(vm_end - start) < span)
+		kpanic("vmalloc: out of virtual memory");
+
+	area->base = start;
+
+	if (p)
+		TAILQ_INSERT_BEFORE(p, area, ptrs);
+	else
+		TAILQ_INSERT_TAIL(&vm_areas, area, ptrs);
+
+	cpu_spinlock_release(&vm_lock);
+
+	/* The area is ours now, so it can be mapped without the lock. */
+	kp_map_range(area->base, area->size, PHYS_NULL);
+
+	return area->base;
+}
+
+/* Checks whether we may wait for a TLB shootdown now. Holding a spinlock disables preemption. */
+static bool can_unmap(void)
+{
+	if (get_nof_active_cpus() <= 1)
+		return true;
+
+	return (cpu_get_eflags() & EFLAGS_IF) && cpu_current()->preempt_disabled == 0;
+}
+
+/* Unmaps the area, frees its pages and takes it off the area list. */
+static void unmap_area(struct vm_area *area)
+{
+	kp_unmap_range(area->base, area->size);
+
+	cpu_spinlock_acquire(&vm_lock);
+	TAILQ_REMOVE(&vm_areas, area, ptrs);
+	cpu_spinlock_release(&vm_lock);
+
+	kmem_cache_free(&vm_area_cache, area);
+}
+
+/* Unmaps the areas whose free had to be deferred. */
+static void vfree_deferred(__unused struct work *work)
+{
+	struct vm_area *area;
+
+	while (1)
+	{
+		cpu_spinlock_acquire(&vm_lock);
+
+		if ((area = TAILQ_FIRST(&vm_deferred)) != NULL)
+			TAILQ_REMOVE(&vm_deferred, area, dptrs);
+
+		cpu_spinlock_release(&vm_lock);
+
+		if (area == NULL)
+			return;
+
+		unmap_area(area);
+	}
+}
+
+/* Unmaps the area starting at v and frees its pages. */
+void vfree(vaddr_t v)
+{
+	struct vm_area *area;
+	bool defer, queue = false;
+
+	/* Checked before taking the lock, which disables preemption. */
+	defer = !can_unmap();
+
+	cpu_spinlock_acquire(&vm_lock);
+
+	area = unsafe_find(v);
+
+	/* The area stays in the list until its pages are gone, so that no one maps it meanwhile. */
+	if (defer)
+	{
+		TAILQ_INSERT_TAIL(&vm_deferred, area, dptrs);
+		queue = vm_workers_started;
+	}
+
+	cpu_spinlock_release(&vm_lock);
+
+	if (queue)
+		work_queue(&vm_deferred_work);
+	else if (!defer)
+		unmap_area(area);
+}
+
+/* Lets vfree() hand areas to the worker threads, and queues the areas freed before. Call once the
+   workers have started. */
+void init_vfree_deferred(void)
+{
+	bool queue;
+
+	cpu_spinlock_acquire(&vm_lock);
+	vm_workers_started = true;
+	queue = !TAILQ_EMPTY(&vm_deferred);
+	cpu_spinlock_release(&vm_lock);
+
+	if (queue)
+		work_queue(&vm_deferred_work);
+}
+
+/* Gets the mapped size of the area starting at v. */
+size_t vmalloc_size(vaddr_t v)
+{
+	size_t size;
+
+	cpu_spinlock_acquire(&vm_lock);
+	size = unsafe_find(v)->size;
+	cpu_spinlock_release(&vm_lock);
+
+	return size;
+}
+
+/* Resizes the area starting at v to size bytes, rounded up to pages, without moving it. Returns
+   false if the following address space is taken. */
+bool vmalloc_resize(vaddr_t v, size_t size)
+{
+	struct vm_area *area;
+	size_t old_size;
+
+	size = align_to_next_page(size);
+
+	/* The pages past the new size stay mapped if they cannot be unmapped now. */
+	if (!can_unmap())
+		size = kmax(size, vmalloc_size(v));
+
+	cpu_spinlock_acquire(&vm_lock);
+
+	area = unsafe_find(v);
+	old_size = area->size;
+
+	if (size > old_size && area->base + size > unsafe_limit(area))
+	{
+		cpu_spinlock_release(&vm_lock);
+		return false;
+	}
+
+	/* Growing claims the space right away. Shrinking gives it up once the pages are unmapped. */
+	if (size > old_size)
+		area->size = size;
+
+	cpu_spinlock_release(&vm_lock);
+
+	if (size > old_size)
+	{
+		kp_map_range(v + old_size, size - old_size, PHYS_NULL);
+	}
+	else if (size < old_size)
+	{
+		kp_unmap_range(v + size, old_size - size);
+
+		cpu_spinlock_acquire(&vm_lock);
+		area->size = size;
+		cpu_spinlock_release(&vm_lock);
+	}
+
+	return true;
+}
@@ -0,0 +1,332 @@
+/* workqueue.c - x86 implementation of per-CPU worker threads */
+#include <kernel/cdefs.h>
+#include <kernel/cpu.h>
+#include <kernel/debug.h>
+#include <kernel/printf.h>
+#include <kernel/scheduler.h>
+#include <kernel/thread.h>
+#include <kernel/workqueue.h>
+#include <arch/cpu.h>
+#include <arch/scheduler.h>
+
+/* Workers run in the real-time class, below any other real-time thread, so that deferred work is
+   not held up by busy CPUs. */
+#define WORKER_PRIORITY (SCHED_RT_PRIORITIES - 1)
+
+TAILQ_HEAD(work_list, work);
+
+/* Work is queued from interrupt handlers, so the worker lock is only held with interrupts disabled.
+   Otherwise a handler could get it right away, as spinlocks are recursive, and find a list half
+   edited. */
+struct worker
+{
+	struct cpu_spinlock lock; /* Protects the lists and the work pending on the worker. */
+	struct work_list queue; /* Work to run, in FIFO order. */
+	struct work_list delayed; /* Delayed work, ordered by expiry tick. */
+	_Atomic ticks_t next_expiry; /* Expiry tick of the first delayed item. Read without the lock. */
+	struct work *running; /* Work whose function is running. */
+	struct thread_cond wait_cond; /* The worker thread waits here for work. */
+	struct thread_cond done_cond; /* Flushers wait here for work to finish. */
+};
+
+static struct worker workers[X86_MAX_CPUS];
+
+/* Number of started workers. Zero until init_workqueue() has been called. */
+static atomic_uint nof_workers;
+
+static void worker_main(void *cookie)
+{
+	struct worker *w = (struct worker *)cookie;
+	struct work *work;
+
+	cpu_spinlock_acquire(&(w->lock));
+	push_no_interrupts();
+
+	while (1)
+	{
+		while (TAILQ_EMPTY(&(w->queue)))
+			sched_thread_wait(&(w->wait_cond), &(w->lock));
+
+		/* The work stops being pending before it runs, so that it can queue itself again. */
+		work = TAILQ_FIRST(&(w->queue));
+		TAILQ_REMOVE(&(w->queue), work, ptrs);
+		atomic_store(&(work->cpu), WORK_IDLE);
+		w->running = work;
+
+		pop_no_interrupts();
+		cpu_spinlock_release(&(w->lock));
+
+		work->func(work);
+
+		/* The function may have freed the work, so it is only compared against from now on. */
+		cpu_spinlock_acquire(&(w->lock));
+		push_no_interrupts();
+		w->running = NULL;
+
+		if (atomic_load(&(w->done_cond.num_waiting)) > 0)
+			sched_thread_notify_all(&(w->done_cond));
+	}
+}
+
+/* Starts the worker threads. Call once the CPUs are enumerated. */
+void init_workqueue(void)
+{
+	struct worker *w;
+	struct thread *thread;
+	char name[32];
+	int len;
+
+	for (uint i = 0; i < get_nof_cpus(); i++)
+	{
+		w = &workers[i];
+
+		cpu_spinlock_create(&(w->lock), "worker");
+		TAILQ_INIT(&(w->queue));
+		TAILQ_INIT(&(w->delayed));
+		atomic_init(&(w->next_expiry), ticks_get_max());
+		w->running = NULL;
+		thread_cond_create(&(w->wait_cond));
+		thread_cond_create(&(w->done_cond));
+
+		len = ksnprintf(name, sizeof(name) - 1, "worker %u", i);
+		name[len > 0 ? len : 0] = '\0';
+
+		/* Each worker stays on its CPU. */
+		thread = kthread_create(worker_main, w, name);
+		sched_set_policy(thread, SCHED_RT, WORKER_PRIORITY);
+		sched_set_affinity(thread, cpu_mask_bit(i));
+		schedule_thread(PID_KERNEL, thread);
+	}
+
+	atomic_store(&nof_workers, get_nof_cpus());
+}
+
+/* Initializes a work item that calls func(work). */
+void work_create(struct work *work, void (*func)(struct work *work))
+{
+	work->func = func;
+	atomic_init(&(work->cpu), WORK_IDLE);
+	work->delayed = false;
+	work->expires = 0;
+}
+
+/* Inserts delayed work in expiry order. Requires the worker lock. */
+static void unsafe_insert_delayed(struct worker *w, struct work *work)
+{
+	struct work *next;
+
+	TAILQ_FOREACH(next, &(w->delayed), ptrs)
+	{
+		if (next->expires > work->expires)
+		{
+			TAILQ_INSERT_BEFORE(next, work, ptrs);
+			goto inserted;
+		}
+	}
+
+	TAILQ_INSERT_TAIL(&(w->delayed), work, ptrs);
+
+inserted:
+	atomic_store(&(w->next_expiry), TAILQ_FIRST(&(w->delayed))->expires);
+}
+
+/* Takes pending work off the list it is in. Requires the worker lock. */
+static void unsafe_remove(struct worker *w, struct work *work)
+{
+	if (work->delayed)
+	{
+		TAILQ_REMOVE(&(w->delayed), work, ptrs);
+		atomic_store(&(w->next_expiry), TAILQ_EMPTY(&(w->delayed)) ? ticks_get_max() :
+			TAILQ_FIRST(&(w->delayed))->expires);
+	}
+	else
+	{
+		TAILQ_REMOVE(&(w->queue), work, ptrs);
+	}
+
+	work->delayed = false;
+	atomic_store(&(work->cpu), WORK_IDLE);
+}
+
+static void wake_worker(struct worker *w)
+{
+	/* The worker counts itself as waiting before it drops its lock, so it cannot be missed. */
+	if (atomic_load(&(w->wait_cond.num_waiting)) > 0)
+		sched_thread_notify_one(&(w->wait_cond));
+}
+
+static bool queue_on(uint num, struct work *work, bool delayed, ticks_t expires)
+{
+	struct worker *w;
+	int idle = WORK_IDLE;
+	bool queued = false;
+
+	kassert(num < atomic_load(&nof_workers));
+	w = &workers[num];
+
+	/* The work is claimed under the worker lock, so that holding the lock of the worker a work is
+	   pending on means it is in one of the worker's lists. */
+	cpu_spinlock_acquire(&(w->lock));
+	push_no_interrupts();
+
+	if (atomic_compare_exchange_strong(&(work->cpu), &idle, (int)num))
+	{
+		work->delayed = delayed;
+		work->expires = expires;
+
+		if (delayed)
+			unsafe_insert_delayed(w, work);
+		else
+			TAILQ_INSERT_TAIL(&(w->queue), work, ptrs);
+
+		queued = true;
+	}
+
+	pop_no_interrupts();
+	cpu_spinlock_release(&(w->lock));
+
+	if (queued && !delayed)
+		wake_worker(w);
+
+	return queued;
+}
+
+/* Queues the work on the current CPU. Returns false if it was already pending. */
+bool work_queue(struct work *work)
+{
+	bool ret;
+
+	preempt_disable();
+	ret = queue_on(cpu_current()->num, work, false, 0);
+	preempt_enable();
+
+	return ret;
+}
+
+/* Queues the work on the CPU with the given number. Returns false if it was already pending. */
+bool work_queue_on(uint num, struct work *work)
+{
+	return queue_on(num, work, false, 0);
+}
+
+/* Queues the work on the current CPU once the given number of milliseconds has passed. Returns
+   false if it was already pending. */
+bool work_queue_delayed(struct work *work, uint milliseconds)
+{
+	ticks_t expires = ticks_get() + (ticks_t)milliseconds * TICKS_PER_MILLISECOND;
+	bool ret;
+
+	preempt_disable();
+	ret = queue_on(cpu_current()->num, work, true, expires);
+	preempt_enable();
+
+	return ret;
+}
+
+/* Takes the work off its queue if it is pending. Returns true if it was. Does not wait for the
+   function if it is already running. */
+bool work_cancel(struct work *work)
+{
+	struct worker *w;
+	int num;
+
+	/* The work may move to another worker while we get the lock, so check again under it. */
+	while ((num = atomic_load(&(work->cpu))) != WORK_IDLE)
+	{
+		w = &workers[num];
+		cpu_spinlock_acquire(&(w->lock));
+		push_no_interrupts();
+
+		if (atomic_load(&(work->cpu)) == num)
+		{
+			unsafe_remove(w, work);
+
+			if (atomic_load(&(w->done_cond.num_waiting)) > 0)
+				sched_thread_notify_all(&(w->done_cond));
+
+			pop_no_interrupts();
+			cpu_spinlock_release(&(w->lock));
+			return true;
+		}
+
+		pop_no_interrupts();
+		cpu_spinlock_release(&(w->lock));
+	}
+
+	return false;
+}
+
+/* Sleeps until no worker has the work pending, if pending is true, or running. */
+static void wait_for_work(struct work *work, bool pending)
+{
+	struct worker *w;
+
+	for (uint i = 0; i < atomic_load(&nof_workers); i++)
+	{
+		w = &workers[i];
+		cpu_spinlock_acquire(&(w->lock));
+		push_no_interrupts();
+
+		/* A work function waiting for itself would never wake up. */
+		kassert(w->running != work || get_current_thread()->cookie != w);
+
+		while ((pending && atomic_load(&(work->cpu)) == (int)i) || w->running == work)
+			sched_thread_wait(&(w->done_cond), &(w->lock));
+
+		pop_no_interrupts();
+		cpu_spinlock_release(&(w->lock));
+	}
+}
+
+/* Sleeps until the work is neither pending nor running. Delayed work is waited for, too. */
+void work_flush(struct work *work)
+{
+	wait_for_work(work, true);
+}
+
+/* Cancels the work and waits for its function to finish if it is running. Returns true if the work
+   was pending. */
+bool work_cancel_sync(struct work *work)
+{
+	bool ret = work_cancel(work);
+
+	wait_for_work(work, false);
+
+	return ret;
+}
+
+/* Moves delayed work whose tick has come to the run queue. Called from the timer interrupt, with
+   interrupts disabled. */
+void work_timer_tick(void)
+{
+	struct worker *w;
+	struct work *work;
+	ticks_t now;
+	uint num;
+
+	if (atomic_load(&nof_workers) == 0)
+		return;
+
+	num = cpu_current()->num;
+	w = &workers[num];
+	now = ticks_get();
+
+	/* Cheap check first, this is called on every tick. */
+	if (atomic_load(&(w->next_expiry)) > now)
+		return;
+
+	cpu_spinlock_acquire(&(w->lock));
+
+	while ((work = TAILQ_FIRST(&(w->delayed))) != NULL && work->expires <= now)
+	{
+		TAILQ_REMOVE(&(w->delayed), work, ptrs);
+		work->delayed = false;
+		TAILQ_INSERT_TAIL(&(w->queue), work, ptrs);
+	}
+
+	atomic_store(&(w->next_expiry), work ? work->expires : ticks_get_max());
+
+	cpu_spinlock_release(&(w->lock));
+
+	wake_worker(w);
+}
@@ -25,6 +25,13 @@ struct block_dev
 	/* Unlock the index block. */
 	void (*unlock)(struct block_dev *dev, uint index);
 
+	/* Lock the block with number num for reading only. Many threads can hold a block locked for
+	   reading at the same time. Returns an index valid until unlock_read. */
+	uint (*lock_read)(struct block_dev *dev, uint num);
+
+	/* Unlock the index block locked with lock_read. */
+	void (*unlock_read)(struct block_dev *dev, uint index);
+
 	/* Write len bytes to the index block, starting at offset off, from src. */
 	void (*write)(struct block_dev *dev, uint index, uint off, const byte *src, uint len);
 
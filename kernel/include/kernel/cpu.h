@@ -4,6 +4,7 @@
 
 #include <kernel/cdefs.h>
 #include <kernel/debug.h>
+#include <kernel/lockstat.h>
 
 /* Include arch-provided header. */
 #include <arch/kernel/cpu.h>
@@ -15,12 +16,53 @@
    initialization stages, where CPUs have not yet been enumerated. */
 #define CPU_SPINLOCK_UNKNOWN_CPU -2
 
+/* Set of CPUs, one bit for each CPU number. */
+typedef uint cpu_mask_t;
+
+#define CPU_MASK_ALL ((cpu_mask_t)~0u)
+#define cpu_mask_bit(num) ((cpu_mask_t)1 << (num))
+
+/* Spinning strategies of struct cpu_spinlock. */
+enum cpu_spinlock_type
+{
+	/* Test-and-set. Cheapest when uncontended, but waiters bounce the lock's cache line and the
+	   order in which they get the lock is arbitrary. */
+	CPU_SPINLOCK_TAS = 0,
+
+	/* Ticket lock. Waiters get the lock in FIFO order, but all of them spin on the same word. */
+	CPU_SPINLOCK_TICKET,
+
+	/* MCS queue lock. Waiters get the lock in FIFO order and each one spins on its own node. */
+	CPU_SPINLOCK_MCS,
+};
+
+/* Queue node of an MCS spinlock waiter or holder. Each CPU has a small pool of these. */
+struct cpu_mcs_node
+{
+	struct cpu_mcs_node *_Atomic next; /* Next waiter in the queue. */
+	atomic_bool waiting; /* Cleared by the previous holder when the lock is handed over. */
+};
+
+/* Ticket and MCS spinlocks must not be acquired by interrupt handlers. A handler interrupting a
+   waiter of the same lock would wait behind it forever. */
 struct cpu_spinlock
 {
 	int locked; /* Is the lock acquired? */
+	int type; /* Spinning strategy. (enum cpu_spinlock_type) */
 	int num;
 	int cpu; /* The number of the holding CPU. */
 
+	atomic_uint ticket_next; /* Next ticket to hand out, if type == CPU_SPINLOCK_TICKET. */
+	atomic_uint ticket_owner; /* Ticket being served, if type == CPU_SPINLOCK_TICKET. */
+
+	struct cpu_mcs_node *_Atomic mcs_tail; /* Last queued node, if type == CPU_SPINLOCK_MCS. */
+	struct cpu_mcs_node *mcs_node; /* Node of the holder, if type == CPU_SPINLOCK_MCS. */
+
+#ifdef KERNEL_LOCKSTAT
+	struct lockstat_class *lockstat; /* Statistics class, or NULL if not tracked. */
+	uint64_t lockstat_since; /* Timestamp of the acquisition. */
+#endif
+
 #ifdef KERNEL_DEBUG
 	const char *name; /* Name of the CPU spinlock. */
 	uint tid; /* TID of the thread the CPU was running when it was locked. */
@@ -28,7 +70,10 @@ struct cpu_spinlock
 #endif
 };
 
+/* Creates a test-and-set spinlock. */
 void cpu_spinlock_create(struct cpu_spinlock *spinlock, const char *name);
+/* Creates a spinlock with the given spinning strategy. */
+void cpu_spinlock_create_type(struct cpu_spinlock *spinlock, const char *name, int type);
 void cpu_spinlock_acquire(struct cpu_spinlock *spinlock);
 void cpu_spinlock_release(struct cpu_spinlock *spinlock);
 bool cpu_spinlock_held(struct cpu_spinlock *spinlock);
@@ -5,6 +5,10 @@
 #include <kernel/cdefs.h>
 #include <kernel/thread.h>
 
+/* Microseconds to let the drive settle after a register write. The spec asks for 400 ns. The
+   drivers hold the channel mutex, so they sleep rather than spin. */
+#define ATA_DELAY_US				10
+
 /* ATA protocol constants. */
 
 /* ATA statuses. */
@@ -3,6 +3,7 @@
 #define _KERNEL_FS_FAT_VFS_H
 
 #include <kernel/cdefs.h>
+#include <kernel/slab.h>
 #include <kernel/thread.h>
 #include <kernel/vfs.h>
 #include <kernel/fs/fat_types.h>
@@ -36,10 +37,11 @@ struct fat_vfs_super_data
 
 	struct fat_entry root_entry;
 
-	/* Dynamic part. */
-	struct thread_mutex mutex;
+	/* Dynamic part. Lookups hold the lock for reading, node creation and removal for writing. */
+	struct thread_rwlock lock;
 	uint nof_nodes;
 	struct vfs_node_list node_list;
+	struct kmem_cache node_cache; /* Holds struct fat_vfs_node_data. */
 };
 
 static inline uint32_t fat_first_sector_of_cluster(const struct fat_vfs_super_data *s,
@@ -53,12 +55,13 @@ static inline uint32_t fat_first_sector_of_cluster(const struct fat_vfs_super_da
 
 struct fat_vfs_node_data
 {
-	/* Super part. To modify, super lock has to be held.*/
+	/* Super part. To modify, super lock has to be held. The counters are atomic, so that they can
+	   be updated with the super lock held for reading. */
 
 	uint32_t dir_cluster; /* Directory cluster where the node entry is located. */
 	uint32_t first_cluster; /* First cluster on disk that contains the data of the node. */
-	uint ref; /* Current number of references to this node. */
-	uint hit; /* Number of times this node has been found. */
+	atomic_uint ref; /* Current number of references to this node. */
+	atomic_uint hit; /* Number of times this node has been found. */
 
 	/* Dynamic part. (protected by node mutex) */
 
@@ -13,4 +13,12 @@ extern uint32_t yaos2_initialized;
 
 noreturn kernel_main(void);
 
+/* Saves the kernel command line given by the boot loader. Call before the memory it is in is
+   reused. */
+void init_cmdline(const char *from);
+
+/* Gets an option with an unsigned decimal value from the kernel command line. Returns false if the
+   option is not given or its value is not a number. */
+bool cmdline_get_uint(const char *name, uint *value);
+
 #endif
@@ -0,0 +1,52 @@
+/* kernel/ktime.h - high-resolution time and timers */
+#ifndef _KERNEL_KTIME_H
+#define _KERNEL_KTIME_H
+
+#include <kernel/cdefs.h>
+#include <kernel/queue.h>
+
+/* Nanoseconds since the clocksource was calibrated at boot. */
+typedef uint64_t ktime_t;
+
+#define KTIME_MAX ((ktime_t)UINT64_MAX)
+
+#define NSEC_PER_USEC 1000ull
+#define NSEC_PER_MSEC 1000000ull
+#define NSEC_PER_SEC 1000000000ull
+
+/* Gets the current time in nanoseconds. Returns 0 before the clocksource is calibrated. */
+ktime_t ktime_get(void);
+
+/* Busy-waits for the given number of nanoseconds. For contexts that cannot sleep and for delays
+   too short to be worth sleeping. */
+void ktime_delay(ktime_t ns);
+
+/*
+ * One-shot timers. The function of a timer runs in the timer interrupt of the CPU the timer was
+ * started on, once the expiry time has passed. It must not sleep. The CPU's timer hardware is
+ * programmed for the earliest pending timer, so expiries are not rounded to scheduler ticks.
+ */
+
+#define KTIMER_IDLE -1
+
+struct ktimer
+{
+	void (*func)(struct ktimer *timer);
+	ktime_t expires; /* Expiry time. */
+
+	atomic_int cpu; /* CPU the timer is pending on, or KTIMER_IDLE. */
+	TAILQ_ENTRY(ktimer) ptrs;
+};
+
+/* Initializes a timer that calls func(timer). */
+void ktimer_create(struct ktimer *timer, void (*func)(struct ktimer *timer));
+
+/* Starts the timer on the current CPU, to expire at the given time. Returns false if it was
+   already pending. */
+bool ktimer_start(struct ktimer *timer, ktime_t expires);
+
+/* Stops the timer if it is pending. Returns true if it was. Does not wait for the function if it is
+   already running. */
+bool ktimer_cancel(struct ktimer *timer);
+
+#endif
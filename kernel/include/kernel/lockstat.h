@@ -0,0 +1,48 @@
+/* kernel/lockstat.h - lock contention statistics */
+#ifndef _KERNEL_LOCKSTAT_H
+#define _KERNEL_LOCKSTAT_H
+
+#include <kernel/cdefs.h>
+
+/* Statistics are kept per lock class. Spinlocks with the same name share a class, as do mutexes
+   and rwlocks created at the same source line. Times are in timestamp counter cycles. They are only
+   recorded in kernels built with KERNEL_LOCKSTAT (make LOCKSTAT=1), as recording slows down every
+   lock operation. */
+
+#define LOCKSTAT_MAX_CLASSES 128
+
+enum lockstat_kind
+{
+	LOCKSTAT_SPINLOCK = 0,
+	LOCKSTAT_MUTEX,
+	LOCKSTAT_RWLOCK,
+};
+
+#ifdef KERNEL_LOCKSTAT
+
+struct lockstat_class;
+
+/* Gets the class of a spinlock with the given name, creating it if needed. Returns NULL if the
+   name is NULL or the class table is full, in which case the lock is not tracked. */
+struct lockstat_class *lockstat_get_spinlock_class(const char *name);
+
+/* Gets the class of a mutex or rwlock created at the given source line, creating it if needed. */
+struct lockstat_class *lockstat_get_creation_class(int kind, const char *file, unsigned int line);
+
+/* Records an acquisition on the given CPU that waited the given number of cycles. Call on that CPU
+   with interrupts disabled. */
+void lockstat_acquired(struct lockstat_class *cls, uint cpu, bool contended, uint64_t wait);
+
+/* Records a release on the given CPU of a lock held for the given number of cycles. Call on that
+   CPU with interrupts disabled. */
+void lockstat_released(struct lockstat_class *cls, uint cpu, uint64_t hold);
+
+/* Clears the statistics of all classes. */
+void lockstat_reset(void);
+
+/* Publishes the statistics as /dev/lockstat. Reading dumps them, writing anything resets them. */
+void init_lockstat(void);
+
+#endif
+
+#endif
@@ -34,30 +34,39 @@ enum proc_state
 
 #define PROC_MAX_FILES 16
 
+LIST_HEAD(proc_list, proc);
+
+/* Processes start a cache line. The first one holds what the threads of the process read on every
+   tick and switch. The process mutex, written by any thread doing file operations, starts a line
+   of its own. */
 struct proc
 {
 	/* Constant part. */
 
 	pid_t pid;
 	pid_t parent;
-	char name[32];
 	struct arch_proc *arch;
 
 	/* Dynamic part. Protected with global scheduler lock. */
 
-	int state;
+	int state; /* Read on every tick, without the lock. */
 	int exit_status;
 	struct thread_list threads; /* Thread list. */
+	struct proc_list children; /* Running child processes. */
+	struct proc_list defunct_children; /* Exited child processes waiting to be collected. */
+	struct thread_queue waiters; /* Threads waiting in wait() for a child process to exit. */
 
-	/* Dynamic part. Protected with process mutex. */
+	LIST_ENTRY(proc) pointers;
+	LIST_ENTRY(proc) hptrs; /* PID hash table chain pointers. */
+	LIST_ENTRY(proc) cptrs; /* Parent's children or defunct_children list pointers. */
 
-	struct thread_mutex mutex;
-	struct file *opened_files[PROC_MAX_FILES]; /* TODO: Get rid of this array. */
+	char name[32];
 
-	LIST_ENTRY(proc) pointers;
-};
+	/* Dynamic part. Protected with process mutex. */
 
-LIST_HEAD(proc_list, proc);
+	struct thread_mutex mutex __cacheline_aligned;
+	struct file *opened_files[PROC_MAX_FILES]; /* TODO: Get rid of this array. */
+} __cacheline_aligned;
 
 /* Creates a new proc object. */
 struct proc *proc_alloc(const char *name);
@@ -72,6 +81,9 @@ void proc_free(struct proc *proc);
 /* Reserves a physical page for the virtual memory page pointed at by v. */
 void proc_vmreserve(struct proc *proc, uvaddr_t v, uint flags);
 
+/* Reserves physical pages for all the virtual memory pages in [v, v + size). */
+void proc_vmreserve_range(struct proc *proc, uvaddr_t v, size_t size, uint flags);
+
 /* Read from the process' virtual memory. */
 void proc_vmread(struct proc *proc, uvaddr_t v, void *buf, size_t num);
 
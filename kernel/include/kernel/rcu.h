@@ -0,0 +1,83 @@
+/* kernel/rcu.h - read-copy-update synchronization for read-mostly data */
+#ifndef _KERNEL_RCU_H
+#define _KERNEL_RCU_H
+
+#include <kernel/cdefs.h>
+#include <kernel/cpu.h>
+#include <kernel/queue.h>
+
+/*
+ * Readers access RCU-protected data between rcu_read_lock() and rcu_read_unlock() without taking
+ * any locks. Read-side sections disable preemption, so they must not sleep. Updaters serialize
+ * among themselves with a normal lock, publish new data with rcu_assign_pointer() and free the
+ * old data only after a grace period, using call_rcu() or synchronize_rcu().
+ *
+ * A grace period ends when every active CPU has passed through a quiescent state, i.e. has
+ * rescheduled, has taken a timer tick outside a read-side section or has gone idle. CPUs that are
+ * idle when it starts are left out. By then no reader can still see the old data. Interrupt
+ * handlers must not enter read-side sections, as they can run on idle CPUs.
+ */
+
+struct rcu_head
+{
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *head);
+};
+
+/* Enters a read-side section. Sections can be nested. */
+static inline void rcu_read_lock(void)
+{
+	preempt_disable();
+}
+
+/* Leaves a read-side section. */
+static inline void rcu_read_unlock(void)
+{
+	preempt_enable();
+}
+
+/* Reads an RCU-protected pointer. */
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+
+/* Publishes an RCU-protected pointer. Stores initializing the pointed-to data are visible to
+   readers before the pointer is. */
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/* Variants of the kernel/queue.h list macros that are safe against concurrent readers. Updaters
+   still have to hold a lock. */
+
+#define RCU_LIST_INSERT_HEAD(head, elm, field) do {				\
+	(elm)->field.le_next = LIST_FIRST(head);					\
+	(elm)->field.le_prev = &LIST_FIRST(head);					\
+	if (LIST_FIRST(head) != NULL)							\
+		LIST_FIRST(head)->field.le_prev = &(elm)->field.le_next;	\
+	rcu_assign_pointer(LIST_FIRST(head), (elm));				\
+} while (0)
+
+/* The element may still be read until a grace period has passed, so it is left intact. */
+#define RCU_LIST_REMOVE(elm, field) do {						\
+	if ((elm)->field.le_next != NULL)						\
+		(elm)->field.le_next->field.le_prev = (elm)->field.le_prev;	\
+	rcu_assign_pointer(*(elm)->field.le_prev, (elm)->field.le_next);	\
+} while (0)
+
+#define RCU_LIST_FOREACH(var, head, field)					\
+	for ((var) = rcu_dereference(LIST_FIRST(head));			\
+		(var);											\
+		(var) = rcu_dereference(LIST_NEXT((var), field)))
+
+/* Initializes RCU and starts the thread running the grace period callbacks. */
+void init_rcu(void);
+
+/* Calls func(head) from a kernel thread once a grace period has passed. Can be called from any
+   context. */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+
+/* Sleeps until a grace period has passed. */
+void synchronize_rcu(void);
+
+/* Reports a quiescent state of the current CPU. Called by the scheduler with interrupts disabled,
+   when the CPU is not in a read-side section. */
+void rcu_quiescent_state(void);
+
+#endif
@@ -33,4 +33,33 @@ tid_t schedule_thread(pid_t pid, struct thread *thread);
 /* Reset performance counters. */
 void schedule_reset_perf_counters(void);
 
+/* Sets the scheduling policy and priority of the given thread. Returns 0 on success, -EPARAM if the
+   policy or priority is invalid. */
+int sched_set_policy(struct thread *thread, int policy, int priority);
+
+/* Sets the time slice of the given policy in microseconds. It is rounded up to whole ticks. Returns 0
+   on success, -EPARAM if the policy or the length is invalid. */
+int sched_set_time_slice(int policy, uint microseconds);
+
+/* Gets the time slice of the given policy in microseconds. Returns 0 if the policy is invalid. */
+uint sched_get_time_slice(int policy);
+
+/* Gets the scheduling policy and priority of the given thread. */
+void sched_get_policy(struct thread *thread, int *policy, int *priority);
+
+/* Sets the CPUs the given thread may run on. The thread is moved off a CPU that is not in the mask
+   anymore. Returns 0 on success, -EPARAM if the mask contains no existing CPU. */
+int sched_set_affinity(struct thread *thread, cpu_mask_t mask);
+
+/* Gets the CPUs the given thread may run on. */
+cpu_mask_t sched_get_affinity(struct thread *thread);
+
+/* Reserves the given CPUs for threads pinned to them. Threads whose affinity allows any CPU outside
+   of the mask are kept off these CPUs. Returns 0 on success, -EPARAM if no CPU would be left for
+   other threads. */
+int sched_isolate_cpus(cpu_mask_t mask);
+
+/* Gets the isolated CPUs. */
+cpu_mask_t sched_get_isolated_cpus(void);
+
 #endif
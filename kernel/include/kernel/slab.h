@@ -0,0 +1,64 @@
+/* kernel/slab.h - object caches for fixed-size kernel objects */
+#ifndef _KERNEL_SLAB_H
+#define _KERNEL_SLAB_H
+
+#include <kernel/addr.h>
+#include <kernel/cdefs.h>
+#include <kernel/cpu.h>
+#include <kernel/queue.h>
+
+/*
+ * A cache hands out objects of one size from slabs, pages carved into equal slots. Freed objects go
+ * back to their slab and are reused by the next allocation, so churn does not grow the heap. Slabs
+ * left empty are kept for reuse, up to a limit. Past the limit their pages go back to a pool shared
+ * by all caches.
+ *
+ * kalloc() serves small requests from a set of size-class caches. Objects allocated from a cache
+ * can be freed with kfree() as well. Each CPU keeps a magazine of free objects for every size
+ * class, so kalloc() and kfree() mostly do not take the cache lock. Magazines are refilled from
+ * and drained to their cache in batches.
+ */
+
+/* Largest object a cache can hold. */
+#define KMEM_CACHE_MAX_SIZE 1024
+
+struct slab;
+
+LIST_HEAD(slab_list, slab);
+
+struct kmem_cache
+{
+	const char *name;
+	size_t size; /* Distance between objects in a slab. A multiple of the alignment. */
+	uint objs_per_slab;
+
+	struct cpu_spinlock lock; /* Protects the slab lists and the slabs. */
+	struct slab_list partial; /* Slabs with both used and free objects. */
+	struct slab_list full; /* Slabs without free objects. */
+	struct slab_list empty; /* Slabs without used objects. */
+	uint nof_empty; /* Number of slabs in the empty list. */
+};
+
+/* Initializes a cache of objects with the given size and alignment. The alignment must be a power
+   of two. */
+void kmem_cache_create(struct kmem_cache *cache, const char *name, size_t size, size_t align);
+
+/* Allocates an object from the cache. */
+vaddr_t kmem_cache_alloc(struct kmem_cache *cache);
+
+/* Allocates n objects from the cache into objs, taking the cache lock once. */
+void kmem_cache_alloc_bulk(struct kmem_cache *cache, vaddr_t *objs, uint n);
+
+/* Returns an object to the cache it was allocated from. */
+void kmem_cache_free(struct kmem_cache *cache, vaddr_t v);
+
+/* Returns n objects in objs to the cache they were allocated from, taking the cache lock once. */
+void kmem_cache_free_bulk(struct kmem_cache *cache, vaddr_t *objs, uint n);
+
+/* Checks whether the address belongs to a slab, rather than to the rest of the kernel heap. */
+bool is_slab_object(vaddr_t v);
+
+/* Gets the cache the given object was allocated from. */
+struct kmem_cache *kmem_cache_of(vaddr_t v);
+
+#endif
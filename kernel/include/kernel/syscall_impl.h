@@ -12,6 +12,10 @@ void init_syscall(void);
 noreturn syscall_exit(int status);
 pid_t syscall_wait(uvaddr_t status);
 pid_t syscall_getpid(void);
+int syscall_sched_set(int policy, int priority);
+int syscall_sched_get(uvaddr_t policy, uvaddr_t priority);
+int syscall_sched_setaffinity(unsigned int mask);
+int syscall_sched_getaffinity(uvaddr_t mask);
 
 int syscall_brk(uvaddr_t ptr);
 uvaddr_t syscall_sbrk(uvaddrdiff_t diff);
@@ -6,6 +6,12 @@
 
 noreturn kalloc_test_main(void);
 
+noreturn kalloc_bench_main(void);
+
+noreturn lock_bench_main(void);
+
+noreturn false_sharing_bench_main(void);
+
 noreturn fat_test_main(struct vfs_super *test);
 
 #endif
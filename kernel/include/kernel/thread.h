@@ -9,14 +9,15 @@
 #include <kernel/queue.h>
 #include <kernel/ticks.h>
 
+#include <user/yaos2/kernel/sched.h>
 #include <user/yaos2/kernel/types.h>
 
 #define TID_INVALID 0
 
 enum thread_state
 {
-	/* Thread is the scheduler thread. */
-	THREAD_SCHEDULER = -1,
+	/* Thread is the idle thread of a CPU. */
+	THREAD_IDLE = -1,
 
 	/* Thread has just been created. */
 	THREAD_NEW = 0,
@@ -36,6 +37,9 @@ enum thread_state
 	/* Thread is sleeping. */
 	THREAD_SLEEPING,
 
+	/* Thread is being moved to the run queue of another CPU. */
+	THREAD_MIGRATING,
+
 	/* Thread has exited. */
 	THREAD_EXITED,
 };
@@ -45,37 +49,55 @@ typedef unsigned int tid_t;
 struct proc; /* Can't include proc.h due to it including thread.h */
 struct arch_thread;
 
+/* Threads start a cache line. The fields the scheduler uses on every switch and wakeup come first,
+   so that they fit in that line. */
 struct thread
 {
+	/* Hot part. Protected by the run queue lock of the CPU the thread is assigned to. */
+
+	int state; /* Current thread state. */
+	int cpu; /* Number of the CPU whose run queue the thread belongs to. */
+	int policy; /* Scheduling policy. (SCHED_RT or SCHED_MLFQ) */
+	int priority; /* Priority within the policy. 0 is the highest. */
+	int level; /* Current queue level. For SCHED_MLFQ this changes with the thread's behaviour. */
+	uint ticks_used; /* Ticks the thread has been running at its current level. */
+	uint boost_epoch; /* Last SCHED_MLFQ boost period the thread has been accounted in. */
+	cpu_mask_t affinity; /* CPUs the thread may run on. */
+	struct arch_thread *arch; /* Arch-dependent structure. Constant. */
+	struct proc *parent; /* Parent process. Constant. */
+	struct thread_cond *cond; /* Condition this thread is waiting on, if state == THREAD_BLOCKED. */
+	uint sched_count;
+	STAILQ_ENTRY(thread) sqptrs;
+	STAILQ_ENTRY(thread) cqptrs; /* Condition or wait() queue pointers. */
+
 	/* Constant part. */
 
 	tid_t tid; /* ID of the thread */
 	char name[32]; /* Name of the thread. */
-	struct proc *parent; /* Parent process */
-	struct arch_thread *arch; /* Arch-dependent structure. */
 
 	void (*entry)(void *); /* Entry point the scheduler will call. */
 	void *cookie; /* The scheduler will pass this cookie to the entry point. */
 
-	/* Dynamic part. Protected by global scheduler lock. */
+	/* Cold part. Protected by the run queue lock. */
 
-	int state; /* Current thread state. */
-	pid_t collected_pid;
-	int collected_status;
 	ticks_t sleep_since; /* Sleep start tick, if state == THREAD_SLEEPING. */
 	ticks_t sleep_until; /* Sleep end tick, if state == THREAD_SLEEPING. */
-	struct thread_cond *cond; /* Condition this thread is waiting on, if state == THREAD_BLOCKED. */
-	uint sched_count;
+	struct thread *sleep_child; /* First child in the sleep heap, if state == THREAD_SLEEPING. */
+	struct thread *sleep_sibling; /* Next sibling in the sleep heap, if state == THREAD_SLEEPING. */
+	pid_t collected_pid;
+	int collected_status;
 
-	LIST_ENTRY(thread) lptrs;
-	STAILQ_ENTRY(thread) sqptrs;
-};
+	LIST_ENTRY(thread) lptrs; /* Process' thread list pointers. Protected by the scheduler lock. */
+} __cacheline_aligned;
 
 LIST_HEAD(thread_list, thread);
+STAILQ_HEAD(thread_queue, thread);
 
 /* thread_cond - a preemtible condition that puts waiting threads into THREAD_BLOCKED state */
 struct thread_cond
 {
+	struct cpu_spinlock lock; /* Protects the waiters queue. */
+	struct thread_queue waiters; /* Threads waiting on the condition, in FIFO order. */
 	atomic_int num_waiting;
 
 #ifdef KERNEL_DEBUG
@@ -94,6 +116,12 @@ struct thread_mutex
 
 	/* Holder of the mutex. */
 	tid_t tid;
+	struct thread *owner;
+
+#ifdef KERNEL_LOCKSTAT
+	struct lockstat_class *lockstat; /* Statistics class, or NULL if not tracked. */
+	uint64_t lockstat_since; /* Timestamp of the acquisition. */
+#endif
 
 #ifdef KERNEL_DEBUG
 	const char *creation_file; /* Source file in which the condition was created. */
@@ -103,6 +131,29 @@ struct thread_mutex
 #endif
 };
 
+/* thread_rwlock - a preemtible reader-writer lock. It is held either by any number of readers or by
+   one writer. Waiting writers are preferred over new readers. The lock is not recursive. */
+struct thread_rwlock
+{
+	struct cpu_spinlock spinlock;
+	struct thread_cond read_cond; /* Readers waiting for writers to finish. */
+	struct thread_cond write_cond; /* Writers waiting for the lock to become free. */
+
+	uint readers; /* Number of threads holding the lock for reading. */
+	uint writers_waiting; /* Number of threads waiting to acquire the lock for writing. */
+	tid_t writer; /* Thread holding the lock for writing. */
+
+#ifdef KERNEL_LOCKSTAT
+	struct lockstat_class *lockstat; /* Statistics class, or NULL if not tracked. */
+	uint64_t lockstat_since; /* Timestamp of the acquisition for writing. */
+#endif
+
+#ifdef KERNEL_DEBUG
+	const char *creation_file; /* Source file in which the lock was created. */
+	unsigned int creation_line; /* Source file line in which the lock was created. */
+#endif
+};
+
 void _thread_mutex_create(struct thread_mutex *mutex, const char *file, unsigned int line);
 #define thread_mutex_create(mutex) _thread_mutex_create(mutex, __FILE__, __LINE__)
 void thread_mutex_acquire(struct thread_mutex *mutex);
@@ -113,6 +164,17 @@ void _thread_cond_create(struct thread_cond *cond, const char *file, unsigned in
 #define thread_cond_create(cond) _thread_cond_create(cond, __FILE__, __LINE__)
 void thread_cond_wait(struct thread_cond *cond, struct thread_mutex *mutex);
 void thread_cond_notify(struct thread_cond *cond);
+void thread_cond_broadcast(struct thread_cond *cond);
+
+void _thread_rwlock_create(struct thread_rwlock *rwlock, const char *file, unsigned int line);
+#define thread_rwlock_create(rwlock) _thread_rwlock_create(rwlock, __FILE__, __LINE__)
+void thread_rwlock_acquire_read(struct thread_rwlock *rwlock);
+void thread_rwlock_release_read(struct thread_rwlock *rwlock);
+void thread_rwlock_acquire_write(struct thread_rwlock *rwlock);
+void thread_rwlock_release_write(struct thread_rwlock *rwlock);
+bool thread_rwlock_write_held(struct thread_rwlock *rwlock);
+/* Checks whether the lock is held by anyone, for reading or writing. */
+bool thread_rwlock_locked(struct thread_rwlock *rwlock);
 
 /* Creates a kernel thread. */
 struct thread *kthread_create(void (*entry)(void *), void *cookie, const char *name);
@@ -132,4 +194,8 @@ noreturn thread_exit(void);
 /* Puts the current thread to sleep for a given number of milliseconds. */
 void thread_sleep(unsigned int milliseconds);
 
+/* Puts the current thread to sleep for a given number of microseconds. Unlike thread_sleep(), the
+   wakeup is not rounded up to scheduler ticks. Delays shorter than a tick are busy-waited. */
+void thread_usleep(unsigned int microseconds);
+
 #endif
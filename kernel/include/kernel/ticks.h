@@ -5,7 +5,8 @@
 #include <kernel/cpu.h>
 #include <kernel/debug.h>
 
-/* TODO: Desperately need a better ticks source... */
+/* Scheduler ticks, emulated on the one-shot timer events of each CPU. See kernel/ktime.h for
+   nanosecond time and timers. */
 
 #define TICKS_PER_SECOND		10000
 #define TICKS_PER_MILLISECOND	10
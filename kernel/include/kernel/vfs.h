@@ -91,6 +91,12 @@ LIST_HEAD(vfs_node_list, vfs_node);
 /* Initializes the virtual filesystem. The super node provided in argument will be available at /.*/
 void vfs_init(void);
 
+/* Allocates an uninitialized node for a filesystem driver. */
+struct vfs_node *vfs_node_alloc(void);
+
+/* Frees a node allocated with vfs_node_alloc(). */
+void vfs_node_free(struct vfs_node *node);
+
 void vfs_mount(const char *path, struct vfs_super *root);
 
 struct vfs_super *vfs_umount(const char *path);
@@ -0,0 +1,65 @@
+/* kernel/workqueue.h - deferred work run by per-CPU worker threads */
+#ifndef _KERNEL_WORKQUEUE_H
+#define _KERNEL_WORKQUEUE_H
+
+#include <kernel/cdefs.h>
+#include <kernel/queue.h>
+#include <kernel/ticks.h>
+
+/*
+ * Each CPU has a worker thread running the work queued on it in FIFO order. Work can be queued
+ * from any context, interrupt handlers included. Queuing only takes the worker's lock, the lock of
+ * its wait condition and the run queue lock of the worker's CPU, which are all only held with
+ * interrupts disabled. Work functions run in a kernel thread and may sleep, but they hold up the
+ * other work of the CPU while doing so.
+ *
+ * A work item is pending from the moment it is queued until its function starts. Queuing a
+ * pending item does nothing, so any number of queue calls before the worker gets to it result in
+ * one run. The function may queue its own item again.
+ */
+
+#define WORK_IDLE -1
+
+struct work
+{
+	void (*func)(struct work *work);
+
+	/* Dynamic part. Protected by the lock of the worker the item is pending on. */
+
+	atomic_int cpu; /* Worker the item is pending on, or WORK_IDLE. Read without the lock. */
+	bool delayed; /* Is the item waiting for its tick, rather than in the run queue? */
+	ticks_t expires; /* Tick at which delayed work is moved to the run queue. */
+	TAILQ_ENTRY(work) ptrs;
+};
+
+/* Starts the worker threads. Call once the CPUs are enumerated. */
+void init_workqueue(void);
+
+/* Initializes a work item that calls func(work). */
+void work_create(struct work *work, void (*func)(struct work *work));
+
+/* Queues the work on the current CPU. Returns false if it was already pending. */
+bool work_queue(struct work *work);
+
+/* Queues the work on the CPU with the given number. Returns false if it was already pending. */
+bool work_queue_on(uint num, struct work *work);
+
+/* Queues the work on the current CPU once the given number of milliseconds has passed. Returns
+   false if it was already pending. */
+bool work_queue_delayed(struct work *work, uint milliseconds);
+
+/* Takes the work off its queue if it is pending. Returns true if it was. Does not wait for the
+   function if it is already running. */
+bool work_cancel(struct work *work);
+
+/* Sleeps until the work is neither pending nor running. Delayed work is waited for, too. */
+void work_flush(struct work *work);
+
+/* Cancels the work and waits for its function to finish if it is running. Returns true if the work
+   was pending. */
+bool work_cancel_sync(struct work *work);
+
+/* Moves delayed work whose tick has come to the run queue. Called from the timer interrupt. */
+void work_timer_tick(void);
+
+#endif
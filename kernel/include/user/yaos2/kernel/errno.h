@@ -9,5 +9,6 @@
 #define ENOMEM			100 /* Ran out of memory. */
 #define EOVERFLOW		101 /* A buffer or value would overflow. */
 #define EPARAM			102 /* An invalid parameter value was provided. */
+#define EPERM			103 /* Operation not permitted. */
 
 #endif
@@ -0,0 +1,17 @@
+/* user/yaos2/kernel/sched.h - scheduling policies (user-space API definitions) */
+#ifndef _USER_YAOS2_KERNEL_SCHED_H
+#define _USER_YAOS2_KERNEL_SCHED_H
+
+/* Fixed-priority real-time policy. Runs before any SCHED_MLFQ thread. Reserved for kernel threads. */
+#define SCHED_RT 0
+
+/* Multilevel feedback queue policy. Threads using up their quantum sink to lower levels, threads
+   that block stay on top. This is the default policy. */
+#define SCHED_MLFQ 1
+
+/* Number of priorities of each policy. Priority 0 is the highest. For SCHED_MLFQ, the priority is
+   the level a thread starts at and gets boosted back to. */
+#define SCHED_RT_PRIORITIES 8
+#define SCHED_MLFQ_PRIORITIES 4
+
+#endif
@@ -18,6 +18,13 @@ enum syscall_num
 	SYSCALL_READ,
 	SYSCALL_WRITE,
 	SYSCALL_LSEEK,
+
+	/* Process calls, like GETPID, but added later. New numbers only ever go at the end, so that
+	   existing binaries keep working. */
+	SYSCALL_SCHED_SET,
+	SYSCALL_SCHED_GET,
+	SYSCALL_SCHED_SETAFFINITY,
+	SYSCALL_SCHED_GETAFFINITY,
 };
 
 #endif
@@ -75,6 +75,26 @@ static void mbr_part_bd_unlock(struct block_dev *dev, uint index)
 	part->parent->unlock(part->parent, index);
 }
 
+static uint mbr_part_bd_lock_read(struct block_dev *dev, uint num)
+{
+	struct mbr_part_data *part = mbr_get_part_data(dev);
+
+	if (dev->valid == false)
+		kpanic("mbr_part_bd_lock_read(): invalid block device");
+
+	return part->parent->lock_read(part->parent, num + part->offset);
+}
+
+static void mbr_part_bd_unlock_read(struct block_dev *dev, uint index)
+{
+	struct mbr_part_data *part = mbr_get_part_data(dev);
+
+	if (dev->valid == false)
+		kpanic("mbr_part_bd_unlock_read(): invalid block device");
+
+	part->parent->unlock_read(part->parent, index);
+}
+
 static void mbr_part_bd_write(struct block_dev *dev, uint index, uint off, const byte *src, uint len)
 {
 	struct mbr_part_data *part = mbr_get_part_data(dev);
@@ -104,6 +124,8 @@ static struct block_dev mbr_part_block_dev_template = {
 
 	.lock = mbr_part_bd_lock,
 	.unlock = mbr_part_bd_unlock,
+	.lock_read = mbr_part_bd_lock_read,
+	.unlock_read = mbr_part_bd_unlock_read,
 	.write = mbr_part_bd_write,
 	.read = mbr_part_bd_read,
 };
@@ -187,9 +209,9 @@ bool mbr_table_scan(struct block_dev *bdev)
 
 	buf = kalloc(HEAP_NORMAL, 1, bdev->block_size);
 
-	idx = bdev->lock(bdev, 0);
+	idx = bdev->lock_read(bdev, 0);
 	bdev->read(bdev, idx, 0, buf, bdev->block_size);
-	bdev->unlock(bdev, idx);
+	bdev->unlock_read(bdev, idx);
 
 	mbr = (struct master_boot_record *) buf;
 
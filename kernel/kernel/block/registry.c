@@ -3,11 +3,14 @@
 #include <kernel/cdefs.h>
 #include <kernel/cpu.h>
 #include <kernel/debug.h>
+#include <kernel/rcu.h>
 #include <kernel/utils.h>
 #include <kernel/block/partitions.h>
 
 /* TODO: Use a linked list. */
 
+/* The device array is read under RCU. Adding a device takes the spinlock. Devices are never
+   removed. */
 static atomic_bool bdev_initialized = false;
 static struct cpu_spinlock bdev_spinlock;
 #define MAX_BLOCK_DEVICES 8
@@ -44,7 +47,7 @@ void bdev_add(struct block_dev *dev)
 	{
 		if (block_devices[i] == NULL)
 		{
-			block_devices[i] = dev;
+			rcu_assign_pointer(block_devices[i], dev);
 			break;
 		}
 	}
@@ -60,7 +63,7 @@ void bdev_add(struct block_dev *dev)
 /* Get a block device by name. */
 struct block_dev *bdev_get(const char *name)
 {
-	struct block_dev *dev = NULL;
+	struct block_dev *dev = NULL, *candidate;
 	int len, len_dev;
 
 	if (!atomic_load(&bdev_initialized))
@@ -71,26 +74,28 @@ struct block_dev *bdev_get(const char *name)
 	if (len >= BDEV_MAX_NAME_LENGTH)
 		kpanic("bdev_get(): name too long");
 
-	cpu_spinlock_acquire(&bdev_spinlock);
+	rcu_read_lock();
 
 	for (int i = 0; i < MAX_BLOCK_DEVICES; i++)
 	{
-		if (block_devices[i] == NULL)
+		candidate = rcu_dereference(block_devices[i]);
+
+		if (candidate == NULL)
 			continue;
 
-		len_dev = kstrlen(block_devices[i]->name);
+		len_dev = kstrlen(candidate->name);
 
 		if (len != len_dev)
 			continue;
 
-		if (kstrncmp(block_devices[i]->name, name, len))
+		if (kstrncmp(candidate->name, name, len))
 		{
-			dev = block_devices[i];
+			dev = candidate;
 			break;
 		}
 	}
 
-	cpu_spinlock_release(&bdev_spinlock);
+	rcu_read_unlock();
 
 	return dev;
 }
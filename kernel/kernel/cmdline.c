@@ -0,0 +1,68 @@
+/* kernel/cmdline.c - kernel command line options */
+#include <kernel/cdefs.h>
+#include <kernel/debug.h>
+#include <kernel/init.h>
+#include <kernel/utils.h>
+
+/* Longer command lines are cut. */
+#define CMDLINE_MAX 256
+
+static char cmdline[CMDLINE_MAX];
+
+/* Saves the kernel command line given by the boot loader. Call before the memory it is in is
+   reused. */
+void init_cmdline(const char *from)
+{
+	size_t len = kmin(kstrlen(from), (size_t)(CMDLINE_MAX - 1));
+
+	kstrncpy(cmdline, from, len);
+	cmdline[len] = '\0';
+
+	kdprintf("Command line: %s\n", cmdline);
+}
+
+/* Finds the value of a "name=value" option. Returns NULL if the option is not given. */
+static const char *find_option(const char *name)
+{
+	size_t len = kstrlen(name);
+	const char *p = cmdline;
+
+	while (*p != '\0')
+	{
+		while (*p == ' ')
+			p++;
+
+		if (kstrncmp(p, name, len) && p[len] == '=')
+			return p + len + 1;
+
+		while (*p != '\0' && *p != ' ')
+			p++;
+	}
+
+	return NULL;
+}
+
+/* Gets an option with an unsigned decimal value from the kernel command line. Returns false if the
+   option is not given or its value is not a number. */
+bool cmdline_get_uint(const char *name, uint *value)
+{
+	const char *p = find_option(name);
+	uint result = 0;
+
+	if (p == NULL || *p < '0' || *p > '9')
+		return false;
+
+	for (; *p >= '0' && *p <= '9'; p++)
+	{
+		if (result > (UINT_MAX - (uint)(*p - '0')) / 10)
+			return false;
+
+		result = result * 10 + (uint)(*p - '0');
+	}
+
+	if (*p != '\0' && *p != ' ')
+		return false;
+
+	*value = result;
+	return true;
+}
@@ -79,7 +79,7 @@ byte ata_pio_poll(struct ide_channel *cp, bool read_status)
 	kassert(thread_mutex_held(&(cp->mutex)));
 
 	/* Wait a little bit for BSY to be set. */
-	ticks_mwait(1);
+	thread_usleep(ATA_DELAY_US);
 
 	/* Wait a for BSY to be cleared. */
 	ata_pio_wait_for_status(cp, ATA_SR_BSY, 0);
@@ -133,10 +133,10 @@ byte ata_pio_read(struct ide_drive *dp, uint64_t lba, uint16_t sectors, void *bu
 	if (lba >= (1 << 28) || lba + sectors >= (1 << 28) || sectors >= (1 << 8))
 	{
 		ata_pio_register_write(cp, ATA_REG_HDDEVSEL, selection);
-		ticks_mwait(1);
+		thread_usleep(ATA_DELAY_US);
 
 		ata_pio_register_write(cp, ATA_REG_CONTROL, ATA_BIT_HOB | ATA_BIT_NIEN | ATA_BIT_CTL_OBS);
-		ticks_mwait(1);
+		thread_usleep(ATA_DELAY_US);
 		ata_pio_wait_for_status(cp, ATA_SR_BSY, 0);
 
 		/* We will need LBA48 support to access above 128 GiB. */
@@ -153,7 +153,7 @@ byte ata_pio_read(struct ide_drive *dp, uint64_t lba, uint16_t sectors, void *bu
 	else
 	{
 		ata_pio_register_write(cp, ATA_REG_HDDEVSEL, selection | ((uint8_t)(lba >> 24) & 0x0f));
-		ticks_mwait(1);
+		thread_usleep(ATA_DELAY_US);
 
 		ata_pio_register_write(cp, ATA_REG_CONTROL, ATA_BIT_NIEN | ATA_BIT_CTL_OBS);
 		ata_pio_wait_for_status(cp, ATA_SR_BSY, 0);
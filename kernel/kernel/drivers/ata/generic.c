@@ -6,7 +6,6 @@
 #include <kernel/heap.h>
 #include <kernel/scheduler.h>
 #include <kernel/thread.h>
-#include <kernel/ticks.h>
 #include <kernel/utils.h>
 #include <kernel/devices/ata.h>
 #include <kernel/devices/pci.h>
@@ -44,6 +43,8 @@ static struct pci_driver gen_ata_pci_driver = {
 
 static uint gen_ata_bd_lock(struct block_dev *dev, uint num);
 static void gen_ata_bd_unlock(struct block_dev *dev, uint index);
+static uint gen_ata_bd_lock_read(struct block_dev *dev, uint num);
+static void gen_ata_bd_unlock_read(struct block_dev *dev, uint index);
 static void gen_ata_bd_write(struct block_dev *dev, uint index, uint off, const byte *src, uint len);
 static void gen_ata_bd_read(struct block_dev *dev, uint index, uint off, byte *dest, uint len);
 
@@ -57,6 +58,8 @@ static void gen_ata_bd_read(struct block_dev *dev, uint index, uint off, byte *d
 									\
 	.lock = gen_ata_bd_lock,		\
 	.unlock = gen_ata_bd_unlock,	\
+	.lock_read = gen_ata_bd_lock_read,		\
+	.unlock_read = gen_ata_bd_unlock_read,	\
 	.write = gen_ata_bd_write,		\
 	.read = gen_ata_bd_read,		\
 }
@@ -115,7 +118,7 @@ static void gen_ata_init_drive(uint drive_index, byte channel, byte drive)
 
 	/* Select the drive. */
 	ata_pio_register_write(cp, ATA_REG_HDDEVSEL, ATA_SEL_BIT_DEV | (drive << 4));
-	ticks_mwait(1);
+	thread_usleep(ATA_DELAY_US);
 
 	/* Disable interrupts for this drive. */
 	ata_pio_register_write(cp, ATA_REG_CONTROL, ATA_BIT_NIEN | ATA_BIT_CTL_OBS);
@@ -124,7 +127,7 @@ static void gen_ata_init_drive(uint drive_index, byte channel, byte drive)
 	/* Send an ATA IDENTIFY command. */
 	ata_pio_wait_for_status(cp, ATA_SR_BSY, 0);
 	ata_pio_register_write(cp, ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
-	ticks_mwait(1);
+	thread_usleep(ATA_DELAY_US);
 
 	/* If ALT STATUS is zero it means there's no drive. */
 	if (ata_pio_register_read(cp, ATA_REG_ALTSTATUS) == 0)
@@ -165,7 +168,7 @@ static void gen_ata_init_drive(uint drive_index, byte channel, byte drive)
 		/* Try to send an ATAPI IDENITFY command. */
 		ata_pio_wait_for_status(cp, ATA_SR_BSY, 0);
 		ata_pio_register_write(cp, ATA_REG_COMMAND, ATA_CMD_IDENTIFY_PACKET);
-		ticks_mwait(1);
+		thread_usleep(ATA_DELAY_US);
 	}
 
 	dp->present = true;
@@ -261,8 +264,6 @@ static void gen_ata_write_block(struct ide_drive *dp, uint lba, const byte *src)
 
 /* block_dev */
 
-/* TODO: Would be nice to have an RW lock. That would make reads much quicker. */
-
 #define B_VALID 0x01
 #define B_DIRTY 0x02
 
@@ -275,7 +276,7 @@ struct block
 	uint hit; /* Hit counter. */
 
 	/* Own block data. */
-	struct thread_mutex mutex;
+	struct thread_rwlock lock; /* Held for reading by readers, for writing by writers. */
 	bool is_valid; /* Is block valid? */
 	byte data[IDE_SECTOR_SIZE]; /* Block data. */
 };
@@ -290,7 +291,9 @@ struct block_cache
 
 static struct block_cache cache;
 
-static uint gen_ata_bd_lock(struct block_dev *dev, uint num)
+/* Finds the block in the cache or assigns a free cache entry to it. Returns the index of the
+   block, which stays in the cache until the reference is dropped with gen_ata_bd_put(). */
+static uint gen_ata_bd_get(struct block_dev *dev, uint num)
 {
 	uint i;
 	struct block *b;
@@ -298,10 +301,10 @@ static uint gen_ata_bd_lock(struct block_dev *dev, uint num)
 	uint min_hits, min_hits_index;
 
 	if (dev->valid == false)
-		kpanic("gen_ata_bd_lock(): invalid block device");
+		kpanic("gen_ata_bd_get(): invalid block device");
 
 	if (dp->present == false)
-		kpanic("gen_ata_bd_lock(): drive not present");
+		kpanic("gen_ata_bd_get(): drive not present");
 
 	cpu_spinlock_acquire(&(cache.lock));
 
@@ -315,8 +318,6 @@ static uint gen_ata_bd_lock(struct block_dev *dev, uint num)
 			b->ref++;
 			b->hit++;
 			cpu_spinlock_release(&(cache.lock));
-			/* Wait for block to become available. */
-			thread_mutex_acquire(&(b->mutex));
 			return i;
 		}
 	}
@@ -345,7 +346,7 @@ static uint gen_ata_bd_lock(struct block_dev *dev, uint num)
 
 		if (b->ref == 0)
 		{
-			thread_mutex_create(&(b->mutex));
+			thread_rwlock_create(&(b->lock));
 			kmemset(b->data, 0, IDE_SECTOR_SIZE);
 			b->drive = dp->num;
 			b->num = num;
@@ -353,34 +354,88 @@ static uint gen_ata_bd_lock(struct block_dev *dev, uint num)
 			b->hit = 1;
 			b->is_valid = false;
 			cpu_spinlock_release(&(cache.lock));
-			/* Wait for block to become available. */
-			thread_mutex_acquire(&(b->mutex));
 			return min_hits_index;
 		}
 	}
 
-	kpanic("gen_ata_bd_lock(): cache is full");
+	kpanic("gen_ata_bd_get(): cache is full");
 }
 
-static void gen_ata_bd_unlock(struct block_dev *dev, uint index)
+/* Drops the reference taken by gen_ata_bd_get(). */
+static void gen_ata_bd_put(struct block_dev *dev, uint index)
 {
 	struct block *b = cache.blocks + index;
 	struct ide_drive *dp = (struct ide_drive*)dev->opaque;
 
+	if (b->drive != dp->num)
+		kpanic("gen_ata_bd_put(): drives do not match");
+
+	cpu_spinlock_acquire(&(cache.lock));
+	b->ref--;
+	cpu_spinlock_release(&(cache.lock));
+}
+
+static uint gen_ata_bd_lock(struct block_dev *dev, uint num)
+{
+	uint index = gen_ata_bd_get(dev, num);
+
+	/* Wait for block to become available. */
+	thread_rwlock_acquire_write(&(cache.blocks[index].lock));
+
+	return index;
+}
+
+static void gen_ata_bd_unlock(struct block_dev *dev, uint index)
+{
+	struct block *b = cache.blocks + index;
+
 	if (dev->valid == false)
 		kpanic("gen_ata_bd_unlock(): invalid block device");
 
-	if (!thread_mutex_held(&(b->mutex)))
-		kpanic("gen_ata_bd_unlock(): block mutex not held");
+	if (!thread_rwlock_write_held(&(b->lock)))
+		kpanic("gen_ata_bd_unlock(): block lock not held");
 
-	if (b->drive != dp->num)
-		kpanic("gen_ata_bd_unlock(): drives do not match");
+	thread_rwlock_release_write(&(b->lock));
+	gen_ata_bd_put(dev, index);
+}
 
-	thread_mutex_release(&(b->mutex));
+static uint gen_ata_bd_lock_read(struct block_dev *dev, uint num)
+{
+	uint index = gen_ata_bd_get(dev, num);
+	struct block *b = cache.blocks + index;
+	struct ide_drive *dp = (struct ide_drive*)dev->opaque;
 
-	cpu_spinlock_acquire(&(cache.lock));
-	b->ref--;
-	cpu_spinlock_release(&(cache.lock));
+	thread_rwlock_acquire_read(&(b->lock));
+
+	if (b->is_valid)
+		return index;
+
+	/* Readers must not fill the block at the same time. Fill it under the write lock first. We
+	   hold a reference, so the block stays valid once it has been read. */
+	thread_rwlock_release_read(&(b->lock));
+	thread_rwlock_acquire_write(&(b->lock));
+
+	if (b->is_valid == false)
+	{
+		gen_ata_read_block(dp, b->num, b->data);
+		b->is_valid = true;
+	}
+
+	thread_rwlock_release_write(&(b->lock));
+	thread_rwlock_acquire_read(&(b->lock));
+
+	return index;
+}
+
+static void gen_ata_bd_unlock_read(struct block_dev *dev, uint index)
+{
+	struct block *b = cache.blocks + index;
+
+	if (dev->valid == false)
+		kpanic("gen_ata_bd_unlock_read(): invalid block device");
+
+	thread_rwlock_release_read(&(b->lock));
+	gen_ata_bd_put(dev, index);
 }
 
 static void gen_ata_bd_write(struct block_dev *dev, uint index, uint off, const byte *src, uint len)
@@ -391,8 +446,8 @@ static void gen_ata_bd_write(struct block_dev *dev, uint index, uint off, const
 	if (dev->valid == false)
 		kpanic("gen_ata_bd_write(): invalid block device");
 
-	if (!thread_mutex_held(&(b->mutex)))
-		kpanic("gen_ata_bd_write(): block mutex not held");
+	if (!thread_rwlock_write_held(&(b->lock)))
+		kpanic("gen_ata_bd_write(): block lock not held");
 
 	if (b->drive != dp->num)
 		kpanic("gen_ata_bd_write(): drives do not match");
@@ -422,8 +477,8 @@ static void gen_ata_bd_read(struct block_dev *dev, uint index, uint off, byte *d
 	if (dev->valid == false)
 		kpanic("gen_ata_bd_read(): invalid block device");
 
-	if (!thread_mutex_held(&(b->mutex)))
-		kpanic("gen_ata_bd_read(): block mutex not held");
+	if (!thread_rwlock_locked(&(b->lock)))
+		kpanic("gen_ata_bd_read(): block lock not held");
 
 	if (b->drive != dp->num)
 		kpanic("gen_ata_bd_read(): drives do not match");
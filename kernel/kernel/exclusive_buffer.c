@@ -152,12 +152,22 @@ _eb_try_read_done:
 
 static void unsafe_growing_write(struct exclusive_buffer *buffer, const uint8_t *src, size_t size)
 {
-	size_t new_size;
+	size_t contents, new_size;
 
 	unsafe_move_head(buffer);
 
-	new_size = unsafe_get_contents_length(buffer) + size;
-	buffer->buffer = krealloc(buffer->buffer, HEAP_NORMAL, buffer->alignment, new_size);
+	contents = unsafe_get_contents_length(buffer);
+
+	/* Grow geometrically, so that a stream of small writes does not resize the buffer each time. */
+	if (contents + size > buffer->buffer_size)
+	{
+		new_size = kmax(contents + size, buffer->buffer_size * 2);
+		buffer->buffer = krealloc(buffer->buffer, HEAP_NORMAL, buffer->alignment, new_size);
+		buffer->buffer_size = new_size;
+		buffer->head = buffer->buffer;
+		buffer->tail = buffer->buffer + contents;
+	}
+
 	kmemcpy(buffer->tail, src, size);
 	buffer->tail += size;
 }
@@ -175,6 +185,7 @@ size_t eb_write(struct exclusive_buffer *buffer, const uint8_t *src, size_t size
 	if (buffer->flags & EBF_GROWING)
 	{
 		unsafe_growing_write(buffer, src, size);
+		num_written = size;
 		goto _eb_write_done;
 	}
 
@@ -223,7 +234,7 @@ size_t eb_try_write(struct exclusive_buffer *buffer, const uint8_t *src, size_t
 	if (buffer->flags & EBF_GROWING)
 	{
 		unsafe_growing_write(buffer, src, size);
-		num_written = size; /* TODO: This is probably not safe to assume... */
+		num_written = size;
 		goto _eb_try_write_done;
 	}
 
@@ -45,7 +45,7 @@ void exec_user_elf_program(const char *path, const char *stdin, const char *stdo
 	uvaddr_t vbreak = UVNULL, v, vto;
 	uvaddr_t stack;
 	size_t stack_size;
-	size_t env_num, formatted_env_size;
+	size_t env_num, formatted_env_size, env_size;
 	uvaddr_t env_table, env_strings, env_loc;
 	size_t env_strings_offset, len;
 	struct thread *thread;
@@ -86,11 +86,8 @@ void exec_user_elf_program(const char *path, const char *stdin, const char *stdo
 		v = (uvaddr_t)mask_to_page(program_32.mem_offset);
 		vto = (uvaddr_t)mask_to_page(program_32.mem_offset + program_32.mem_size);
 
-		while (v <= vto)
-		{
-			proc_vmreserve(proc, v, VM_USER | VM_WRITE | VM_EXEC);
-			v += PAGE_SIZE;
-		}
+		proc_vmreserve_range(proc, v, (size_t)(vto - v) + PAGE_SIZE,
+			VM_USER | VM_WRITE | VM_EXEC);
 
 		/* Move the program break address. */
 		if (vto > vbreak)
@@ -138,11 +135,9 @@ void exec_user_elf_program(const char *path, const char *stdin, const char *stdo
 	env_strings = env_table + (env_num * sizeof(char *));
 
 	/* Reserve pages needed to contain the formatted environment table. */
-	for (i = 0; i < (formatted_env_size / PAGE_SIZE) + 1; i++)
-	{
-		proc_vmreserve(proc, vbreak, VM_USER);
-		vbreak += PAGE_SIZE;
-	}
+	env_size = ((formatted_env_size / PAGE_SIZE) + 1) * PAGE_SIZE;
+	proc_vmreserve_range(proc, vbreak, env_size, VM_USER);
+	vbreak += env_size;
 
 	/* Write the formatted table. */
 	env_strings_offset = 0;
@@ -60,16 +60,17 @@ devfs_handle_t devfs_register_node(struct devfs_node *node, uint vfs_flags)
 	/* Create the vfs_node data. */
 	vfs_node_data = kualloc(HEAP_NORMAL, sizeof(struct devfs_vfs_node_data));
 	thread_mutex_create(&(vfs_node_data->mutex));
-	vfs_node_data->ref = 0;
+	atomic_init(&(vfs_node_data->ref), 0);
 	vfs_node_data->node = node;
 
 	/* Create the vfs_node itself. */
-	vfs_node = kualloc(HEAP_NORMAL, sizeof(struct vfs_node));
+	vfs_node = vfs_node_alloc();
 	vfs_node->type = VFS_NODE_DEVICE;
 	vfs_node->flags = vfs_flags;
 	vfs_node->index = devfs_inode_seq++;
 	vfs_node->parent = &devfs;
 	vfs_node->opaque = vfs_node_data;
+	vfs_node_data->vfs_node = vfs_node;
 
 	vfs_node->lock = devfs_node_lock;
 	vfs_node->unlock = devfs_node_unlock;
@@ -85,37 +86,47 @@ devfs_handle_t devfs_register_node(struct devfs_node *node, uint vfs_flags)
 
 	handle = vfs_node->index;
 
-	LIST_INSERT_HEAD(&devfs_nodes, vfs_node, lptrs);
+	RCU_LIST_INSERT_HEAD(&devfs_nodes, vfs_node, lptrs);
 
 	thread_mutex_release(&devfs_mutex);
 
 	return handle;
 }
 
+static void devfs_free_node(struct rcu_head *head)
+{
+	struct devfs_vfs_node_data *node_data = (struct devfs_vfs_node_data *)head;
+
+	vfs_node_free(node_data->vfs_node);
+	kfree(node_data);
+}
+
 /* Unregisters a devfs node. */
 void devfs_unregister_node(devfs_handle_t handle)
 {
 	struct vfs_node *node;
 	struct devfs_vfs_node_data *node_data;
+	uint ref = 0;
 
 	thread_mutex_acquire(&devfs_mutex);
 
 	/* Find the node and panic if it isn't found. TODO: Don't panic! */
-	node = devfs_get_by_index(&devfs, handle);
+	LIST_FOREACH(node, &devfs_nodes, lptrs)
+		if (node->index == handle)
+			break;
 
 	if (!node)
 		kpanic("devfs_unregister_node(): node not found");
 
-	/* Check if node has references. */
+	/* Check if node has references. Lookups cannot take new ones once the node is dead. */
 	node_data = devfs_get_node_data(node);
 
-	if (node_data->ref > 0)
+	if (!atomic_compare_exchange_strong(&(node_data->ref), &ref, DEVFS_REF_DEAD))
 		kpanic("devfs_unregister_node(): node busy");
 
-	/* Just free everything. */
-	kfree(node_data);
-	LIST_REMOVE(node, lptrs);
-	kfree(node);
+	/* Lookups may still be looking at the node, so free it after a grace period. */
+	RCU_LIST_REMOVE(node, lptrs);
+	call_rcu(&(node_data->rcu), devfs_free_node);
 
 	devfs_num_leaves--;
 
@@ -2,6 +2,7 @@
 #define _KERNEL_FS_DEVFS_INTERNAL_H
 
 #include <kernel/cdefs.h>
+#include <kernel/rcu.h>
 #include <kernel/thread.h>
 #include <kernel/vfs.h>
 #include <kernel/fs/devfs.h>
@@ -28,11 +29,20 @@ uint devfs_root_get_num_leaves(struct vfs_node *node);
 inode_t devfs_root_get_leaf(struct vfs_node *node, uint n);
 struct vfs_node *devfs_root_get_leaf_node(struct vfs_node *node, uint n);
 
+/* Reference count of an unregistered node. Lookups under RCU may still find the node, but cannot
+   take a reference to it anymore. */
+#define DEVFS_REF_DEAD UINT_MAX
+
 struct devfs_vfs_node_data
 {
-	/* Super part. To modify, super lock has to be held.*/
+	/* Freeing is deferred until lookups under RCU are done with the node. Has to be the first
+	   member. */
+	struct rcu_head rcu;
+	struct vfs_node *vfs_node;
+
+	/* Super part. The node list is modified with the super lock held and read under RCU. */
 
-	uint ref;
+	atomic_uint ref;
 
 	/* Dynamic part. (protected by node mutex) */
 
@@ -42,6 +52,20 @@ struct devfs_vfs_node_data
 
 #define devfs_get_node_data(node) ((struct devfs_vfs_node_data *)(node)->opaque)
 
+/* Takes a reference to the node, unless it has been unregistered. */
+static inline bool devfs_node_tryget(struct devfs_vfs_node_data *node_data)
+{
+	uint ref = atomic_load(&(node_data->ref));
+
+	do
+	{
+		if (ref == DEVFS_REF_DEAD)
+			return false;
+	} while (!atomic_compare_exchange_weak(&(node_data->ref), &ref, ref + 1));
+
+	return true;
+}
+
 void devfs_node_lock(struct vfs_node *node);
 void devfs_node_unlock(struct vfs_node *node);
 const char *devfs_node_get_name(struct vfs_node *node);
@@ -1,6 +1,7 @@
 
 #include <kernel/cdefs.h>
 #include <kernel/debug.h>
+#include <kernel/rcu.h>
 #include <kernel/utils.h>
 #include <kernel/vfs.h>
 
@@ -16,21 +17,17 @@ struct vfs_node *devfs_get_root(__unused struct vfs_super *super)
 struct vfs_node *devfs_get_by_index(__unused struct vfs_super *super, inode_t index)
 {
 	struct vfs_node *node;
-	struct devfs_vfs_node_data *node_data;
 
-	thread_mutex_acquire(&devfs_mutex);
+	rcu_read_lock();
 
-	LIST_FOREACH(node, &devfs_nodes, lptrs)
+	RCU_LIST_FOREACH(node, &devfs_nodes, lptrs)
 		if (node->index == index)
 			break;
 
-	if (node)
-	{
-		node_data = devfs_get_node_data(node);
-		node_data->ref++;
-	}
+	if (node && !devfs_node_tryget(devfs_get_node_data(node)))
+		node = NULL;
 
-	thread_mutex_release(&devfs_mutex);
+	rcu_read_unlock();
 
 	return node;
 }
@@ -49,9 +46,9 @@ struct vfs_node *devfs_get_by_path(__unused struct vfs_super *super, const char
 
 	name = path + 1;
 
-	thread_mutex_acquire(&devfs_mutex);
+	rcu_read_lock();
 
-	LIST_FOREACH(node, &devfs_nodes, lptrs)
+	RCU_LIST_FOREACH(node, &devfs_nodes, lptrs)
 	{
 		node_data = devfs_get_node_data(node);
 
@@ -59,25 +56,17 @@ struct vfs_node *devfs_get_by_path(__unused struct vfs_super *super, const char
 			break;
 	}
 
-	if (node)
-	{
-		node_data = devfs_get_node_data(node);
-		node_data->ref++;
-	}
+	if (node && !devfs_node_tryget(devfs_get_node_data(node)))
+		node = NULL;
 
-	thread_mutex_release(&devfs_mutex);
+	rcu_read_unlock();
 
 	return node;
 }
 
 void devfs_put(__unused struct vfs_super *super, struct vfs_node *node)
 {
-	struct devfs_vfs_node_data *node_data;
-
-	thread_mutex_acquire(&devfs_mutex);
-	node_data = devfs_get_node_data(node);
-	node_data->ref--;
-	thread_mutex_release(&devfs_mutex);
+	atomic_fetch_sub(&(devfs_get_node_data(node)->ref), 1);
 }
 
 /* root vfs_node interface */
@@ -157,7 +146,7 @@ struct vfs_node *devfs_root_get_leaf_node(struct vfs_node *node, uint n)
 	if (leaf_node)
 	{
 		leaf_node_data = devfs_get_node_data(leaf_node);
-		leaf_node_data->ref++;
+		atomic_fetch_add(&(leaf_node_data->ref), 1);
 	}
 
 	thread_mutex_release(&devfs_mutex);
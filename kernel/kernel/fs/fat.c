@@ -34,9 +34,9 @@ struct vfs_super *fat_create_super(struct block_dev *bdev)
 	bs = kalloc(HEAP_NORMAL, 1, sizeof(struct fat_bootsec));
 
 	/* Read the volume's boot sector. */
-	block_index = bdev->lock(bdev, 0);
+	block_index = bdev->lock_read(bdev, 0);
 	bdev->read(bdev, block_index, 0, (byte*)bs, sizeof(struct fat_bootsec));
-	bdev->unlock(bdev, block_index);
+	bdev->unlock_read(bdev, block_index);
 
 	/* Check the FAT type label. */
 	if (!fat_check_label(&(bs->ext16)) && !fat_check_label(&(bs->ext32)))
@@ -101,6 +101,9 @@ struct vfs_super *fat_create_super(struct block_dev *bdev)
 	super->bdev = bdev;
 	super->opaque = data;
 
+	kmem_cache_create(&(data->node_cache), "fat node", sizeof(struct fat_vfs_node_data),
+		sizeof(void *));
+
 	/* Fill out interface. */
 	super->get_root = fat_vfs_get_root;
 	super->get_by_index = fat_vfs_get_by_index;
@@ -142,7 +145,7 @@ struct vfs_super *fat_create_super(struct block_dev *bdev)
 	data->root_entry.cluster_low = bs->ext32.root_cluster & 0xffff;
 
 	/* Create the node cache. */
-	thread_mutex_create(&(data->mutex));
+	thread_rwlock_create(&(data->lock));
 	data->nof_nodes = 0;
 	LIST_INIT(&(data->node_list));
 
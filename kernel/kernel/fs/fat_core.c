@@ -42,9 +42,9 @@ int fat_read_fat(struct vfs_super *super, uint32_t *next_cluster, uint32_t clust
 	fat_sector = fat_data->first_fat_sector + (fat_offset / fat_data->bs.bytes_per_sector);
 	ent_offset = fat_offset % fat_data->bs.bytes_per_sector;
 
-	block_index = super->bdev->lock(super->bdev, fat_sector);
+	block_index = super->bdev->lock_read(super->bdev, fat_sector);
 	super->bdev->read(super->bdev, block_index, ent_offset, (byte*)&fat_entry, sizeof(fat_entry));
-	super->bdev->unlock(super->bdev, block_index);
+	super->bdev->unlock_read(super->bdev, block_index);
 
 	switch (fat_data->type)
 	{
@@ -212,9 +212,9 @@ int fat_read(struct vfs_super *super, uint32_t first_cluster, void *buf, uint of
 				bl_portion = fat_data->bs.bytes_per_sector - initial_offset;
 
 			/* Perform the read. */
-			block_index = super->bdev->lock(super->bdev, cl_first_sector + bl_i);
+			block_index = super->bdev->lock_read(super->bdev, cl_first_sector + bl_i);
 			super->bdev->read(super->bdev, block_index, initial_offset, buf + num_read, bl_portion);
-			super->bdev->unlock(super->bdev, block_index);
+			super->bdev->unlock_read(super->bdev, block_index);
 
 			/* Update num_read. */
 			num_read += bl_portion;
@@ -3,6 +3,7 @@
 #include <kernel/debug.h>
 #include <kernel/heap.h>
 #include <kernel/queue.h>
+#include <kernel/slab.h>
 #include <kernel/thread.h>
 #include <kernel/utils.h>
 #include <kernel/vfs.h>
@@ -30,9 +31,9 @@ static bool unsafe_truncate(struct vfs_super *super)
 	{
 		node_data = fat_get_node_data(node);
 
-		if (node_data->ref == 0 && node_data->hit < lowest_hit)
+		if (atomic_load(&(node_data->ref)) == 0 && atomic_load(&(node_data->hit)) < lowest_hit)
 		{
-			lowest_hit = node_data->hit;
+			lowest_hit = atomic_load(&(node_data->hit));
 			lowest_node = node;
 		}
 	}
@@ -42,8 +43,8 @@ static bool unsafe_truncate(struct vfs_super *super)
 	{
 		LIST_REMOVE(lowest_node, lptrs);
 		fat_data->nof_nodes--;
-		kfree(lowest_node->opaque);
-		kfree(lowest_node);
+		kmem_cache_free(&(fat_data->node_cache), lowest_node->opaque);
+		vfs_node_free(lowest_node);
 		return true;
 	}
 
@@ -76,8 +77,8 @@ static struct vfs_node *unsafe_create(struct vfs_super *super, struct fat_result
 	struct vfs_node *node;
 	struct fat_vfs_node_data *node_data;
 
-	node = kalloc(HEAP_NORMAL, 1, sizeof(struct vfs_node));
-	node_data = kalloc(HEAP_NORMAL, 1, sizeof(struct fat_vfs_node_data));
+	node = vfs_node_alloc();
+	node_data = kmem_cache_alloc(&(fat_get_super_data(super)->node_cache));
 
 	kmemset(node, 0, sizeof(struct vfs_node));
 	kmemset(node_data, 0, sizeof(struct fat_vfs_node_data));
@@ -96,8 +97,8 @@ static struct vfs_node *unsafe_create(struct vfs_super *super, struct fat_result
 	/* Super part. */
 	node_data->dir_cluster = result->dir_cluster;
 	node_data->first_cluster = fat_get_entry_cluster(&(result->entry));
-	node_data->ref = 0;
-	node_data->hit = 0;
+	atomic_init(&(node_data->ref), 0);
+	atomic_init(&(node_data->hit), 0);
 
 	/* Dynamic part. */
 	thread_mutex_create(&(node_data->mutex));
@@ -125,11 +126,30 @@ static struct vfs_node *safe_get_with_fat_result(struct vfs_super *super, struct
 	struct fat_vfs_super_data *fat_data;
 	struct vfs_node *node;
 	struct fat_vfs_node_data *node_data;
+	uint32_t cluster;
 
 	fat_data = fat_get_super_data(super);
 
-	thread_mutex_acquire(&(fat_data->mutex));
-	node = unsafe_fat_get(super, fat_get_entry_cluster(&(result->entry)));
+	cluster = fat_get_entry_cluster(&(result->entry));
+
+	/* Most lookups hit a cached node, so look for it with the lock held for reading first. */
+	thread_rwlock_acquire_read(&(fat_data->lock));
+	node = unsafe_fat_get(super, cluster);
+
+	if (node != NULL)
+	{
+		node_data = fat_get_node_data(node);
+		atomic_fetch_add(&(node_data->ref), 1);
+		atomic_fetch_add(&(node_data->hit), 1);
+		thread_rwlock_release_read(&(fat_data->lock));
+		return node;
+	}
+
+	thread_rwlock_release_read(&(fat_data->lock));
+
+	/* Someone may have created the node before we got the lock for writing, so look again. */
+	thread_rwlock_acquire_write(&(fat_data->lock));
+	node = unsafe_fat_get(super, cluster);
 
 	if (node == NULL)
 	{
@@ -140,9 +160,9 @@ static struct vfs_node *safe_get_with_fat_result(struct vfs_super *super, struct
 	}
 
 	node_data = fat_get_node_data(node);
-	node_data->ref++;
-	node_data->hit++;
-	thread_mutex_release(&(fat_data->mutex));
+	atomic_fetch_add(&(node_data->ref), 1);
+	atomic_fetch_add(&(node_data->hit), 1);
+	thread_rwlock_release_write(&(fat_data->lock));
 
 	return node;
 }
@@ -191,13 +211,13 @@ void fat_vfs_put(struct vfs_super *super, struct vfs_node *node)
 	fat_data = fat_get_super_data(super);
 	node_data = fat_get_node_data(node);
 
-	thread_mutex_acquire(&(fat_data->mutex));
-	node_data->ref--;
+	thread_rwlock_acquire_write(&(fat_data->lock));
+	atomic_fetch_sub(&(node_data->ref), 1);
 
 	/* Possibly truncate a node. */
 	unsafe_truncate(super);
 
-	thread_mutex_release(&(fat_data->mutex));
+	thread_rwlock_release_write(&(fat_data->lock));
 }
 
 /* vfs_node interface */
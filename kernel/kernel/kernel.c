@@ -2,6 +2,7 @@
 #include <kernel/block.h>
 #include <kernel/cdefs.h>
 #include <kernel/debug.h>
+#include <kernel/lockstat.h>
 #include <kernel/test.h>
 #include <kernel/thread.h>
 #include <kernel/vfs.h>
@@ -38,6 +39,11 @@ noreturn kernel_main(void)
 	install_com1_cdev();
 	install_com2_cdev();
 
+#ifdef KERNEL_LOCKSTAT
+	/* Publish lock statistics as /dev/lockstat. */
+	init_lockstat();
+#endif
+
 	/* Mount the root filesystem. */
 	struct block_dev *bd = bdev_get("ata0:0");
 
@@ -55,6 +61,9 @@ noreturn kernel_main(void)
 	kdprintf("remaining %x bytes (before)\n", palloc_get_remaining());
 
 	//kalloc_test_main();
+	//kalloc_bench_main();
+	//lock_bench_main();
+	//false_sharing_bench_main();
 	//fat_test_main(root_fs);
 	for (int i = 0; i < 1; i++)
 		exec_user_elf_program("/usr/bin/hello", "/dev/com2", "/dev/com1", "/dev/com1", (const char **)test_env);
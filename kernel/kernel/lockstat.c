@@ -0,0 +1,297 @@
+/* lockstat.c - lock contention statistics */
+#include <kernel/cdefs.h>
+#include <kernel/cpu.h>
+#include <kernel/debug.h>
+#include <kernel/heap.h>
+#include <kernel/lockstat.h>
+#include <kernel/printf.h>
+#include <kernel/utils.h>
+#include <kernel/fs/devfs.h>
+
+struct lockstat_class
+{
+	int kind; /* enum lockstat_kind */
+	const char *name; /* Spinlock name, if kind == LOCKSTAT_SPINLOCK. */
+	const char *file; /* Creation file, for other kinds. */
+	unsigned int line; /* Creation line, for other kinds. */
+};
+
+struct lockstat_counters
+{
+	uint64_t acquired; /* Number of acquisitions. */
+	uint64_t contended; /* Number of acquisitions that had to wait. */
+	uint64_t wait_total; /* Total cycles spent waiting. */
+	uint64_t wait_max; /* Longest wait. */
+	uint64_t hold_max; /* Longest hold. */
+};
+
+/* Each CPU updates its own counters, with interrupts disabled and without a lock, so locks of the
+   same class taken on different CPUs do not share a cache line. Dumps and resets run on another
+   CPU, so they can catch a counter in the middle of an update. That is fine for statistics. */
+struct lockstat_cpu
+{
+	struct lockstat_counters counters[LOCKSTAT_MAX_CLASSES];
+} __cacheline_aligned;
+
+/* Classes are never removed, so they can be read without the table lock once they're counted. */
+static struct lockstat_class classes[LOCKSTAT_MAX_CLASSES];
+static atomic_uint nof_classes;
+static atomic_flag classes_lock = ATOMIC_FLAG_INIT;
+
+static struct lockstat_cpu cpus[MAX_CPUS];
+
+static struct devfs_node lockstat_devfs_node;
+
+/* The class locks are plain flags, as spinlocks would record statistics themselves. */
+static inline void flag_lock(atomic_flag *flag)
+{
+	while (atomic_flag_test_and_set(flag))
+		cpu_relax();
+}
+
+static inline void flag_unlock(atomic_flag *flag)
+{
+	atomic_flag_clear(flag);
+}
+
+static bool class_matches(struct lockstat_class *cls, int kind, const char *name, const char *file,
+	unsigned int line)
+{
+	if (cls->kind != kind)
+		return false;
+
+	if (kind == LOCKSTAT_SPINLOCK)
+		return kstrcmp(cls->name, name);
+
+	return cls->line == line && kstrcmp(cls->file, file);
+}
+
+static struct lockstat_class *get_class(int kind, const char *name, const char *file,
+	unsigned int line)
+{
+	struct lockstat_class *cls = NULL;
+	uint n;
+
+	push_no_interrupts();
+	flag_lock(&classes_lock);
+
+	n = atomic_load(&nof_classes);
+
+	for (uint i = 0; i < n; i++)
+	{
+		if (class_matches(&classes[i], kind, name, file, line))
+		{
+			cls = &classes[i];
+			goto out;
+		}
+	}
+
+	if (n == LOCKSTAT_MAX_CLASSES)
+		goto out;
+
+	cls = &classes[n];
+	cls->kind = kind;
+	cls->name = name;
+	cls->file = file;
+	cls->line = line;
+	atomic_store(&nof_classes, n + 1);
+
+out:
+	flag_unlock(&classes_lock);
+	pop_no_interrupts();
+
+	return cls;
+}
+
+/* Gets the class of a spinlock with the given name, creating it if needed. Returns NULL if the
+   name is NULL or the class table is full, in which case the lock is not tracked. */
+struct lockstat_class *lockstat_get_spinlock_class(const char *name)
+{
+	uint n = atomic_load(&nof_classes);
+
+	if (name == NULL)
+		return NULL;
+
+	/* Spinlocks are named with string literals, so the name is usually the very same pointer.
+	   Look for it without the table lock first, as locks are created all the time. */
+	for (uint i = 0; i < n; i++)
+	{
+		if (classes[i].kind == LOCKSTAT_SPINLOCK && classes[i].name == name)
+			return &classes[i];
+	}
+
+	return get_class(LOCKSTAT_SPINLOCK, name, NULL, 0);
+}
+
+/* Gets the class of a mutex or rwlock created at the given source line, creating it if needed. */
+struct lockstat_class *lockstat_get_creation_class(int kind, const char *file, unsigned int line)
+{
+	kassert(kind != LOCKSTAT_SPINLOCK);
+
+	if (file == NULL)
+		return NULL;
+
+	return get_class(kind, NULL, file, line);
+}
+
+static inline struct lockstat_counters *get_counters(struct lockstat_class *cls, uint cpu)
+{
+	kassert(cpu < MAX_CPUS);
+	return &(cpus[cpu].counters[cls - classes]);
+}
+
+/* Records an acquisition on the given CPU that waited the given number of cycles. Call on that CPU
+   with interrupts disabled. */
+void lockstat_acquired(struct lockstat_class *cls, uint cpu, bool contended, uint64_t wait)
+{
+	struct lockstat_counters *c;
+
+	if (cls == NULL)
+		return;
+
+	c = get_counters(cls, cpu);
+	c->acquired++;
+
+	if (contended)
+	{
+		c->contended++;
+		c->wait_total += wait;
+
+		if (wait > c->wait_max)
+			c->wait_max = wait;
+	}
+}
+
+/* Records a release on the given CPU of a lock held for the given number of cycles. Call on that
+   CPU with interrupts disabled. */
+void lockstat_released(struct lockstat_class *cls, uint cpu, uint64_t hold)
+{
+	struct lockstat_counters *c;
+
+	if (cls == NULL)
+		return;
+
+	c = get_counters(cls, cpu);
+
+	if (hold > c->hold_max)
+		c->hold_max = hold;
+}
+
+/* Clears the statistics of all classes. */
+void lockstat_reset(void)
+{
+	for (uint cpu = 0; cpu < get_nof_cpus(); cpu++)
+		kmemset(&(cpus[cpu]), 0, sizeof(struct lockstat_cpu));
+}
+
+/* devfs interface */
+
+/* Maximum length of one line of the dump. */
+#define LOCKSTAT_LINE_SIZE 256
+
+/* Dump line of a class, with the given class description. */
+#define LOCKSTAT_FORMAT(class) \
+	class ": %s acquired, %s contended, %s wait, %s max wait, %s max hold\n"
+
+/* Formats a 64-bit number. The printf implementation only handles 32-bit ones. */
+static const char *format_u64(char *buf, uint64_t v)
+{
+	char *p = buf + 20;
+
+	*p = '\0';
+
+	do
+	{
+		*(--p) = '0' + v % 10;
+		v /= 10;
+	} while (v > 0);
+
+	return p;
+}
+
+static int format_class(char *dest, int len, struct lockstat_class *cls)
+{
+	struct lockstat_counters sum, *c;
+	char acquired[21], contended[21], wait_total[21], wait_max[21], hold_max[21];
+
+	/* Add up the counters of all CPUs. */
+	kmemset(&sum, 0, sizeof(struct lockstat_counters));
+
+	for (uint cpu = 0; cpu < get_nof_cpus(); cpu++)
+	{
+		c = get_counters(cls, cpu);
+		sum.acquired += c->acquired;
+		sum.contended += c->contended;
+		sum.wait_total += c->wait_total;
+		sum.wait_max = kmax(sum.wait_max, c->wait_max);
+		sum.hold_max = kmax(sum.hold_max, c->hold_max);
+	}
+
+	if (cls->kind == LOCKSTAT_SPINLOCK)
+		return ksnprintf(dest, len, LOCKSTAT_FORMAT("spinlock %s"), cls->name,
+			format_u64(acquired, sum.acquired), format_u64(contended, sum.contended),
+			format_u64(wait_total, sum.wait_total), format_u64(wait_max, sum.wait_max),
+			format_u64(hold_max, sum.hold_max));
+
+	return ksnprintf(dest, len, LOCKSTAT_FORMAT("%s %s:%u"),
+		cls->kind == LOCKSTAT_MUTEX ? "mutex" : "rwlock", cls->file, cls->line,
+		format_u64(acquired, sum.acquired), format_u64(contended, sum.contended),
+		format_u64(wait_total, sum.wait_total), format_u64(wait_max, sum.wait_max),
+		format_u64(hold_max, sum.hold_max));
+}
+
+static foffset_t lockstat_devfs_get_size(__unused struct devfs_node *node)
+{
+	return 0;
+}
+
+/* Renders the whole dump and copies the requested part of it. */
+static int lockstat_devfs_read(__unused struct devfs_node *node, void *buf, uint off, int num)
+{
+	char *text;
+	uint n = atomic_load(&nof_classes);
+	uint size = 0;
+	int ret = 0;
+
+	text = kalloc(HEAP_NORMAL, 1, n * LOCKSTAT_LINE_SIZE);
+
+	/* Lines that do not fit are left out. */
+	for (uint i = 0; i < n; i++)
+	{
+		ret = format_class(text + size, LOCKSTAT_LINE_SIZE, &classes[i]);
+
+		if (ret > 0)
+			size += ret;
+	}
+
+	ret = 0;
+
+	if (off < size)
+	{
+		ret = kmin((int)(size - off), num);
+		kmemcpy(buf, text + off, ret);
+	}
+
+	kfree(text);
+
+	return ret;
+}
+
+static int lockstat_devfs_write(__unused struct devfs_node *node, __unused const void *buf,
+	__unused uint off, int num)
+{
+	lockstat_reset();
+	return num;
+}
+
+/* Publishes the statistics as /dev/lockstat. Reading dumps them, writing anything resets them. */
+void init_lockstat(void)
+{
+	kstrncpy(lockstat_devfs_node.name, "lockstat", sizeof(lockstat_devfs_node.name) - 1);
+	lockstat_devfs_node.opaque = NULL;
+	lockstat_devfs_node.get_size = lockstat_devfs_get_size;
+	lockstat_devfs_node.read = lockstat_devfs_read;
+	lockstat_devfs_node.write = lockstat_devfs_write;
+
+	devfs_register_node(&lockstat_devfs_node, VFS_NODE_BIT_READABLE | VFS_NODE_BIT_WRITEABLE);
+}
@@ -4,6 +4,7 @@
 #include <kernel/scheduler.h>
 
 #include <user/yaos2/kernel/errno.h>
+#include <user/yaos2/kernel/sched.h>
 
 /* Exits the process. */
 noreturn syscall_exit(int status)
@@ -48,3 +49,38 @@ pid_t syscall_getpid(void)
 {
 	return get_current_proc()->pid;
 }
+
+int syscall_sched_set(int policy, int priority)
+{
+	/* The real-time policy is reserved for kernel threads. */
+	if (policy == SCHED_RT)
+		return -EPERM;
+
+	return sched_set_policy(get_current_thread(), policy, priority);
+}
+
+int syscall_sched_get(uvaddr_t policy, uvaddr_t priority)
+{
+	int kpolicy, kpriority;
+
+	sched_get_policy(get_current_thread(), &kpolicy, &kpriority);
+
+	/* Write to user space. TODO: Make sure it is accessible. */
+	*((int *)policy) = kpolicy;
+	*((int *)priority) = kpriority;
+
+	return 0;
+}
+
+int syscall_sched_setaffinity(unsigned int mask)
+{
+	return sched_set_affinity(get_current_thread(), mask);
+}
+
+int syscall_sched_getaffinity(uvaddr_t mask)
+{
+	/* Write to user space. TODO: Make sure it is accessible. */
+	*((unsigned int *)mask) = sched_get_affinity(get_current_thread());
+
+	return 0;
+}
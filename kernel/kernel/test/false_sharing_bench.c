@@ -0,0 +1,97 @@
+/* kernel/test/false_sharing_bench.c - microbenchmark of per-CPU data sharing cache lines */
+#include <kernel/cdefs.h>
+#include <kernel/cpu.h>
+#include <kernel/debug.h>
+#include <kernel/scheduler.h>
+#include <kernel/thread.h>
+#include <kernel/utils.h>
+
+#define BENCH_ITERATIONS 1000000
+
+/* Most CPUs taking part. */
+#define BENCH_MAX_THREADS 8
+
+/* Counters next to each other, the way per-CPU fields were laid out before they got lines of their
+   own. */
+static atomic_uint packed_counters[BENCH_MAX_THREADS];
+
+/* Counters with a cache line each. */
+struct padded_counter
+{
+	atomic_uint value;
+} __cacheline_aligned;
+
+static struct padded_counter padded_counters[BENCH_MAX_THREADS];
+
+static atomic_uint *bench_counters[BENCH_MAX_THREADS];
+static uint64_t bench_cycles[BENCH_MAX_THREADS];
+static uint bench_nof_threads;
+static atomic_bool bench_start;
+static atomic_uint bench_done;
+
+/* Bumps the counter of this thread, and nothing else, once all the threads are running. */
+static void bench_thread(void *arg)
+{
+	uint num = (uint)arg;
+	atomic_uint *counter = bench_counters[num];
+	uint64_t start;
+
+	while (!atomic_load(&bench_start))
+		cpu_relax();
+
+	start = cpu_timestamp();
+
+	for (uint i = 0; i < BENCH_ITERATIONS; i++)
+		atomic_fetch_add(counter, 1);
+
+	bench_cycles[num] = cpu_timestamp() - start;
+	atomic_fetch_add(&bench_done, 1);
+}
+
+/* Runs one thread pinned to each CPU and prints the average cycles per increment. */
+static void bench_run(const char *name)
+{
+	struct thread *thread;
+	uint64_t total = 0;
+
+	atomic_store(&bench_start, false);
+	atomic_store(&bench_done, 0);
+
+	for (uint i = 0; i < bench_nof_threads; i++)
+	{
+		thread = kthread_create(bench_thread, (void *)i, "false sharing bench");
+		sched_set_affinity(thread, cpu_mask_bit(i));
+		schedule_thread(PID_KERNEL, thread);
+	}
+
+	atomic_store(&bench_start, true);
+
+	while (atomic_load(&bench_done) < bench_nof_threads)
+		thread_sleep(100);
+
+	for (uint i = 0; i < bench_nof_threads; i++)
+		total += bench_cycles[i];
+
+	kdprintf("%s: %u cycles per increment on %u CPUs\n", name,
+		(uint)(total / ((uint64_t)bench_nof_threads * BENCH_ITERATIONS)), bench_nof_threads);
+}
+
+noreturn false_sharing_bench_main(void)
+{
+	bench_nof_threads = kmin(get_nof_cpus(), (uint)BENCH_MAX_THREADS);
+
+	for (uint i = 0; i < bench_nof_threads; i++)
+		bench_counters[i] = &packed_counters[i];
+
+	bench_run("shared cache line");
+
+	for (uint i = 0; i < bench_nof_threads; i++)
+		bench_counters[i] = &(padded_counters[i].value);
+
+	bench_run("cache line per CPU");
+
+	kdprintf("false sharing bench: done\n");
+
+	while (1)
+		thread_sleep(1000);
+}
@@ -0,0 +1,110 @@
+/* kernel/test/kalloc_bench.c - multi-CPU throughput benchmark of small kernel heap allocations */
+#include <kernel/cdefs.h>
+#include <kernel/cpu.h>
+#include <kernel/debug.h>
+#include <kernel/heap.h>
+#include <kernel/scheduler.h>
+#include <kernel/slab.h>
+#include <kernel/thread.h>
+#include <kernel/utils.h>
+
+#define BENCH_ROUNDS 10000
+
+/* Objects each thread holds at once in a round. More than a magazine, so that refills and drains
+   are part of the measurement. */
+#define BENCH_OBJECTS 32
+
+#define BENCH_OBJECT_SIZE 64
+
+/* Most CPUs taking part. */
+#define BENCH_MAX_THREADS 8
+
+/* Cache used without magazines, so that every allocation and free takes its lock. */
+static struct kmem_cache bench_cache;
+
+static bool bench_use_kalloc;
+static uint64_t bench_cycles[BENCH_MAX_THREADS];
+static uint bench_nof_threads;
+static atomic_bool bench_start;
+static atomic_uint bench_done;
+
+/* Allocates and frees BENCH_OBJECTS objects per round, once all the threads are running. */
+static void bench_thread(void *arg)
+{
+	uint num = (uint)arg;
+	vaddr_t objs[BENCH_OBJECTS];
+	uint64_t start;
+
+	while (!atomic_load(&bench_start))
+		cpu_relax();
+
+	start = cpu_timestamp();
+
+	for (uint r = 0; r < BENCH_ROUNDS; r++)
+	{
+		for (uint i = 0; i < BENCH_OBJECTS; i++)
+		{
+			if (bench_use_kalloc)
+				objs[i] = kalloc(HEAP_NORMAL, HEAP_NO_ALIGN, BENCH_OBJECT_SIZE);
+			else
+				objs[i] = kmem_cache_alloc(&bench_cache);
+		}
+
+		for (uint i = 0; i < BENCH_OBJECTS; i++)
+		{
+			if (bench_use_kalloc)
+				kfree(objs[i]);
+			else
+				kmem_cache_free(&bench_cache, objs[i]);
+		}
+	}
+
+	bench_cycles[num] = cpu_timestamp() - start;
+	atomic_fetch_add(&bench_done, 1);
+}
+
+/* Runs one thread pinned to each CPU and prints the average cycles per allocation and free. */
+static void bench_run(const char *name)
+{
+	struct thread *thread;
+	uint64_t total = 0;
+
+	atomic_store(&bench_start, false);
+	atomic_store(&bench_done, 0);
+
+	for (uint i = 0; i < bench_nof_threads; i++)
+	{
+		thread = kthread_create(bench_thread, (void *)i, "kalloc bench");
+		sched_set_affinity(thread, cpu_mask_bit(i));
+		schedule_thread(PID_KERNEL, thread);
+	}
+
+	atomic_store(&bench_start, true);
+
+	while (atomic_load(&bench_done) < bench_nof_threads)
+		thread_sleep(100);
+
+	for (uint i = 0; i < bench_nof_threads; i++)
+		total += bench_cycles[i];
+
+	kdprintf("%s: %u cycles per allocation and free on %u CPUs\n", name,
+		(uint)(total / ((uint64_t)bench_nof_threads * BENCH_ROUNDS * BENCH_OBJECTS)),
+		bench_nof_threads);
+}
+
+noreturn kalloc_bench_main(void)
+{
+	bench_nof_threads = kmin(get_nof_cpus(), (uint)BENCH_MAX_THREADS);
+	kmem_cache_create(&bench_cache, "kalloc bench", BENCH_OBJECT_SIZE, BENCH_OBJECT_SIZE);
+
+	bench_use_kalloc = false;
+	bench_run("cache lock per object");
+
+	bench_use_kalloc = true;
+	bench_run("kalloc with per-CPU magazines");
+
+	kdprintf("kalloc bench: done\n");
+
+	while (1)
+		thread_sleep(1000);
+}
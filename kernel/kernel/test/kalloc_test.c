@@ -80,7 +80,7 @@ noreturn kalloc_test_main(void)
 	for (int i = 0; i < 100; i++)
 	{
 		kdprintf("A");
-		/* Test to see if paging_propagate_changes works. */
+		/* Test to see if TLB shootdowns work. */
 		kalloc(HEAP_NORMAL, HEAP_NO_ALIGN, 4096);
 		thread_sleep(1000);
 	}
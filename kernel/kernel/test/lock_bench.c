@@ -0,0 +1,124 @@
+/* kernel/test/lock_bench.c - microbenchmarks of the locking primitives */
+#include <kernel/cdefs.h>
+#include <kernel/cpu.h>
+#include <kernel/debug.h>
+#include <kernel/scheduler.h>
+#include <kernel/thread.h>
+#include <arch/cpu.h>
+
+#define BENCH_ITERATIONS 1000000
+
+/* Iterations of each thread in the contended benchmarks. */
+#define BENCH_CONTENDED_ITERATIONS 100000
+
+static struct cpu_spinlock bench_lock;
+static atomic_uint bench_done;
+
+/* Runs the given function BENCH_ITERATIONS times and prints the average cycles per iteration. */
+static void bench_run(const char *name, void (*fn)(void))
+{
+	uint64_t start, end;
+
+	/* Timer interrupts would be charged to whichever iteration they hit. */
+	push_no_interrupts();
+	start = cpu_timestamp();
+
+	for (uint i = 0; i < BENCH_ITERATIONS; i++)
+		fn();
+
+	end = cpu_timestamp();
+	pop_no_interrupts();
+
+	kdprintf("%s: %u cycles per iteration\n", name, (uint)((end - start) / BENCH_ITERATIONS));
+}
+
+/* The current CPU through the per-CPU segment. */
+static void bench_cpu_current(void)
+{
+	volatile struct x86_cpu *cpu = cpu_current();
+	(void)cpu;
+}
+
+/* The current CPU through the LAPIC ID lookup, which is what cpu_current_early() does before
+   init_gdt(). */
+static void bench_cpu_lookup_current(void)
+{
+	volatile struct x86_cpu *cpu = cpu_lookup_current();
+	(void)cpu;
+}
+
+static void bench_current_thread(void)
+{
+	get_current_thread();
+}
+
+static void bench_preempt(void)
+{
+	preempt_disable();
+	preempt_enable();
+}
+
+static void bench_spinlock(void)
+{
+	cpu_spinlock_acquire(&bench_lock);
+	cpu_spinlock_release(&bench_lock);
+}
+
+/* Hammers the lock and prints the average cycles per iteration of this thread. With a fair lock,
+   all threads get about the same figure. */
+static void bench_contended(void *arg)
+{
+	const char *name = arg;
+	uint64_t start, end;
+
+	start = cpu_timestamp();
+
+	for (uint i = 0; i < BENCH_CONTENDED_ITERATIONS; i++)
+		bench_spinlock();
+
+	end = cpu_timestamp();
+
+	kdprintf("contended %s: %u cycles per iteration\n", name,
+		(uint)((end - start) / BENCH_CONTENDED_ITERATIONS));
+	atomic_fetch_add(&bench_done, 1);
+}
+
+/* Runs one thread for each CPU, all hammering the same lock of the given type. */
+static void bench_contended_type(const char *name, int type)
+{
+	cpu_spinlock_create_type(&bench_lock, "lock bench", type);
+	atomic_store(&bench_done, 0);
+
+	for (uint i = 0; i < get_nof_cpus(); i++)
+		schedule_kernel_thread(bench_contended, (void *)name, "lock bench");
+
+	while (atomic_load(&bench_done) < get_nof_cpus())
+		thread_sleep(100);
+}
+
+noreturn lock_bench_main(void)
+{
+	cpu_spinlock_create(&bench_lock, "lock bench");
+	atomic_init(&bench_done, 0);
+
+	bench_run("cpu_current", bench_cpu_current);
+	bench_run("cpu_lookup_current", bench_cpu_lookup_current);
+	bench_run("get_current_thread", bench_current_thread);
+	bench_run("preempt_disable/enable", bench_preempt);
+	bench_run("uncontended cpu_spinlock", bench_spinlock);
+
+	cpu_spinlock_create_type(&bench_lock, "lock bench", CPU_SPINLOCK_TICKET);
+	bench_run("uncontended ticket spinlock", bench_spinlock);
+
+	cpu_spinlock_create_type(&bench_lock, "lock bench", CPU_SPINLOCK_MCS);
+	bench_run("uncontended MCS spinlock", bench_spinlock);
+
+	bench_contended_type("test-and-set spinlock", CPU_SPINLOCK_TAS);
+	bench_contended_type("ticket spinlock", CPU_SPINLOCK_TICKET);
+	bench_contended_type("MCS spinlock", CPU_SPINLOCK_MCS);
+
+	kdprintf("lock bench: done\n");
+
+	while (1)
+		thread_sleep(1000);
+}
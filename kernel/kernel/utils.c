@@ -8,7 +8,7 @@ bool kstrcmp(const char *p1, const char *p2)
 	size_t l1, l2;
 
 	l1 = kstrlen(p1);
-	l2 = kstrlen(p1);
+	l2 = kstrlen(p2);
 
 	if (l1 != l2)
 		return false;
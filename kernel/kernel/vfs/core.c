@@ -3,6 +3,8 @@
 #include <kernel/debug.h>
 #include <kernel/heap.h>
 #include <kernel/queue.h>
+#include <kernel/rcu.h>
+#include <kernel/slab.h>
 #include <kernel/thread.h>
 #include <kernel/utils.h>
 #include <kernel/vfs.h>
@@ -20,16 +22,33 @@ struct vfs_mount
 
 LIST_HEAD(vfs_mount_list, vfs_mount);
 
+/* The mount list is read under RCU. Mounting takes the mutex. Mounts are never freed, as unmounting
+   is not implemented, so lookups can use a mount after leaving the read-side section. */
 static struct thread_mutex vfs_mount_mutex;
 static struct vfs_mount_list vfs_mounts;
 
+static struct kmem_cache vfs_node_cache;
+
 /* Initializes the virtual filesystem. The super node provided in argument will be available at /.*/
 void vfs_init(void)
 {
 	thread_mutex_create(&vfs_mount_mutex);
+	kmem_cache_create(&vfs_node_cache, "vfs node", sizeof(struct vfs_node), sizeof(void *));
 	vfs_file_init();
 }
 
+/* Allocates an uninitialized node for a filesystem driver. */
+struct vfs_node *vfs_node_alloc(void)
+{
+	return kmem_cache_alloc(&vfs_node_cache);
+}
+
+/* Frees a node allocated with vfs_node_alloc(). */
+void vfs_node_free(struct vfs_node *node)
+{
+	kmem_cache_free(&vfs_node_cache, node);
+}
+
 void vfs_mount(const char *path, struct vfs_super *super_node)
 {
 	struct vfs_mount *mount;
@@ -57,7 +76,7 @@ void vfs_mount(const char *path, struct vfs_super *super_node)
 	kstrcpy(mount->path, path);
 	mount->super_node = super_node;
 
-	LIST_INSERT_HEAD(&vfs_mounts, mount, lptrs);
+	RCU_LIST_INSERT_HEAD(&vfs_mounts, mount, lptrs);
 
 	thread_mutex_release(&vfs_mount_mutex);
 }
@@ -78,10 +97,11 @@ struct vfs_node *vfs_get(const char *path)
 
 	path_len = kstrlen(path);
 
-	/* TODO: Replace this with an R/W lock to speed things up! */
-	thread_mutex_acquire(&vfs_mount_mutex);
+	/* Find the mount point without taking any locks. The filesystem lookup may sleep, so it is
+	   done outside of the read-side section. */
+	rcu_read_lock();
 
-	LIST_FOREACH(mount, &vfs_mounts, lptrs)
+	RCU_LIST_FOREACH(mount, &vfs_mounts, lptrs)
 	{
 		mount_path_len = kstrlen(mount->path);
 		min_len = kmin(mount_path_len, path_len);
@@ -93,20 +113,24 @@ struct vfs_node *vfs_get(const char *path)
 		/* Make sure the path looks like this: /mount_point or /mount_point/ */
 		last_char = path[min_len];
 
-		if (last_char == 0)
-		{
-			/* We're looking for the root of the mount point. */
-			node = mount->super_node->get_root(mount->super_node);
+		if (last_char == 0 || last_char == VFS_SEPARATOR)
 			break;
-		}
-		else if (last_char == VFS_SEPARATOR)
-		{
-			node = mount->super_node->get_by_path(mount->super_node, path + min_len);
-			break;
-		}
 	}
 
-	thread_mutex_release(&vfs_mount_mutex);
+	rcu_read_unlock();
+
+	if (mount == NULL)
+		return NULL;
+
+	if (last_char == 0)
+	{
+		/* We're looking for the root of the mount point. */
+		node = mount->super_node->get_root(mount->super_node);
+	}
+	else
+	{
+		node = mount->super_node->get_by_path(mount->super_node, path + min_len);
+	}
 
 	return node;
 }
@@ -1,6 +1,7 @@
 /* kernel/vfs/file.c - VFS file interface */
 #include <kernel/cdefs.h>
 #include <kernel/heap.h>
+#include <kernel/slab.h>
 #include <kernel/thread.h>
 #include <kernel/vfs.h>
 
@@ -10,11 +11,14 @@ static struct thread_mutex vfs_file_list_mutex;
 
 static struct file_list vfs_file_list;
 
+static struct kmem_cache file_cache;
+
 /* Init file susbsystem. */
 void vfs_file_init(void)
 {
 	thread_mutex_create(&vfs_file_list_mutex);
 	LIST_INIT(&vfs_file_list);
+	kmem_cache_create(&file_cache, "file", sizeof(struct file), sizeof(void *));
 }
 
 /* Opens a new file object using the path. Returns null if not found. */
@@ -31,7 +35,7 @@ struct file *vfs_open(const char *path)
 	thread_mutex_acquire(&vfs_file_list_mutex);
 
 	/* Create a new file object. */
-	file = kualloc(HEAP_NORMAL, sizeof(struct file));
+	file = kmem_cache_alloc(&file_cache);
 
 	/* Fill out the data. */
 	file->node = node;
@@ -90,6 +94,6 @@ void vfs_close(struct file *f)
 		thread_mutex_release(&vfs_file_list_mutex);
 
 		vfs_put(f->node);
-		kfree(f);
+		kmem_cache_free(&file_cache, f);
 	}
 }
@@ -2,6 +2,7 @@
 #define _UNISTD_H_
 
 #include <yaos2/kernel/defs.h>
+#include <yaos2/kernel/sched.h>
 
 #include <sys/types.h>
 #include <stddef.h>
@@ -14,6 +15,11 @@ pid_t wait(int *status);
 pid_t fork(void);
 pid_t getpid(void);
 
+int sched_setpolicy(int policy, int priority);
+int sched_getpolicy(int *policy, int *priority);
+int sched_setaffinity(unsigned int mask);
+int sched_getaffinity(unsigned int *mask);
+
 int brk(void *ptr);
 void *sbrk(int increment);
 
@@ -38,6 +38,30 @@ pid_t getpid(void)
 	return set_errno_and_convert(ret);
 }
 
+int sched_setpolicy(int policy, int priority)
+{
+	int ret = syscall2(SYSCALL_SCHED_SET, policy, priority);
+	return set_errno_and_convert(ret);
+}
+
+int sched_getpolicy(int *policy, int *priority)
+{
+	int ret = syscall2(SYSCALL_SCHED_GET, (int)policy, (int)priority);
+	return set_errno_and_convert(ret);
+}
+
+int sched_setaffinity(unsigned int mask)
+{
+	int ret = syscall1(SYSCALL_SCHED_SETAFFINITY, (int)mask);
+	return set_errno_and_convert(ret);
+}
+
+int sched_getaffinity(unsigned int *mask)
+{
+	int ret = syscall1(SYSCALL_SCHED_GETAFFINITY, (int)mask);
+	return set_errno_and_convert(ret);
+}
+
 int brk(void *ptr)
 {
 	int ret = syscall1(SYSCALL_BRK, (int)ptr);